@@ -97,8 +97,12 @@ void bokeh_keyboardcb(GLFWwindow *window, int key, int scancode, int action, int
             canvas->_raytracing.stop_threaded_raytrace();
           }
           canvas->_raytracing.reset();
-        } else if (!canvas->_progressive_raytracing) {
-          canvas->_raytracing.start_threaded_raytrace();
+        } else {
+          canvas->_scene.refresh_bvh();
+          canvas->_scene.refresh_camera();
+          if (!canvas->_progressive_raytracing) {
+            canvas->_raytracing.start_threaded_raytrace();
+          }
         }
 
         canvas->_draw_raytracing = !canvas->_draw_raytracing;
@@ -109,6 +113,13 @@ void bokeh_keyboardcb(GLFWwindow *window, int key, int scancode, int action, int
         break;
 
       case GLFW_KEY_T:
+        // While ray tracing nothing can move, and the BVH and camera snapshot
+        // from when it started are current; they must not be replaced under
+        // the workers
+        if (!canvas->_draw_raytracing) {
+          canvas->_scene.refresh_bvh();
+          canvas->_scene.refresh_camera();
+        }
         canvas->_scene.visualize_raytree(canvas->_mouse.x, canvas->_mouse.y);
         break;
     }
@@ -135,6 +146,16 @@ BokehCanvas::BokehCanvas(const BokehCanvasConf &conf)
   _scene.set_shadow_samples(conf.shadow_samples);
   _scene.set_lens_samples(conf.antialias_samples);
   _scene.set_ray_bounces(conf.num_bounces);
+  _scene.set_resolution(conf.width, conf.height);
+
+  // As for --output renders, but without -a the image is refined until the
+  // trace is stopped (or, with a noise threshold, converges)
+  if (conf.noise_threshold > 0) {
+    _raytracing.set_noise_threshold(conf.noise_threshold);
+    _raytracing.set_sample_budget(conf.antialias_samples);
+  } else {
+    _raytracing.set_max_passes(conf.antialias_samples);
+  }
 }
 
 void BokehCanvas::update() {
@@ -30,7 +30,9 @@ struct MouseInfo {
 struct BokehCanvasConf {
   unsigned width, height;
   unsigned shadow_samples;
-  unsigned antialias_samples;
+  unsigned antialias_samples; // 0 if not given
+  float noise_threshold; // 0 to sample every pixel the same
+  bool lens_fit; // trace lens cameras through a fitted table
   unsigned num_bounces;
   bool progressive;
   std::string scnfile;
@@ -40,6 +42,7 @@ class BokehCanvas : public Canvas {
   public:
     BokehCanvas(const BokehCanvasConf &conf);
     const MouseInfo &mouse() const { return _mouse; }
+    Scene &scene() { return _scene; }
 
   protected:
     void update();
@@ -0,0 +1,360 @@
+#include "bvh.h"
+
+#include <algorithm>
+
+#include "mesh.h"
+#include "primitive.h"
+#include "raytracing.h"
+
+struct CompItemsByAxis {
+  int axis;
+
+  bool operator()(const BVH::item &a, const BVH::item &b) const {
+    return a.bbox.center()[axis] < b.bbox.center()[axis];
+  }
+};
+
+std::vector<BVH::item> BVH::collect_items(const std::vector<MeshInstance> &instances,
+    const std::vector<Primitive*> &primitives)
+{
+  std::vector<item> items;
+
+  for (unsigned i = 0; i < instances.size(); ++i) {
+    const MeshInstance *mi = &instances[i];
+    items.push_back(item { mi, NULL, mi->mesh()->kd_tree().bbox().transformed(mi->modelmat()) });
+  }
+
+  for (unsigned i = 0; i < primitives.size(); ++i) {
+    items.push_back(item { NULL, primitives[i], primitives[i]->bbox() });
+  }
+
+  return items;
+}
+
+void BVH::build(const std::vector<MeshInstance> &instances,
+    const std::vector<Primitive*> &primitives)
+{
+  build(collect_items(instances, primitives));
+}
+
+bool BVH::refresh(const std::vector<MeshInstance> &instances,
+    const std::vector<Primitive*> &primitives)
+{
+  std::vector<item> items = collect_items(instances, primitives);
+
+  bool changed = items.size() != _items.size();
+  for (unsigned i = 0; i < items.size() && !changed; ++i) {
+    // Items are reordered during the build, so look them up by object
+    bool found = false;
+    for (unsigned j = 0; j < _items.size(); ++j) {
+      if (_items[j].instance == items[i].instance && _items[j].primitive == items[i].primitive) {
+        found = _items[j].bbox.min() == items[i].bbox.min()
+          && _items[j].bbox.max() == items[i].bbox.max();
+        break;
+      }
+    }
+    changed = !found;
+  }
+
+  if (changed) {
+    build(std::move(items));
+  }
+
+  return changed;
+}
+
+// Entries of a traversal stack: collapsing the binary tree keeps the depth below
+// BVH_MAX_DEPTH, and each node visited pushes at most BBOX4_WIDTH - 1 more
+// entries than it pops.
+#define BVH_STACK_SIZE ((BBOX4_WIDTH - 1) * BVH_MAX_DEPTH + 1)
+
+void BVH::build(std::vector<item> &&items) {
+  _items = std::move(items);
+  _nodes.clear();
+
+  if (!_items.empty()) {
+    std::vector<binary_node> nodes;
+    build_node(nodes, 0, _items.size(), 0);
+    collapse(nodes, 0);
+  }
+}
+
+void BVH::build_node(std::vector<binary_node> &nodes, unsigned begin, unsigned end,
+    unsigned depth)
+{
+  glm::vec3 min(HUGE_VALF), max(-HUGE_VALF);
+  glm::vec3 cmin(HUGE_VALF), cmax(-HUGE_VALF);
+  for (unsigned i = begin; i < end; ++i) {
+    min = glm::min(min, _items[i].bbox.min());
+    max = glm::max(max, _items[i].bbox.max());
+    cmin = glm::min(cmin, _items[i].bbox.center());
+    cmax = glm::max(cmax, _items[i].bbox.center());
+  }
+
+  uint32_t idx = nodes.size();
+  nodes.push_back(binary_node { BBox(min, max), begin, uint16_t(end - begin) });
+
+  glm::vec3 extent = cmax - cmin;
+  int axis = 0;
+  if (extent.y > extent[axis]) {
+    axis = 1;
+  }
+  if (extent.z > extent[axis]) {
+    axis = 2;
+  }
+
+  if (end - begin <= BVH_MAX_LEAF_ITEMS || extent[axis] <= 0.0f || depth + 1 >= BVH_MAX_DEPTH) {
+    return;
+  }
+
+  // Split at the median centroid along the axis of greatest centroid spread
+  unsigned mid = (begin + end) / 2;
+  std::nth_element(_items.begin() + begin, _items.begin() + mid, _items.begin() + end,
+      CompItemsByAxis { axis });
+
+  build_node(nodes, begin, mid, depth + 1);
+  nodes[idx].offset = nodes.size();
+  nodes[idx].count = 0;
+  build_node(nodes, mid, end, depth + 1);
+}
+
+uint32_t BVH::collapse(const std::vector<binary_node> &nodes, uint32_t idx) {
+  // Gather the children of the binary node, then keep replacing the interior
+  // one with the largest surface area by its own children while lanes are left
+  uint32_t lanes[BBOX4_WIDTH];
+  unsigned size = 0;
+  if (nodes[idx].count > 0) {
+    lanes[size++] = idx;
+  } else {
+    lanes[size++] = idx + 1;
+    lanes[size++] = nodes[idx].offset;
+  }
+
+  while (size < BBOX4_WIDTH) {
+    int open = -1;
+    float open_area = 0.0f;
+    for (unsigned i = 0; i < size; ++i) {
+      const binary_node &b = nodes[lanes[i]];
+      if (b.count == 0 && (open < 0 || b.bbox.surface_area() > open_area)) {
+        open = i;
+        open_area = b.bbox.surface_area();
+      }
+    }
+
+    if (open < 0) {
+      break;
+    }
+
+    uint32_t b = lanes[open];
+    lanes[open] = b + 1;
+    lanes[size++] = nodes[b].offset;
+  }
+
+  uint32_t w = _nodes.size();
+  _nodes.push_back(node());
+  _nodes[w].size = size;
+
+  for (unsigned i = 0; i < BBOX4_WIDTH; ++i) {
+    if (i >= size) {
+      _nodes[w].bounds.clear(i);
+      _nodes[w].child[i] = 0;
+      _nodes[w].count[i] = 0;
+      continue;
+    }
+
+    const binary_node &b = nodes[lanes[i]];
+    _nodes[w].bounds.set(i, b.bbox);
+    _nodes[w].count[i] = b.count;
+    if (b.count > 0) {
+      _nodes[w].child[i] = b.offset;
+    } else {
+      // Not a reference: collapsing the child grows _nodes
+      uint32_t child = collapse(nodes, lanes[i]);
+      _nodes[w].child[i] = child;
+    }
+  }
+
+  return w;
+}
+
+bool BVH::intersect(RayHit &hit) const {
+  if (_nodes.empty()) {
+    return false;
+  }
+
+  SlabRay ray(hit.ray().origin(), hit.ray().direction());
+
+  struct entry {
+    uint32_t node;
+    float t_near;
+  } stack[BVH_STACK_SIZE];
+  unsigned stack_size = 0;
+  stack[stack_size++] = entry { 0, 0.0f };
+
+  bool updated = false;
+
+  while (stack_size > 0) {
+    entry e = stack[--stack_size];
+
+    // Skip nodes that a hit found since they were pushed lies in front of
+    float t_max = hit.intersected() ? hit.t() : HUGE_VALF;
+    if (e.t_near > t_max) {
+      continue;
+    }
+
+    const node &n = _nodes[e.node];
+    float t_near[BBOX4_WIDTH];
+    unsigned mask = n.bounds.clip_ray(ray, t_max, t_near);
+
+    // Order the children hit from near to far
+    unsigned order[BBOX4_WIDTH];
+    unsigned hits = 0;
+    for (unsigned i = 0; i < n.size; ++i) {
+      if (!(mask & (1u << i))) {
+        continue;
+      }
+      unsigned j = hits++;
+      for (; j > 0 && t_near[order[j - 1]] > t_near[i]; --j) {
+        order[j] = order[j - 1];
+      }
+      order[j] = i;
+    }
+
+    // Intersect leaves right away, then push the interior children far to near
+    // so the near ones are visited first
+    for (unsigned k = 0; k < hits; ++k) {
+      unsigned i = order[k];
+      if (n.count[i] == 0 || (hit.intersected() && t_near[i] > hit.t())) {
+        continue;
+      }
+      for (uint32_t j = n.child[i]; j < n.child[i] + n.count[i]; ++j) {
+        if (_items[j].instance) {
+          updated |= hit.intersect_mesh(*_items[j].instance);
+        } else {
+          updated |= _items[j].primitive->intersect(hit);
+        }
+      }
+    }
+
+    for (unsigned k = hits; k > 0; --k) {
+      unsigned i = order[k - 1];
+      if (n.count[i] == 0) {
+        assert(stack_size < BVH_STACK_SIZE);
+        stack[stack_size++] = entry { n.child[i], t_near[i] };
+      }
+    }
+  }
+
+  return updated;
+}
+
+void BVH::intersect(RayPacket &packet) const {
+  if (_nodes.empty()) {
+    return;
+  }
+
+  RayInterval iv = packet.interval();
+  if (!iv.coherent) {
+    for (unsigned i = 0; i < packet.size(); ++i) {
+      intersect(packet[i]);
+    }
+    return;
+  }
+
+  // Children are visited in order of their centers along the first ray
+  const glm::vec3 &dir = packet[0].ray().direction();
+
+  uint32_t stack[BVH_STACK_SIZE];
+  unsigned stack_size = 0;
+  stack[stack_size++] = 0;
+
+  while (stack_size > 0) {
+    const node &n = _nodes[stack[--stack_size]];
+
+    // A child can be skipped once every ray has a hit closer than it
+    float t_max = 0.0f;
+    for (unsigned i = 0; i < packet.size(); ++i) {
+      t_max = std::max(packet[i].intersected() ? packet[i].t() : HUGE_VALF, t_max);
+    }
+
+    unsigned order[BBOX4_WIDTH];
+    float dist[BBOX4_WIDTH];
+    unsigned hits = 0;
+    for (unsigned i = 0; i < n.size; ++i) {
+      BBox box = n.bounds.box(i);
+      if (!box.interval_intersects(iv, t_max)) {
+        continue;
+      }
+      dist[i] = glm::dot(box.center(), dir);
+      unsigned j = hits++;
+      for (; j > 0 && dist[order[j - 1]] > dist[i]; --j) {
+        order[j] = order[j - 1];
+      }
+      order[j] = i;
+    }
+
+    for (unsigned k = 0; k < hits; ++k) {
+      unsigned i = order[k];
+      if (n.count[i] == 0) {
+        continue;
+      }
+      for (uint32_t j = n.child[i]; j < n.child[i] + n.count[i]; ++j) {
+        if (_items[j].instance) {
+          packet.intersect_mesh(*_items[j].instance);
+        } else {
+          for (unsigned r = 0; r < packet.size(); ++r) {
+            _items[j].primitive->intersect(packet[r]);
+          }
+        }
+      }
+    }
+
+    for (unsigned k = hits; k > 0; --k) {
+      unsigned i = order[k - 1];
+      if (n.count[i] == 0) {
+        assert(stack_size < BVH_STACK_SIZE);
+        stack[stack_size++] = n.child[i];
+      }
+    }
+  }
+}
+
+bool BVH::occluded(const Ray &ray, float t_max) const {
+  if (_nodes.empty()) {
+    return false;
+  }
+
+  SlabRay slab_ray(ray.origin(), ray.direction());
+
+  uint32_t stack[BVH_STACK_SIZE];
+  unsigned stack_size = 0;
+  stack[stack_size++] = 0;
+
+  while (stack_size > 0) {
+    const node &n = _nodes[stack[--stack_size]];
+
+    float t_near[BBOX4_WIDTH];
+    unsigned mask = n.bounds.clip_ray(slab_ray, t_max, t_near);
+
+    for (unsigned i = 0; i < n.size; ++i) {
+      if (!(mask & (1u << i))) {
+        continue;
+      }
+
+      if (n.count[i] == 0) {
+        assert(stack_size < BVH_STACK_SIZE);
+        stack[stack_size++] = n.child[i];
+        continue;
+      }
+
+      for (uint32_t j = n.child[i]; j < n.child[i] + n.count[i]; ++j) {
+        const MeshInstance *mi = _items[j].instance;
+        if (mi ? ray.hits_mesh(*mi, t_max) : _items[j].primitive->occludes(ray, t_max)) {
+          return true;
+        }
+      }
+    }
+  }
+
+  return false;
+}
@@ -0,0 +1,104 @@
+// Top-level acceleration structure over the objects in a Scene.
+#ifndef BVH_H_
+#define BVH_H_
+
+#include <vector>
+
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "kd_tree.h"
+
+class MeshInstance;
+class Primitive;
+class Ray;
+class RayHit;
+class RayPacket;
+
+// Maximum depth of the binary tree a BVH is built as. Traversal keeps a
+// fixed-size stack, sized from this.
+#define BVH_MAX_DEPTH 64
+
+// Maximum number of objects in a BVH leaf.
+#define BVH_MAX_LEAF_ITEMS 2
+
+// A bounding volume hierarchy over the world space bounds of a set of
+// MeshInstances and Primitives. Rays that reach a MeshInstance are handed off to
+// the object space KDTree of its Mesh; rays that miss its bounds never touch it.
+//
+// The BVH is built as a binary tree, then collapsed into a tree of nodes with up
+// to BBOX4_WIDTH children each, so that a ray is tested against the bounds of all
+// children of a node at once.
+//
+// The BVH keeps pointers into the containers it was built from, so it must be
+// rebuilt if those containers are modified.
+class BVH {
+  public:
+    BVH() {}
+
+    // Build the BVH over the given mesh instances and primitives.
+    void build(const std::vector<MeshInstance> &instances,
+        const std::vector<Primitive*> &primitives);
+
+    // Rebuild the BVH if the set of objects or any object's world space bounds
+    // have changed since it was last built. Returns true if it was rebuilt.
+    bool refresh(const std::vector<MeshInstance> &instances,
+        const std::vector<Primitive*> &primitives);
+
+    // Intersect the ray of the given RayHit with every object in the BVH that
+    // it might hit. Returns true if `hit` was updated with a closer intersection.
+    bool intersect(RayHit &hit) const;
+
+    // Intersect every ray of the given packet with the objects in the BVH. Nodes
+    // are culled for the whole packet at once; packets whose rays head into
+    // different octants are traced one ray at a time.
+    void intersect(RayPacket &packet) const;
+
+    // Check whether the given ray hits any object at a distance less than t_max,
+    // stopping at the first one found.
+    bool occluded(const Ray &ray, float t_max) const;
+
+  private:
+    struct item {
+      const MeshInstance *instance; // exactly one of these is non-NULL
+      const Primitive *primitive;
+      BBox bbox;
+    };
+
+    // A node of the binary tree built over the items, stored flattened. The
+    // first child of an interior node immediately follows it; `offset` holds the
+    // index of the second child. For leaves, `offset` is the index of the first
+    // item and `count` the number of items.
+    struct binary_node {
+      BBox bbox;
+      uint32_t offset;
+      uint16_t count; // 0 for interior nodes
+    };
+
+    // A node of the collapsed tree, holding the bounds of its children. For a
+    // child that is a leaf, `child` is the index of its first item and `count`
+    // its number of items; otherwise `count` is 0 and `child` is the index of
+    // the child node. Lanes from `size` on are unused and have empty bounds.
+    struct node {
+      BBox4 bounds;
+      uint32_t child[BBOX4_WIDTH];
+      uint16_t count[BBOX4_WIDTH];
+      uint16_t size;
+    };
+
+    static std::vector<item> collect_items(const std::vector<MeshInstance> &instances,
+        const std::vector<Primitive*> &primitives);
+
+    void build(std::vector<item> &&items);
+    void build_node(std::vector<binary_node> &nodes, unsigned begin, unsigned end,
+        unsigned depth);
+    uint32_t collapse(const std::vector<binary_node> &nodes, uint32_t idx);
+
+    std::vector<item> _items;
+    std::vector<node> _nodes;
+
+    friend struct CompItemsByAxis;
+};
+
+#endif /* BVH_H_ */
@@ -1,6 +1,5 @@
 #include "camera.h"
 
-#include "canvas.h"
 #include "util.h"
 
 #include <glm/gtc/matrix_transform.hpp>
@@ -12,6 +11,7 @@ Camera::Camera(const glm::vec3 &pos, const glm::vec3 &poi, const glm::vec3 &up)
   _point_of_interest = poi;
   _up = glm::normalize(up);
   _rotate_speed = DEFAULT_ROTATE_SPEED;
+  _aspect = 1.0;
 }
 
 void Camera::dolly(float dist) {
@@ -67,11 +67,7 @@ void OrthographicCamera::zoom(float factor) {
 }
 
 void OrthographicCamera::get_view_projection(glm::mat4 &view, glm::mat4 &projection) const {
-  if (!Canvas::active()) {
-    return;
-  }
-
-  double aspect = Canvas::aspect();
+  double aspect = this->aspect();
   float w, h;
   if (aspect < 1.0) {
     w = _size / 2.0;
@@ -85,16 +81,18 @@ void OrthographicCamera::get_view_projection(glm::mat4 &view, glm::mat4 &project
   view = glm::lookAt(position(), point_of_interest(), screen_up());
 }
 
-Ray OrthographicCamera::cast_ray(double x, double y) const {
-  double width = Canvas::width() >= Canvas::height() ? _size : _size * Canvas::aspect();
-  double height = width / Canvas::aspect();
-
-  glm::vec3 screen_center = position();
-  glm::vec3 x_axis = horizontal() * float(width);
-  glm::vec3 y_axis = screen_up() * float(height);
-  glm::vec3 bottom_left = screen_center - 0.5f*x_axis - 0.5f*y_axis;
-  glm::vec3 point = bottom_left + float(x)*x_axis + float(y)*y_axis;
-  return Ray(point, direction());
+CameraSnapshot OrthographicCamera::snapshot() const {
+  double width = aspect() >= 1.0 ? _size : _size * aspect();
+  double height = width / aspect();
+
+  CameraSnapshot snap;
+  snap._kind = CAMERA_ORTHOGRAPHIC;
+  snap._position = position();
+  snap._direction = direction();
+  snap._x_axis = horizontal() * float(width);
+  snap._y_axis = screen_up() * float(height);
+  snap._bottom_left = snap._position - 0.5f*snap._x_axis - 0.5f*snap._y_axis;
+  return snap;
 }
 
 PerspectiveCamera::PerspectiveCamera(
@@ -114,28 +112,24 @@ void PerspectiveCamera::zoom(float factor) {
 }
 
 void PerspectiveCamera::get_view_projection(glm::mat4 &view, glm::mat4 &projection) const {
-  if (!Canvas::active()) {
-    return;
-  }
-
-  double aspect = Canvas::aspect();
+  double aspect = this->aspect();
 
   projection = glm::perspective<float>(deg_to_rad(_angle), aspect, 0.1f, 1000.0f);
   view = glm::lookAt(position(), point_of_interest(), screen_up());
 }
 
-Ray PerspectiveCamera::cast_ray(double x, double y) const {
-  y = 1.0 - y;
+CameraSnapshot PerspectiveCamera::snapshot() const {
   float screen_h = 2 * tan(deg_to_rad(_angle) * 0.5);
-  float screen_w = screen_h * Canvas::aspect();
-
-  glm::vec3 screen_center = position() + direction();
-  glm::vec3 x_axis = horizontal() * screen_w;
-  glm::vec3 y_axis = screen_up() * screen_h;
-  glm::vec3 bottom_left = screen_center - 0.5f*x_axis - 0.5f*y_axis;
-  glm::vec3 point = bottom_left + float(x)*x_axis + float(y)*y_axis;
-  glm::vec3 dir = point - position();
-  return Ray(point, dir);
+  float screen_w = screen_h * aspect();
+
+  CameraSnapshot snap;
+  snap._kind = CAMERA_PERSPECTIVE;
+  snap._position = position();
+  snap._direction = direction();
+  snap._x_axis = horizontal() * screen_w;
+  snap._y_axis = screen_up() * screen_h;
+  snap._bottom_left = snap._position + snap._direction - 0.5f*snap._x_axis - 0.5f*snap._y_axis;
+  return snap;
 }
 
 LensCamera::LensCamera(
@@ -146,26 +140,82 @@ LensCamera::LensCamera(
     LensAssembly *la) :
   PerspectiveCamera(pos, poi, up, angle), _lens_assembly(la) {}
 
-Ray LensCamera::cast_ray(double x, double y) const {
-  float mm_per_unit = 50.0;
-  float film_height = 35.0;
-  float film_width = film_height * Canvas::aspect();
+CameraSnapshot LensCamera::snapshot() const {
+  CameraSnapshot snap = PerspectiveCamera::snapshot();
+  snap._kind = CAMERA_LENS;
+  snap._film_height = LENS_FILM_HEIGHT;
+  snap._film_width = LENS_FILM_HEIGHT * aspect();
+  snap._lens_assembly = _lens_assembly;
+
+  // Rays leave the lens in millimeters of its own space, looking down -z
+  glm::mat4 view, proj_unused;
+  get_view_projection(view, proj_unused);
+  snap._world_from_camera = glm::scale(glm::inverse(view), glm::vec3(1.0f / LENS_MM_PER_UNIT));
+  return snap;
+}
+
+bool CameraSnapshot::cast_ray(double x, double y, RNG &rng, Ray &ray) const {
+  switch (_kind) {
+    case CAMERA_ORTHOGRAPHIC: {
+      glm::vec3 point = _bottom_left + float(x)*_x_axis + float(y)*_y_axis;
+      ray = Ray(point, _direction);
+      return true;
+    }
+
+    case CAMERA_PERSPECTIVE: {
+      y = 1.0 - y;
+      glm::vec3 point = _bottom_left + float(x)*_x_axis + float(y)*_y_axis;
+      ray = Ray(point, point - _position);
+      return true;
+    }
 
-  float lens_x = (0.5 - x) * film_width;
-  float lens_y = (y - 0.5) * film_height;
+    default: {
+      assert(_kind == CAMERA_LENS);
+      float lens_x = (0.5 - x) * _film_width;
+      float lens_y = (y - 0.5) * _film_height;
+
+      Ray unmodded(glm::vec3(0.0), glm::vec3(0.0, 0.0, -1.0));
+      if (!_lens_assembly->generate_ray(lens_x, lens_y, rng, unmodded)) {
+        return false;
+      }
+      glm::vec3 origin = apply_homog(_world_from_camera, unmodded.origin(), VEC3_POINT);
+      glm::vec3 direction = apply_homog(_world_from_camera, unmodded.direction(), VEC3_DIR);
+      ray = Ray(origin, direction);
+      return true;
+    }
+  }
+}
 
-  Ray unmodded(_lens_assembly->generate_ray(lens_x, lens_y));
+uint32_t CameraSnapshot::cast_rays(const double *xs, const double *ys, unsigned n, RNG *const *rngs,
+    RayPacket &packet) const
+{
+  assert(n <= RAY_PACKET_SIZE);
 
-  glm::mat4 inverse_view;
-  glm::mat4 proj_unused;
-  get_view_projection(inverse_view, proj_unused);
-  inverse_view = glm::inverse(inverse_view);
+  if (_kind != CAMERA_LENS) {
+    Ray ray(glm::vec3(0.0), glm::vec3(0.0, 0.0, -1.0));
+    for (unsigned i = 0; i < n; ++i) {
+      cast_ray(xs[i], ys[i], *rngs[i], ray);
+      packet.add(ray);
+    }
+    return (1u << n) - 1;
+  }
 
-  glm::vec3 unmod_origin = unmodded.origin();
-  glm::vec3 scaled_origin(unmod_origin / mm_per_unit);
+  float lens_xs[RAY_PACKET_SIZE], lens_ys[RAY_PACKET_SIZE];
+  for (unsigned i = 0; i < n; ++i) {
+    lens_xs[i] = (0.5 - xs[i]) * _film_width;
+    lens_ys[i] = (ys[i] - 0.5) * _film_height;
+  }
 
-  glm::vec3 origin = apply_homog(inverse_view, scaled_origin, VEC3_POINT);
-  glm::vec3 direction = apply_homog(inverse_view, unmodded.direction(), VEC3_DIR);
+  glm::vec3 origins[RAY_PACKET_SIZE], dirs[RAY_PACKET_SIZE];
+  uint32_t through = _lens_assembly->generate_rays(lens_xs, lens_ys, n, rngs, origins, dirs);
 
-  return Ray(origin, direction);
+  for (unsigned i = 0; i < n; ++i) {
+    if (!(through & (1u << i))) {
+      continue;
+    }
+    glm::vec3 origin = apply_homog(_world_from_camera, origins[i], VEC3_POINT);
+    glm::vec3 direction = apply_homog(_world_from_camera, dirs[i], VEC3_DIR);
+    packet.add(Ray(origin, direction));
+  }
+  return through;
 }
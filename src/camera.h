@@ -13,6 +13,61 @@
 #include "lens_assembly.h"
 #include "util.h"
 
+// Scale of the scene for lens cameras: how many millimeters of the lens
+// assembly's space one scene unit is.
+#define LENS_MM_PER_UNIT 50.0f
+
+// Height of the film (sensor) of lens cameras, in millimeters.
+#define LENS_FILM_HEIGHT 35.0f
+
+// Kinds of camera a CameraSnapshot casts rays for.
+#define CAMERA_ORTHOGRAPHIC 0
+#define CAMERA_PERSPECTIVE  1
+#define CAMERA_LENS         2
+
+// An immutable copy of a camera at one moment, with everything its rays need
+// worked out in advance: the screen the rays pass through, or for lens cameras
+// the film and the transform out of the lens's space into the world. Any
+// number of threads may cast rays from a snapshot at once, and it does not
+// change when the camera it came from moves.
+class CameraSnapshot {
+  public:
+    CameraSnapshot() : _kind(CAMERA_PERSPECTIVE), _position(0.0), _direction(0.0, 0.0, -1.0),
+      _bottom_left(0.0), _x_axis(0.0), _y_axis(0.0), _film_width(0.0), _film_height(0.0),
+      _lens_assembly(NULL) {}
+
+    // Generate a ray through the given coordinates, as Camera::cast_ray()
+    // does.
+    bool cast_ray(double x, double y, RNG &rng, Ray &ray) const;
+
+    // Generate the rays through n coordinates at once, ray i drawing its random
+    // numbers from rngs[i], and add those that are not blocked to the packet,
+    // in order. Lens cameras trace the rays through the lens assembly together.
+    // Returns a mask of the rays added.
+    uint32_t cast_rays(const double *xs, const double *ys, unsigned n, RNG *const *rngs,
+        RayPacket &packet) const;
+
+  private:
+    int _kind;
+
+    // Orthographic and perspective cameras: the screen rays go through, with
+    // its bottom left corner and edges in world space
+    glm::vec3 _position;
+    glm::vec3 _direction;
+    glm::vec3 _bottom_left;
+    glm::vec3 _x_axis, _y_axis;
+
+    // Lens cameras: the film, in millimeters, and the transform from the
+    // lens's space (in scene units) into world space
+    float _film_width, _film_height;
+    glm::mat4 _world_from_camera;
+    const LensAssembly *_lens_assembly;
+
+    friend class OrthographicCamera;
+    friend class PerspectiveCamera;
+    friend class LensCamera;
+};
+
 // A top-level, pure virtual class representing a camera (viewpoint) in a 3D
 // scene.
 class Camera {
@@ -44,6 +99,13 @@ class Camera {
     // Return the rotate speed of the camera.
     float rotate_speed() const { return _rotate_speed; }
 
+    // Set the aspect ratio (width / height) of the image this camera projects
+    // onto.
+    void set_aspect(double aspect) { _aspect = aspect; }
+
+    // Return the aspect ratio of the image this camera projects onto.
+    double aspect() const { return _aspect; }
+
     // Return various orientation vectors of the camera. The `up()` vector
     // is unit length.
     const glm::vec3 &position() const { return _position; }
@@ -77,12 +139,24 @@ class Camera {
     // Places the results in the corresponding arguments.
     virtual void get_view_projection(glm::mat4 &view, glm::mat4 &projection) const = 0;
 
-    // Generate a ray through the given coordinates, according to the active Canvas's
+    // Take a snapshot of the camera as it is now, to cast rays from.
+    virtual CameraSnapshot snapshot() const = 0;
+
+    // Generate a ray through the given coordinates, according to the camera's
     // aspect ratio.
     //
     // The given coordinates should both be normalized to the [0, 1] range, with 0
-    // being the left screen edge for x and the bottom screen edge for y.
-    virtual Ray cast_ray(double x, double y) const = 0;
+    // being the left screen edge for x and the bottom screen edge for y. Cameras
+    // that sample their rays draw from `rng`.
+    //
+    // Returns false, leaving `ray` alone, if no light gets through to the film
+    // along the ray, as when a lens blocks every path tried.
+    //
+    // This takes a new snapshot for the one ray; to cast many, cast them from a
+    // snapshot().
+    bool cast_ray(double x, double y, RNG &rng, Ray &ray) const {
+      return snapshot().cast_ray(x, y, rng, ray);
+    }
 
   private:
     Camera() = delete;
@@ -91,6 +165,7 @@ class Camera {
     glm::vec3 _position;
     glm::vec3 _up;
     float _rotate_speed;
+    double _aspect;
 };
 
 // A camera with an orthographic projection.
@@ -99,8 +174,8 @@ class OrthographicCamera : public Camera {
     // An orthographic camera is defined by a rectangular prism with the image plane
     // as one face, and extending infinitely away from the image plane in the view
     // direction. In camera coordinates, the image plane's largest dimension will
-    // be `size` units, with the other dimension determined according to the active
-    // Canvas's aspect ratio.
+    // be `size` units, with the other dimension determined according to the
+    // camera's aspect ratio.
     OrthographicCamera(const glm::vec3 &pos = glm::vec3(0,0,1),
         const glm::vec3 &poi = glm::vec3(0,0,0),
         const glm::vec3 &up = glm::vec3(0,1,0),
@@ -109,7 +184,7 @@ class OrthographicCamera : public Camera {
     void set_size(float size) { _size = size; }
     void zoom(float factor);
     void get_view_projection(glm::mat4 &view, glm::mat4 &projection) const;
-    Ray cast_ray(double x, double y) const;
+    CameraSnapshot snapshot() const;
 
   private:
     float _size;
@@ -127,7 +202,7 @@ class PerspectiveCamera : public Camera {
     void set_angle(float fov) { _angle = fov; }
     void zoom(float dist);
     void get_view_projection(glm::mat4 &view, glm::mat4 &projection) const;
-    virtual Ray cast_ray(double x, double y) const;
+    virtual CameraSnapshot snapshot() const;
 
   private:
     float _angle;
@@ -144,7 +219,9 @@ class LensCamera : public PerspectiveCamera {
     ~LensCamera() { delete _lens_assembly; }
 
     void set_lens_assembly(LensAssembly *la) { delete _lens_assembly; _lens_assembly = la; }
-    Ray cast_ray(double x, double y) const;
+    LensAssembly *lens_assembly() { return _lens_assembly; }
+    const LensAssembly *lens_assembly() const { return _lens_assembly; }
+    CameraSnapshot snapshot() const;
 
   private:
     LensAssembly *_lens_assembly;
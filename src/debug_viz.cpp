@@ -11,10 +11,11 @@
 
 bool DebugViz::_depth_test = true;
 
+// The GL objects are made on first use, on the thread with the GL context, so
+// that objects holding a DebugViz, like Meshes, can be made on any thread
 DebugViz::DebugViz() : _dirty(false), _line_width(1.0) {
   _vbuf = 0;
   _vao = 0;
-  lazy_init_shaders();
 }
 
 DebugViz::~DebugViz() {
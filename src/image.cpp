@@ -0,0 +1,241 @@
+#include "image.h"
+
+#include <fstream>
+#include <string>
+
+#include <cmath>
+#include <cstdint>
+
+#include "util.h"
+
+// Largest amount of data a stored (uncompressed) deflate block can hold
+#define DEFLATE_STORED_MAX 65535
+
+static uint32_t crc32_table[256];
+
+static void init_crc32_table() {
+  if (crc32_table[1] != 0) {
+    return;
+  }
+
+  for (uint32_t n = 0; n < 256; ++n) {
+    uint32_t c = n;
+    for (unsigned k = 0; k < 8; ++k) {
+      c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    }
+    crc32_table[n] = c;
+  }
+}
+
+static uint32_t crc32(const unsigned char *data, size_t size, uint32_t crc = 0) {
+  crc = ~crc;
+  for (size_t i = 0; i < size; ++i) {
+    crc = crc32_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+static void put_u32_be(std::string &buf, uint32_t v) {
+  buf.push_back((char) (v >> 24));
+  buf.push_back((char) (v >> 16));
+  buf.push_back((char) (v >> 8));
+  buf.push_back((char) v);
+}
+
+// Write a PNG chunk: its length, type, data, and the CRC of the type and data.
+static void write_png_chunk(std::ostream &out, const char *type, const std::string &data) {
+  std::string chunk;
+  put_u32_be(chunk, data.size());
+  chunk.append(type, 4);
+  chunk.append(data);
+
+  uint32_t crc = crc32((const unsigned char*) chunk.data() + 4, chunk.size() - 4);
+  put_u32_be(chunk, crc);
+  out.write(chunk.data(), chunk.size());
+}
+
+bool Image::write(const char *filename) const {
+  std::string ext = file_extension(filename);
+  if (ext != "ppm" && ext != "png") {
+    glerr() << "ERROR: unknown image format for " << filename
+      << " (expected .ppm or .png)" << std::endl;
+    return false;
+  }
+
+  std::ofstream out(filename, std::ios::binary);
+  if (!out) {
+    glerr() << "ERROR: could not open " << filename << " for writing" << std::endl;
+    return false;
+  }
+
+  if (ext == "ppm") {
+    write_ppm(out);
+  } else {
+    write_png(out);
+  }
+
+  out.close();
+  if (!out) {
+    glerr() << "ERROR: could not write image " << filename << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+void Image::write_ppm(std::ostream &out) const {
+  out << "P6\n" << _w << " " << _h << "\n255\n";
+
+  std::vector<unsigned char> row(3*_w);
+  for (unsigned y = 0; y < _h; ++y) {
+    for (unsigned x = 0; x < _w; ++x) {
+      const pixel_color &p = pixel(x, y);
+      row[3*x] = p.r;
+      row[3*x + 1] = p.g;
+      row[3*x + 2] = p.b;
+    }
+    out.write((const char*) row.data(), row.size());
+  }
+}
+
+void Image::write_png(std::ostream &out) const {
+  init_crc32_table();
+
+  static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+  out.write((const char*) signature, sizeof(signature));
+
+  std::string ihdr;
+  put_u32_be(ihdr, _w);
+  put_u32_be(ihdr, _h);
+  ihdr.push_back(8); // bit depth
+  ihdr.push_back(2); // color type: RGB
+  ihdr.push_back(0); // compression: deflate
+  ihdr.push_back(0); // filter method
+  ihdr.push_back(0); // no interlacing
+  write_png_chunk(out, "IHDR", ihdr);
+
+  // Scanlines, top to bottom, each starting with filter type 0 (none)
+  std::string raw;
+  raw.reserve((3*_w + 1) * _h);
+  for (unsigned y = 0; y < _h; ++y) {
+    raw.push_back(0);
+    for (unsigned x = 0; x < _w; ++x) {
+      const pixel_color &p = pixel(x, y);
+      raw.push_back((char) p.r);
+      raw.push_back((char) p.g);
+      raw.push_back((char) p.b);
+    }
+  }
+
+  // Wrap the scanlines in a zlib stream of stored deflate blocks. Render output
+  // is noisy enough that compressing it would gain little for the code it takes.
+  std::string idat;
+  idat.push_back(0x78);
+  idat.push_back(0x01);
+
+  uint32_t adler_a = 1, adler_b = 0;
+  size_t pos = 0;
+  do {
+    size_t len = std::min(raw.size() - pos, (size_t) DEFLATE_STORED_MAX);
+    bool last = pos + len == raw.size();
+
+    idat.push_back(last ? 1 : 0);
+    idat.push_back((char) (len & 0xff));
+    idat.push_back((char) (len >> 8));
+    idat.push_back((char) (~len & 0xff));
+    idat.push_back((char) ((~len >> 8) & 0xff));
+    idat.append(raw, pos, len);
+
+    for (size_t i = pos; i < pos + len; ++i) {
+      adler_a = (adler_a + (unsigned char) raw[i]) % 65521;
+      adler_b = (adler_b + adler_a) % 65521;
+    }
+    pos += len;
+  } while (pos < raw.size());
+
+  put_u32_be(idat, (adler_b << 16) | adler_a);
+  write_png_chunk(out, "IDAT", idat);
+  write_png_chunk(out, "IEND", std::string());
+}
+
+void AccumBuffer::set_range(unsigned x0, unsigned y0, unsigned width, unsigned height,
+    const glm::vec3 &color)
+{
+  accum_pixel p;
+  p.sum = glm::vec4(color, 1.0);
+  p.sum_sq = color*color;
+  p.samples = 1;
+
+  unsigned x1 = std::min(x0 + width, _w);
+  unsigned y1 = std::min(y0 + height, _h);
+  for (unsigned j = y0; j < y1; ++j) {
+    for (unsigned i = x0; i < x1; ++i) {
+      _data[j*_w + i] = p;
+    }
+  }
+}
+
+float AccumBuffer::error(unsigned x, unsigned y, float floor) const {
+  const accum_pixel &p = _data[y*_w + x];
+  if (p.samples < 2) {
+    return 0.0;
+  }
+
+  // Per-channel variances, corrected for the bias of the population variance.
+  // Their mean stands in for the variance of the brightness, which would need
+  // the covariances of the channels as well.
+  float n = p.samples;
+  glm::vec3 var = variance(x, y) * (n / (n - 1));
+  float std_error = std::sqrt((var.r + var.g + var.b) / (3*n));
+
+  glm::vec3 mean = glm::vec3(p.sum) / n;
+  float brightness = (mean.r + mean.g + mean.b) / 3;
+
+  return std_error / std::max(brightness, floor);
+}
+
+void AccumBuffer::resolve(Image &image) const {
+  assert(image.width() == _w && image.height() == _h);
+
+  for (unsigned y = 0; y < _h; ++y) {
+    for (unsigned x = 0; x < _w; ++x) {
+      glm::vec4 color = glm::clamp(mean(x, y), 0.0f, 1.0f);
+      image.set_pixel(x, y, color);
+    }
+  }
+}
+
+bool AccumBuffer::write_pfm(const char *filename) const {
+  std::ofstream out(filename, std::ios::binary);
+  if (!out) {
+    glerr() << "ERROR: could not open " << filename << " for writing" << std::endl;
+    return false;
+  }
+
+  // The sign of the scale gives the byte order of the floats: negative for
+  // little-endian
+  uint16_t one = 1;
+  bool little_endian = *(const unsigned char*) &one == 1;
+  out << "PF\n" << _w << " " << _h << "\n" << (little_endian ? "-1.0" : "1.0") << "\n";
+
+  // PFM rows run bottom to top
+  std::vector<float> row(3*_w);
+  for (unsigned r = 0; r < _h; ++r) {
+    unsigned y = _h - r - 1;
+    for (unsigned x = 0; x < _w; ++x) {
+      glm::vec4 p = mean(x, y);
+      row[3*x] = p.r;
+      row[3*x + 1] = p.g;
+      row[3*x + 2] = p.b;
+    }
+    out.write((const char*) row.data(), row.size() * sizeof(float));
+  }
+
+  out.close();
+  if (!out) {
+    glerr() << "ERROR: could not write image " << filename << std::endl;
+    return false;
+  }
+
+  return true;
+}
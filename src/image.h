@@ -1,10 +1,12 @@
 #ifndef IMAGE_H_
 #define IMAGE_H_
 
+#include <iosfwd>
 #include <vector>
 #include <algorithm>
 
 #include <cassert>
+#include <cstdint>
 
 #include <glm/glm.hpp>
 
@@ -72,7 +74,15 @@ class Image {
     size_t num_pixels() const { return _w * _h; }
     size_t data_bytes() const { return _data.size() * sizeof(pixel_color); }
 
+    // Write this image to a file, in the format given by the file's extension:
+    // .ppm (binary PPM) or .png. Returns false, after reporting the error, if
+    // the file could not be written.
+    bool write(const char *filename) const;
+
   private:
+    void write_ppm(std::ostream &out) const;
+    void write_png(std::ostream &out) const;
+
     unsigned index(unsigned x, unsigned y) const {
       return (_h - y - 1)*_w + x;
     }
@@ -99,4 +109,81 @@ class Image {
     unsigned _w, _h;
 };
 
+// A float RGBA framebuffer that accumulates samples of each pixel's color over
+// any number of passes. Each pixel keeps the sum and the sum of squares of its
+// samples, and how many there are, so its mean and variance can be read at any
+// point; the alpha channel of the sum counts the samples' coverage. Pixels are
+// addressed as in Image, with y = 0 at the top.
+//
+// Different threads may add samples to different pixels at the same time.
+class AccumBuffer {
+  public:
+    AccumBuffer(unsigned width, unsigned height)
+      : _data(width*height), _w(width), _h(height) {}
+
+    unsigned width() const { return _w; }
+    unsigned height() const { return _h; }
+
+    void clear() { std::fill(_data.begin(), _data.end(), accum_pixel()); }
+
+    void add_sample(unsigned x, unsigned y, const glm::vec3 &color) {
+      assert(x < _w);
+      assert(y < _h);
+      accum_pixel &p = _data[y*_w + x];
+      p.sum += glm::vec4(color, 1.0);
+      p.sum_sq += color*color;
+      ++p.samples;
+    }
+
+    // Replace whatever has been accumulated in the given rectangle with a
+    // single sample of the given color, as for previews at a coarser
+    // resolution than the image.
+    void set_range(unsigned x0, unsigned y0, unsigned width, unsigned height, const glm::vec3 &color);
+
+    unsigned samples(unsigned x, unsigned y) const { return _data[y*_w + x].samples; }
+
+    // Get the mean of the samples of a pixel, or transparent black if it has
+    // none.
+    glm::vec4 mean(unsigned x, unsigned y) const {
+      const accum_pixel &p = _data[y*_w + x];
+      return p.samples > 0 ? p.sum / float(p.samples) : glm::vec4(0.0);
+    }
+
+    // Get the (population) variance of the samples of a pixel, per channel.
+    glm::vec3 variance(unsigned x, unsigned y) const {
+      const accum_pixel &p = _data[y*_w + x];
+      if (p.samples == 0) {
+        return glm::vec3(0.0);
+      }
+      glm::vec3 mean = glm::vec3(p.sum) / float(p.samples);
+      return glm::max(p.sum_sq / float(p.samples) - mean*mean, glm::vec3(0.0));
+    }
+
+    // Estimate the relative error of a pixel's mean: the standard error of its
+    // brightness (the mean of the channels) over the brightness itself, which
+    // counts as at least `floor` so dark pixels are not held to an impossible
+    // standard. Pixels with fewer than two samples have no estimate, and get 0.
+    float error(unsigned x, unsigned y, float floor) const;
+
+    // Convert the mean of each pixel to 8-bit color, clamped to [0, 1], in an
+    // Image of the same size.
+    void resolve(Image &image) const;
+
+    // Write the mean of each pixel to a 32-bit float PFM file. Returns false,
+    // after reporting the error, if the file could not be written.
+    bool write_pfm(const char *filename) const;
+
+  private:
+    struct accum_pixel {
+      accum_pixel() : sum(0.0), sum_sq(0.0), samples(0) {}
+
+      glm::vec4 sum;
+      glm::vec3 sum_sq;
+      uint32_t samples;
+    };
+
+    std::vector<accum_pixel> _data;
+    unsigned _w, _h;
+};
+
 #endif /* IMAGE_H_ */
@@ -2,96 +2,220 @@
 
 #include <algorithm>
 
+#include <cstring>
+
 #include "mesh.h"
 #include "raytracing.h"
+#include "threads.h"
 #include "util.h"
 
 #define X_AXIS 0
 #define Y_AXIS 1
 #define Z_AXIS 2
 
-static bool ray_plane_intersect(const Ray &ray, int axis, float plane, glm::vec3 &point) {
-  assert(axis == X_AXIS || axis == Y_AXIS || axis == Z_AXIS);
-  float orig_dim, dir_dim;
-  if (axis == X_AXIS) {
-    orig_dim = ray.origin().x;
-    dir_dim = ray.direction().x;
-  } else if (axis == Y_AXIS) {
-    orig_dim = ray.origin().y;
-    dir_dim = ray.direction().y;
-  } else {
-    orig_dim = ray.origin().z;
-    dir_dim = ray.direction().z;
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define BBOX4_SSE
+#include <xmmintrin.h>
+#endif
+
+SlabRay::SlabRay(const glm::vec3 &origin, const glm::vec3 &dir) :
+  origin(origin), inv_dir(1.0f / dir)
+{
+  bool degenerate = false;
+  for (unsigned a = 0; a < 3; ++a) {
+    sign[a] = std::signbit(dir[a]);
+    degenerate |= std::isnan(origin[a]) || std::isnan(dir[a]);
   }
 
-  float t = (plane - orig_dim) / dir_dim;
-  if (t < 0) {
-    return false;
+  // Move degenerate rays out to infinity, behind every box
+  if (degenerate) {
+    this->origin = glm::vec3(HUGE_VALF);
+    inv_dir = glm::vec3(1.0f);
+    sign[0] = sign[1] = sign[2] = 0;
   }
+}
 
-  point = ray.point_at(t);
-  return true;
+// Maximum and minimum of a slab distance `t` and a running bound, in the form of
+// the SSE instructions: if `t` is NaN the bound is returned unchanged. That
+// happens when a ray lies in the plane of a box face (0 * inf), and makes such
+// rays count as inside the slab.
+static inline float slab_max(float t, float bound) { return t > bound ? t : bound; }
+static inline float slab_min(float t, float bound) { return t < bound ? t : bound; }
+
+bool BBox::clip_ray(const SlabRay &ray, float &t_near, float &t_far) const {
+  t_near = slab_max((_bounds[ray.sign[0]].x - ray.origin.x) * ray.inv_dir.x, t_near);
+  t_near = slab_max((_bounds[ray.sign[1]].y - ray.origin.y) * ray.inv_dir.y, t_near);
+  t_near = slab_max((_bounds[ray.sign[2]].z - ray.origin.z) * ray.inv_dir.z, t_near);
+
+  t_far = slab_min((_bounds[1 - ray.sign[0]].x - ray.origin.x) * ray.inv_dir.x, t_far);
+  t_far = slab_min((_bounds[1 - ray.sign[1]].y - ray.origin.y) * ray.inv_dir.y, t_far);
+  t_far = slab_min((_bounds[1 - ray.sign[2]].z - ray.origin.z) * ray.inv_dir.z, t_far);
+
+  // A ray parallel to a slab and outside it enters at infinity
+  return (t_near <= t_far) & (t_near < HUGE_VALF);
 }
 
-static bool point_within_face(const glm::vec3 &point, int axis,
-    const glm::vec3 &min, const glm::vec3 &max)
-{
-  assert(axis == X_AXIS || axis == Y_AXIS || axis == Z_AXIS);
-  float dim1_min, dim2_min;
-  float dim1_max, dim2_max;
-  float dim1, dim2;
+void BBox4::set(unsigned lane, const BBox &box) {
+  assert(lane < BBOX4_WIDTH);
+  min_x[lane] = box.min().x;
+  min_y[lane] = box.min().y;
+  min_z[lane] = box.min().z;
+  max_x[lane] = box.max().x;
+  max_y[lane] = box.max().y;
+  max_z[lane] = box.max().z;
+}
 
-  if (axis == X_AXIS) {
-    dim1_min = min.y; dim2_min = min.z;
-    dim1_max = max.y; dim2_max = max.z;
-    dim1 = point.y; dim2 = point.z;
-  } else if (axis == Y_AXIS) {
-    dim1_min = min.x; dim2_min = min.z;
-    dim1_max = max.x; dim2_max = max.z;
-    dim1 = point.x; dim2 = point.z;
-  } else {
-    dim1_min = min.x; dim2_min = min.y;
-    dim1_max = max.x; dim2_max = max.y;
-    dim1 = point.x; dim2 = point.y;
-  }
+void BBox4::clear(unsigned lane) {
+  assert(lane < BBOX4_WIDTH);
+  min_x[lane] = min_y[lane] = min_z[lane] = HUGE_VALF;
+  max_x[lane] = max_y[lane] = max_z[lane] = -HUGE_VALF;
+}
 
-  return dim1_min <= dim1 && dim1 <= dim1_max
-      && dim2_min <= dim2 && dim2 <= dim2_max;
+BBox BBox4::box(unsigned lane) const {
+  assert(lane < BBOX4_WIDTH);
+  return BBox(glm::vec3(min_x[lane], min_y[lane], min_z[lane]),
+      glm::vec3(max_x[lane], max_y[lane], max_z[lane]));
 }
 
-bool BBox::ray_intersects(const Ray &ray) const {
-  glm::vec3 point;
-  if (ray_plane_intersect(ray, X_AXIS, _min.x, point)) {
-    if (point_within_face(point, X_AXIS, _min, _max)) return true;
+unsigned BBox4::clip_ray(const SlabRay &ray, float t_max, float t_near[BBOX4_WIDTH]) const {
+  // Near and far planes of each slab, chosen by the direction of the ray
+  const float *near_x = ray.sign[0] ? max_x : min_x;
+  const float *near_y = ray.sign[1] ? max_y : min_y;
+  const float *near_z = ray.sign[2] ? max_z : min_z;
+  const float *far_x = ray.sign[0] ? min_x : max_x;
+  const float *far_y = ray.sign[1] ? min_y : max_y;
+  const float *far_z = ray.sign[2] ? min_z : max_z;
+
+#ifdef BBOX4_SSE
+  __m128 ox = _mm_set1_ps(ray.origin.x);
+  __m128 oy = _mm_set1_ps(ray.origin.y);
+  __m128 oz = _mm_set1_ps(ray.origin.z);
+  __m128 ix = _mm_set1_ps(ray.inv_dir.x);
+  __m128 iy = _mm_set1_ps(ray.inv_dir.y);
+  __m128 iz = _mm_set1_ps(ray.inv_dir.z);
+
+  __m128 t0 = _mm_setzero_ps();
+  t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near_x), ox), ix), t0);
+  t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near_y), oy), iy), t0);
+  t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near_z), oz), iz), t0);
+
+  __m128 t1 = _mm_set1_ps(t_max);
+  t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far_x), ox), ix), t1);
+  t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far_y), oy), iy), t1);
+  t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far_z), oz), iz), t1);
+
+  __m128 hit = _mm_and_ps(_mm_cmple_ps(t0, t1), _mm_cmplt_ps(t0, _mm_set1_ps(HUGE_VALF)));
+  _mm_storeu_ps(t_near, t0);
+  return _mm_movemask_ps(hit);
+#else
+  unsigned mask = 0;
+  for (unsigned i = 0; i < BBOX4_WIDTH; ++i) {
+    float t0 = 0.0f;
+    t0 = slab_max((near_x[i] - ray.origin.x) * ray.inv_dir.x, t0);
+    t0 = slab_max((near_y[i] - ray.origin.y) * ray.inv_dir.y, t0);
+    t0 = slab_max((near_z[i] - ray.origin.z) * ray.inv_dir.z, t0);
+
+    float t1 = t_max;
+    t1 = slab_min((far_x[i] - ray.origin.x) * ray.inv_dir.x, t1);
+    t1 = slab_min((far_y[i] - ray.origin.y) * ray.inv_dir.y, t1);
+    t1 = slab_min((far_z[i] - ray.origin.z) * ray.inv_dir.z, t1);
+
+    t_near[i] = t0;
+    mask |= unsigned((t0 <= t1) & (t0 < HUGE_VALF)) << i;
   }
-  if (ray_plane_intersect(ray, X_AXIS, _max.x, point)) {
-    if (point_within_face(point, X_AXIS, _min, _max)) return true;
-  }
-  if (ray_plane_intersect(ray, Y_AXIS, _min.y, point)) {
-    if (point_within_face(point, Y_AXIS, _min, _max)) return true;
-  }
-  if (ray_plane_intersect(ray, Y_AXIS, _max.y, point)) {
-    if (point_within_face(point, Y_AXIS, _min, _max)) return true;
+  return mask;
+#endif
+}
+
+RayInterval::RayInterval(const glm::vec3 *origins, const glm::vec3 *dirs, unsigned n) :
+  coherent(n > 0), min_origin(HUGE_VALF), max_origin(-HUGE_VALF),
+  min_rcp(HUGE_VALF), max_rcp(-HUGE_VALF)
+{
+  parallel[0] = parallel[1] = parallel[2] = false;
+
+  for (unsigned i = 0; i < n; ++i) {
+    min_origin = glm::min(min_origin, origins[i]);
+    max_origin = glm::max(max_origin, origins[i]);
+
+    for (unsigned a = 0; a < 3; ++a) {
+      if (std::signbit(dirs[i][a]) != std::signbit(dirs[0][a])) {
+        coherent = false;
+      }
+
+      if (dirs[i][a] == 0.0f) {
+        parallel[a] = true;
+        continue;
+      }
+
+      float rcp = 1.0f / dirs[i][a];
+      min_rcp[a] = std::min(rcp, min_rcp[a]);
+      max_rcp[a] = std::max(rcp, max_rcp[a]);
+    }
   }
-  if (ray_plane_intersect(ray, Z_AXIS, _min.z, point)) {
-    if (point_within_face(point, Z_AXIS, _min, _max)) return true;
+}
+
+bool BBox::interval_intersects(const RayInterval &iv, float t_max) const {
+  assert(iv.coherent);
+
+  float t_enter = 0.0f;
+  float t_exit = t_max;
+
+  for (unsigned a = 0; a < 3; ++a) {
+    if (iv.parallel[a]) {
+      continue;
+    }
+
+    // Bound the distances at which the rays enter and leave this box's slab
+    // along the axis, over every combination of origin and direction.
+    float enter, exit;
+    if (iv.min_rcp[a] > 0.0f) {
+      float near_lo = min()[a] - iv.max_origin[a];
+      float far_hi = max()[a] - iv.min_origin[a];
+      enter = near_lo >= 0.0f ? near_lo * iv.min_rcp[a] : near_lo * iv.max_rcp[a];
+      exit = far_hi >= 0.0f ? far_hi * iv.max_rcp[a] : far_hi * iv.min_rcp[a];
+    } else {
+      float near_hi = max()[a] - iv.min_origin[a];
+      float far_lo = min()[a] - iv.max_origin[a];
+      enter = near_hi >= 0.0f ? near_hi * iv.min_rcp[a] : near_hi * iv.max_rcp[a];
+      exit = far_lo <= 0.0f ? far_lo * iv.min_rcp[a] : far_lo * iv.max_rcp[a];
+    }
+
+    t_enter = std::max(enter, t_enter);
+    t_exit = std::min(exit, t_exit);
+    if (t_enter > t_exit) {
+      return false;
+    }
   }
-  if (ray_plane_intersect(ray, Z_AXIS, _max.z, point)) {
-    if (point_within_face(point, Z_AXIS, _min, _max)) return true;
+
+  return true;
+}
+
+BBox BBox::transformed(const glm::mat4 &modelmat) const {
+  glm::vec3 min(HUGE_VALF);
+  glm::vec3 max(-HUGE_VALF);
+
+  for (unsigned i = 0; i < 8; ++i) {
+    glm::vec3 corner(
+        (i & 1) ? _bounds[1].x : _bounds[0].x,
+        (i & 2) ? _bounds[1].y : _bounds[0].y,
+        (i & 4) ? _bounds[1].z : _bounds[0].z);
+    corner = apply_homog(modelmat, corner, VEC3_POINT);
+    min = glm::min(min, corner);
+    max = glm::max(max, corner);
   }
 
-  return false;
+  return BBox(min, max);
 }
 
 void BBox::add_debug_lines(DebugViz &dbviz, const glm::mat4 &modelmat) const {
-  glm::vec3 pt000 = apply_homog(modelmat, _min, VEC3_POINT);
-  glm::vec3 pt001 = apply_homog(modelmat, glm::vec3(_min.x, _min.y, _max.z), VEC3_POINT);
-  glm::vec3 pt010 = apply_homog(modelmat, glm::vec3(_min.x, _max.y, _min.z), VEC3_POINT);
-  glm::vec3 pt011 = apply_homog(modelmat, glm::vec3(_min.x, _max.y, _max.z), VEC3_POINT);
-  glm::vec3 pt100 = apply_homog(modelmat, glm::vec3(_max.x, _min.y, _min.z), VEC3_POINT);
-  glm::vec3 pt101 = apply_homog(modelmat, glm::vec3(_max.x, _min.y, _max.z), VEC3_POINT);
-  glm::vec3 pt110 = apply_homog(modelmat, glm::vec3(_max.x, _max.y, _min.z), VEC3_POINT);
-  glm::vec3 pt111 = apply_homog(modelmat, _max, VEC3_POINT);
+  glm::vec3 pt000 = apply_homog(modelmat, min(), VEC3_POINT);
+  glm::vec3 pt001 = apply_homog(modelmat, glm::vec3(min().x, min().y, max().z), VEC3_POINT);
+  glm::vec3 pt010 = apply_homog(modelmat, glm::vec3(min().x, max().y, min().z), VEC3_POINT);
+  glm::vec3 pt011 = apply_homog(modelmat, glm::vec3(min().x, max().y, max().z), VEC3_POINT);
+  glm::vec3 pt100 = apply_homog(modelmat, glm::vec3(max().x, min().y, min().z), VEC3_POINT);
+  glm::vec3 pt101 = apply_homog(modelmat, glm::vec3(max().x, min().y, max().z), VEC3_POINT);
+  glm::vec3 pt110 = apply_homog(modelmat, glm::vec3(max().x, max().y, min().z), VEC3_POINT);
+  glm::vec3 pt111 = apply_homog(modelmat, max(), VEC3_POINT);
 
   glm::vec4 color(0.7, 0.9, 1.0, 1.0);
 
@@ -109,6 +233,10 @@ void BBox::add_debug_lines(DebugViz &dbviz, const glm::mat4 &modelmat) const {
   dbviz.add_line(pt110, pt111, color);
 }
 
+// Both subtrees of a split are built in parallel if each has at least this
+// many faces.
+#define KD_PARALLEL_BUILD_FACES 2048
+
 #define SPLIT_LEFT    0
 #define SPLIT_RIGHT   1
 #define SPLIT_NEITHER 2
@@ -126,14 +254,14 @@ struct CompByAxis {
     }
   }
 
-  bool operator()(const Face *f1, const Face *f2) const {
-    glm::vec3 p1 = f1->centroid();
-    glm::vec3 p2 = f2->centroid();
+  bool operator()(const Face &f1, const Face &f2) const {
+    glm::vec3 p1 = f1.centroid();
+    glm::vec3 p2 = f2.centroid();
     return (*this)(p1, get_coord(p2));
   }
 
-  bool operator()(const Face *f, float plane) const {
-    glm::vec3 p = f->centroid();
+  bool operator()(const Face &f, float plane) const {
+    glm::vec3 p = f.centroid();
     return (*this)(p, plane);
   }
 
@@ -141,10 +269,10 @@ struct CompByAxis {
     return get_coord(v) < plane;
   }
 
-  int face_split(const Face *f, float plane) const {
+  int face_split(const Face &f, float plane) const {
     int count = 0;
     for (unsigned i = 0; i < 3; ++i) {
-      if (!(*this)(f->vert(i)->position(), plane)) {
+      if (!(*this)(f.vert(i).position(), plane)) {
         count++;
       }
     }
@@ -159,227 +287,719 @@ struct CompByAxis {
   }
 };
 
-KDTree::KDTree(const Mesh *mesh) : _child1(NULL), _child2(NULL) {
-  std::vector<const Face*> faces;
+// Orders faces by the lowest or highest coordinate of their vertices along one
+// axis
+struct CompBoundsByAxis {
+  CompByAxis comp;
+  bool upper;
+
+  float bound(const Face &f) const {
+    float c0 = comp.get_coord(f.vert(0).position());
+    float c1 = comp.get_coord(f.vert(1).position());
+    float c2 = comp.get_coord(f.vert(2).position());
+    return upper ? std::max(c0, std::max(c1, c2)) : std::min(c0, std::min(c1, c2));
+  }
+
+  bool operator()(const Face &f1, const Face &f2) const {
+    return bound(f1) < bound(f2);
+  }
+};
+
+// The faces of a node sorted along each axis. For the median builder, by_x,
+// by_y and by_z are sorted by centroid. For the SAH builder they are sorted by
+// the faces' lower bounds, and upper_x, upper_y and upper_z by their upper
+// bounds. Splitting a node keeps the order of each list.
+typedef struct sorted_data {
+  std::vector<Face> by_x;
+  std::vector<Face> by_y;
+  std::vector<Face> by_z;
+  std::vector<Face> upper_x;
+  std::vector<Face> upper_y;
+  std::vector<Face> upper_z;
+} sorted_data;
+
+// A node of a KDTree under construction. Once built, the tree is compiled into
+// the node array of the KDTree and then thrown away.
+class KDBuildNode {
+  public:
+    KDBuildNode() : _child1(NULL), _child2(NULL), _axis(X_AXIS), _plane(0.0) {}
+    KDBuildNode(const KDBuildNode&) = delete;
+    KDBuildNode &operator=(const KDBuildNode&) = delete;
+
+    ~KDBuildNode() {
+      delete _child1;
+      delete _child2;
+    }
+
+    void construct(const sorted_data &sorted, const BBox &bbox,
+        const KDTreeBuildParams &params, unsigned depth = 0);
+
+  private:
+    bool find_median_split(const sorted_data &sorted, const KDTreeBuildParams &params);
+    bool find_sah_split(const sorted_data &sorted, const KDTreeBuildParams &params);
+
+    BBox _bbox;
+    KDBuildNode *_child1;
+    KDBuildNode *_child2;
+
+    int _axis;
+    float _plane;
+
+    std::vector<Face> _faces;
+
+    friend class KDTree;
+};
+
+// Arguments of KDBuildNode::construct, for running it as a thread pool task.
+struct construct_args {
+  KDBuildNode *node;
+  const sorted_data *sorted;
+  BBox bbox;
+  const KDTreeBuildParams *params;
+  unsigned depth;
+};
+
+static void construct_task(void *argptr) {
+  construct_args *args = (construct_args*) argptr;
+  args->node->construct(*args->sorted, args->bbox, *args->params, args->depth);
+}
+
+// Sort a list of faces into those below and above a splitting plane, keeping
+// their order. Faces crossing the plane go in both.
+static void split_faces(const std::vector<Face> &faces, const CompByAxis &comp, float plane,
+    std::vector<Face> &below, std::vector<Face> &above)
+{
+  for (unsigned i = 0; i < faces.size(); ++i) {
+    int split = comp.face_split(faces[i], plane);
+    if (split != SPLIT_RIGHT) {
+      below.push_back(faces[i]);
+    }
+    if (split != SPLIT_LEFT) {
+      above.push_back(faces[i]);
+    }
+  }
+}
+
+static void split_bbox(const BBox &bbox, int axis, float plane, BBox &lower, BBox &upper) {
+  lower = upper = bbox;
+  if (axis == X_AXIS) {
+    lower.set_max_x(plane);
+    upper.set_min_x(plane);
+  } else if (axis == Y_AXIS) {
+    lower.set_max_y(plane);
+    upper.set_min_y(plane);
+  } else {
+    lower.set_max_z(plane);
+    upper.set_min_z(plane);
+  }
+}
+
+static KDTreeBuildParams build_params;
+
+const KDTreeBuildParams &kd_tree_build_params() {
+  return build_params;
+}
+
+void set_kd_tree_build_params(const KDTreeBuildParams &params) {
+  build_params = params;
+}
+
+KDTree::KDTree(const Mesh *mesh, const KDTreeBuildParams &params) {
   sorted_data sorted;
 
   glm::vec3 min(HUGE_VALF); // Get ourselves some nice infinities up in here...
   glm::vec3 max(-HUGE_VALF);
 
-  for (Mesh::face_iterator fi = mesh->faces_begin(); fi != mesh->faces_end(); ++fi) {
+  for (uint32_t i = 0; i < mesh->faces_size(); ++i) {
+    Face f = mesh->face(i);
     for (unsigned v = 0; v < 3; ++v) {
-      max.x = std::max((*fi)->vert(v)->position().x, max.x);
-      max.y = std::max((*fi)->vert(v)->position().y, max.y);
-      max.z = std::max((*fi)->vert(v)->position().z, max.z);
-      min.x = std::min((*fi)->vert(v)->position().x, min.x);
-      min.y = std::min((*fi)->vert(v)->position().y, min.y);
-      min.z = std::min((*fi)->vert(v)->position().z, min.z);
+      max.x = std::max(f.vert(v).position().x, max.x);
+      max.y = std::max(f.vert(v).position().y, max.y);
+      max.z = std::max(f.vert(v).position().z, max.z);
+      min.x = std::min(f.vert(v).position().x, min.x);
+      min.y = std::min(f.vert(v).position().y, min.y);
+      min.z = std::min(f.vert(v).position().z, min.z);
     }
 
-    faces.push_back(*fi);
-    sorted.by_x.push_back(*fi);
-    sorted.by_y.push_back(*fi);
-    sorted.by_z.push_back(*fi);
+    sorted.by_x.push_back(f);
+    sorted.by_y.push_back(f);
+    sorted.by_z.push_back(f);
   }
 
-  std::sort(sorted.by_x.begin(), sorted.by_x.end(), CompByAxis { X_AXIS });
-  std::sort(sorted.by_y.begin(), sorted.by_y.end(), CompByAxis { Y_AXIS });
-  std::sort(sorted.by_z.begin(), sorted.by_z.end(), CompByAxis { Z_AXIS });
+  if (params.builder == KD_BUILD_SAH) {
+    sorted.upper_x = sorted.upper_y = sorted.upper_z = sorted.by_x;
+    std::sort(sorted.by_x.begin(), sorted.by_x.end(), CompBoundsByAxis { { X_AXIS }, false });
+    std::sort(sorted.by_y.begin(), sorted.by_y.end(), CompBoundsByAxis { { Y_AXIS }, false });
+    std::sort(sorted.by_z.begin(), sorted.by_z.end(), CompBoundsByAxis { { Z_AXIS }, false });
+    std::sort(sorted.upper_x.begin(), sorted.upper_x.end(), CompBoundsByAxis { { X_AXIS }, true });
+    std::sort(sorted.upper_y.begin(), sorted.upper_y.end(), CompBoundsByAxis { { Y_AXIS }, true });
+    std::sort(sorted.upper_z.begin(), sorted.upper_z.end(), CompBoundsByAxis { { Z_AXIS }, true });
+  } else {
+    std::sort(sorted.by_x.begin(), sorted.by_x.end(), CompByAxis { X_AXIS });
+    std::sort(sorted.by_y.begin(), sorted.by_y.end(), CompByAxis { Y_AXIS });
+    std::sort(sorted.by_z.begin(), sorted.by_z.end(), CompByAxis { Z_AXIS });
+  }
 
-  BBox bbox(min - glm::vec3(EPSILON), max + glm::vec3(EPSILON));
+  _bbox = BBox(min - glm::vec3(EPSILON), max + glm::vec3(EPSILON));
 
-  construct(sorted, bbox);
+  KDBuildNode root;
+  root.construct(sorted, _bbox, params);
+  flatten(&root, mesh);
 }
 
-std::unordered_set<const Face*> KDTree::collect_possible_faces(const Ray &ray,
-    const glm::mat4 &modelmat) const
-{
-  glm::mat4 inv_modelmat = glm::inverse(modelmat);
-  Ray inv_ray(apply_homog(inv_modelmat, ray.origin(), VEC3_POINT),
-      apply_homog(inv_modelmat, ray.direction(), VEC3_DIR));
-  std::unordered_set<const Face*> set;
-  add_intersecting(inv_ray, set);
-  return set;
+uint32_t KDTree::flatten(const KDBuildNode *build_node, const Mesh *mesh) {
+  uint32_t idx = _nodes.size();
+  _nodes.push_back(node());
+
+  if (!build_node->_child1 || !build_node->_child2) {
+    unsigned n_faces = build_node->_faces.size();
+    _nodes[idx].packet_offset = _packets.size();
+    _nodes[idx].bits = (n_faces << 2) | 3;
+
+    for (unsigned i = 0; i < n_faces; i += TRI_PACKET_WIDTH) {
+      TriPacket packet;
+      for (unsigned lane = 0; lane < TRI_PACKET_WIDTH; ++lane) {
+        if (i + lane < n_faces) {
+          uint32_t id = build_node->_faces[i + lane].index();
+          packet.set(lane, mesh->triangle(id), id);
+        } else {
+          packet.clear(lane);
+        }
+      }
+      _packets.push_back(packet);
+    }
+    return idx;
+  }
+
+  _nodes[idx].plane = build_node->_plane;
+  flatten(build_node->_child1, mesh);
+  uint32_t above = flatten(build_node->_child2, mesh);
+  _nodes[idx].bits = (above << 2) | build_node->_axis;
+
+  return idx;
 }
 
-void KDTree::add_debug_lines(DebugViz &dbviz, const glm::mat4 &modelmat) const {
-  if (!_child1 || !_child2) {
-    _bbox.add_debug_lines(dbviz, modelmat);
+bool KDTree::intersect(const glm::vec3 &origin, const glm::vec3 &dir, TriangleHit &hit) const {
+  if (_nodes.empty()) {
+    return false;
   }
 
-  if (_child1) {
-    _child1->add_debug_lines(dbviz, modelmat);
+  SlabRay ray(origin, dir);
+  float tmin = 0.0f;
+  float tmax = hit.t;
+  if (!_bbox.clip_ray(ray, tmin, tmax)) {
+    return false;
   }
 
-  if (_child2) {
-    _child2->add_debug_lines(dbviz, modelmat);
+  struct entry {
+    uint32_t node;
+    float tmin, tmax;
+  } stack[KD_TREE_MAX_DEPTH];
+  unsigned stack_size = 0;
+
+  bool updated = false;
+  uint32_t idx = 0;
+
+  while (1) {
+    // Nodes come off the stack in front-to-back order, so a hit closer than
+    // the entry distance of the next node cannot be beaten by anything left.
+    if (hit.t < tmin) {
+      break;
+    }
+
+    const node &n = _nodes[idx];
+
+    if (!n.leaf()) {
+      int axis = n.axis();
+      float plane = n.plane;
+
+      bool below_first = origin[axis] < plane
+        || (origin[axis] == plane && dir[axis] <= 0.0f);
+      uint32_t near = below_first ? idx + 1 : n.above_child();
+      uint32_t far = below_first ? n.above_child() : idx + 1;
+
+      if (dir[axis] == 0.0f) {
+        // Parallel to the split plane. A ray lying in the plane may hit faces
+        // on either side of it.
+        if (origin[axis] == plane) {
+          assert(stack_size < KD_TREE_MAX_DEPTH);
+          stack[stack_size++] = entry { far, tmin, tmax };
+        }
+        idx = near;
+        continue;
+      }
+
+      float t_split = (plane - origin[axis]) * ray.inv_dir[axis];
+      if (t_split > tmax || t_split <= 0.0f) {
+        idx = near;
+      } else if (t_split < tmin) {
+        idx = far;
+      } else {
+        assert(stack_size < KD_TREE_MAX_DEPTH);
+        stack[stack_size++] = entry { far, t_split, tmax };
+        idx = near;
+        tmax = t_split;
+      }
+
+      continue;
+    }
+
+    updated |= intersect_tri_packets(&_packets[n.packet_offset], n.num_packets(), origin, dir, hit);
+
+    if (stack_size == 0) {
+      break;
+    }
+
+    --stack_size;
+    idx = stack[stack_size].node;
+    tmin = stack[stack_size].tmin;
+    tmax = stack[stack_size].tmax;
   }
+
+  return updated;
 }
 
-bool KDTree::contains_face(const Face *f) const {
-  CompByAxis comp = { _axis };
+bool KDTree::occluded(const glm::vec3 &origin, const glm::vec3 &dir, float t_max) const {
+  if (_nodes.empty()) {
+    return false;
+  }
 
-  int split = comp.face_split(f, _plane);
-  if (split == SPLIT_LEFT && _child1) {
-    return _child1->contains_face(f);
-  } else if (split == SPLIT_RIGHT && _child2) {
-    return _child2->contains_face(f);
-  } else if (split == SPLIT_NEITHER && _child1 && _child2) {
-    return _child1->contains_face(f) && _child2->contains_face(f);
-  } else {
-    for (unsigned i = 0; i < _faces.size(); ++i) {
-      if (_faces[i] == f) {
-        return true;
+  SlabRay ray(origin, dir);
+  float tmin = 0.0f;
+  float tmax = t_max;
+  if (!_bbox.clip_ray(ray, tmin, tmax)) {
+    return false;
+  }
+
+  struct entry {
+    uint32_t node;
+    float tmin, tmax;
+  } stack[KD_TREE_MAX_DEPTH];
+  unsigned stack_size = 0;
+
+  uint32_t idx = 0;
+
+  while (1) {
+    const node &n = _nodes[idx];
+
+    if (!n.leaf()) {
+      int axis = n.axis();
+      float plane = n.plane;
+
+      bool below_first = origin[axis] < plane
+        || (origin[axis] == plane && dir[axis] <= 0.0f);
+      uint32_t near = below_first ? idx + 1 : n.above_child();
+      uint32_t far = below_first ? n.above_child() : idx + 1;
+
+      if (dir[axis] == 0.0f) {
+        if (origin[axis] == plane) {
+          assert(stack_size < KD_TREE_MAX_DEPTH);
+          stack[stack_size++] = entry { far, tmin, tmax };
+        }
+        idx = near;
+        continue;
+      }
+
+      float t_split = (plane - origin[axis]) * ray.inv_dir[axis];
+      if (t_split > tmax || t_split <= 0.0f) {
+        idx = near;
+      } else if (t_split < tmin) {
+        idx = far;
+      } else {
+        assert(stack_size < KD_TREE_MAX_DEPTH);
+        stack[stack_size++] = entry { far, t_split, tmax };
+        idx = near;
+        tmax = t_split;
       }
+
+      continue;
+    }
+
+    // Any face closer than t_max will do, even one lying outside this leaf
+    if (tri_packets_occlude(&_packets[n.packet_offset], n.num_packets(), origin, dir, t_max)) {
+      return true;
     }
+
+    if (stack_size == 0) {
+      break;
+    }
+
+    --stack_size;
+    idx = stack[stack_size].node;
+    tmin = stack[stack_size].tmin;
+    tmax = stack[stack_size].tmax;
   }
 
   return false;
 }
 
-void KDTree::add_intersecting(const Ray &ray, std::unordered_set<const Face*> &set) const {
-  if (!_bbox.ray_intersects(ray)) {
+uint32_t KDTree::intersect_packet(const glm::vec3 *origins, const glm::vec3 *dirs,
+    unsigned n, TriangleHit *hits) const
+{
+  assert(n <= RAY_PACKET_SIZE);
+
+  if (_nodes.empty()) {
+    return 0;
+  }
+
+  uint32_t updated = 0;
+
+  // The rays must agree on which child of each node is the near one
+  bool coherent = true;
+  for (unsigned i = 1; i < n && coherent; ++i) {
+    for (unsigned a = 0; a < 3; ++a) {
+      coherent = coherent && std::signbit(dirs[i][a]) == std::signbit(dirs[0][a]);
+    }
+  }
+
+  if (!coherent) {
+    for (unsigned i = 0; i < n; ++i) {
+      if (intersect(origins[i], dirs[i], hits[i])) {
+        updated |= 1u << i;
+      }
+    }
+    return updated;
+  }
+
+  // Each entry holds the rays still active in a node, and the interval of each
+  // ray that lies within the node.
+  struct entry {
+    uint32_t node;
+    uint32_t mask;
+    float tmin[RAY_PACKET_SIZE], tmax[RAY_PACKET_SIZE];
+  } stack[KD_TREE_MAX_DEPTH];
+  unsigned stack_size = 0;
+
+  entry cur;
+  cur.node = 0;
+  cur.mask = 0;
+  for (unsigned i = 0; i < n; ++i) {
+    cur.tmin[i] = 0.0f;
+    cur.tmax[i] = hits[i].t;
+    if (_bbox.clip_ray(SlabRay(origins[i], dirs[i]), cur.tmin[i], cur.tmax[i])) {
+      cur.mask |= 1u << i;
+    }
+  }
+
+  while (1) {
+    // As with single rays, a ray is done once it has a hit closer than the
+    // entry distance of the node it is in.
+    for (unsigned i = 0; i < n; ++i) {
+      if ((cur.mask & (1u << i)) && hits[i].t < cur.tmin[i]) {
+        cur.mask &= ~(1u << i);
+      }
+    }
+
+    const node &nd = _nodes[cur.node];
+
+    if (cur.mask != 0 && !nd.leaf()) {
+      int axis = nd.axis();
+      float plane = nd.plane;
+
+      bool below_first = !std::signbit(dirs[0][axis]);
+      uint32_t near = below_first ? cur.node + 1 : nd.above_child();
+      uint32_t far = below_first ? nd.above_child() : cur.node + 1;
+
+      assert(stack_size < KD_TREE_MAX_DEPTH);
+      entry &far_entry = stack[stack_size];
+      uint32_t near_mask = 0, far_mask = 0;
+
+      for (unsigned i = 0; i < n; ++i) {
+        uint32_t bit = 1u << i;
+        if (!(cur.mask & bit)) {
+          continue;
+        }
+
+        // NaN when the ray lies in the split plane, in which case it may hit
+        // faces on either side of it
+        float t_split = (plane - origins[i][axis]) / dirs[i][axis];
+
+        if (t_split > cur.tmax[i]) {
+          near_mask |= bit;
+        } else if (t_split < cur.tmin[i]) {
+          far_mask |= bit;
+          far_entry.tmin[i] = cur.tmin[i];
+          far_entry.tmax[i] = cur.tmax[i];
+        } else {
+          near_mask |= bit;
+          far_mask |= bit;
+          far_entry.tmin[i] = std::isnan(t_split) ? cur.tmin[i] : t_split;
+          far_entry.tmax[i] = cur.tmax[i];
+          if (!std::isnan(t_split)) {
+            cur.tmax[i] = t_split;
+          }
+        }
+      }
+
+      if (far_mask) {
+        far_entry.node = far;
+        far_entry.mask = far_mask;
+        ++stack_size;
+      }
+
+      if (near_mask) {
+        cur.node = near;
+        cur.mask = near_mask;
+        continue;
+      }
+    } else if (cur.mask != 0) {
+      const TriPacket *packets = &_packets[nd.packet_offset];
+      for (unsigned i = 0; i < n; ++i) {
+        if ((cur.mask & (1u << i))
+            && intersect_tri_packets(packets, nd.num_packets(), origins[i], dirs[i], hits[i]))
+        {
+          updated |= 1u << i;
+        }
+      }
+    }
+
+    if (stack_size == 0) {
+      break;
+    }
+
+    cur = stack[--stack_size];
+  }
+
+  return updated;
+}
+
+void KDTree::add_debug_lines(DebugViz &dbviz, const glm::mat4 &modelmat) const {
+  if (!_nodes.empty()) {
+    add_debug_lines(0, _bbox, dbviz, modelmat);
+  }
+}
+
+void KDTree::add_debug_lines(uint32_t idx, const BBox &bbox,
+    DebugViz &dbviz, const glm::mat4 &modelmat) const
+{
+  const node &n = _nodes[idx];
+  if (n.leaf()) {
+    bbox.add_debug_lines(dbviz, modelmat);
     return;
   }
 
-  for (unsigned i = 0; i < _faces.size(); ++i) {
-    set.insert(_faces[i]);
+  BBox bbox1, bbox2;
+  split_bbox(bbox, n.axis(), n.plane, bbox1, bbox2);
+  add_debug_lines(idx + 1, bbox1, dbviz, modelmat);
+  add_debug_lines(n.above_child(), bbox2, dbviz, modelmat);
+}
+
+bool KDTree::contains_face(const Face &f) const {
+  return !_nodes.empty() && contains_face(0, f);
+}
+
+bool KDTree::contains_face(uint32_t idx, const Face &f) const {
+  const node &n = _nodes[idx];
+
+  if (!n.leaf()) {
+    CompByAxis comp = { n.axis() };
+
+    int split = comp.face_split(f, n.plane);
+    if (split == SPLIT_LEFT) {
+      return contains_face(idx + 1, f);
+    } else if (split == SPLIT_RIGHT) {
+      return contains_face(n.above_child(), f);
+    } else {
+      return contains_face(idx + 1, f) && contains_face(n.above_child(), f);
+    }
   }
 
-  if (_child1) {
-    _child1->add_intersecting(ray, set);
+  for (uint32_t i = 0; i < n.num_faces(); ++i) {
+    if (_packets[n.packet_offset + i / TRI_PACKET_WIDTH].face[i % TRI_PACKET_WIDTH] == f.index()) {
+      return true;
+    }
   }
 
-  if (_child2) {
-    _child2->add_intersecting(ray, set);
+  return false;
+}
+
+KDTreeStats KDTree::stats(const KDTreeBuildParams &params) const {
+  KDTreeStats stats;
+  memset((void*) &stats, 0, sizeof(KDTreeStats));
+  if (!_nodes.empty()) {
+    stats.sah_cost = collect_stats(0, _bbox, stats, params, 0);
   }
+  return stats;
 }
 
-void KDTree::construct(const sorted_data &sorted, const BBox &bbox) {
-  _bbox = bbox;
+float KDTree::collect_stats(uint32_t idx, const BBox &bbox, KDTreeStats &stats,
+    const KDTreeBuildParams &params, unsigned depth) const
+{
+  const node &n = _nodes[idx];
 
-  assert(sorted.by_x.size() == sorted.by_y.size());
-  assert(sorted.by_y.size() == sorted.by_z.size());
+  ++stats.nodes;
+  stats.max_depth = std::max(stats.max_depth, depth);
 
-  if (sorted.by_x.size() <= 16) {
-    for (unsigned i = 0; i < sorted.by_x.size(); ++i) {
-      _faces.push_back(sorted.by_x[i]);
+  if (n.leaf()) {
+    ++stats.leaves;
+    if (n.num_faces() == 0) {
+      ++stats.empty_leaves;
     }
-    return;
+    stats.face_refs += n.num_faces();
+    return params.intersect_cost * n.num_faces();
+  }
+
+  BBox bbox1, bbox2;
+  split_bbox(bbox, n.axis(), n.plane, bbox1, bbox2);
+
+  float cost1 = collect_stats(idx + 1, bbox1, stats, params, depth + 1);
+  float cost2 = collect_stats(n.above_child(), bbox2, stats, params, depth + 1);
+  return params.traversal_cost
+    + (bbox1.surface_area() * cost1 + bbox2.surface_area() * cost2) / bbox.surface_area();
+}
+
+bool KDBuildNode::find_median_split(const sorted_data &sorted, const KDTreeBuildParams &params) {
+  if (sorted.by_x.size() <= params.max_leaf_faces) {
+    return false;
   }
 
-  float range_x = sorted.by_x.back()->centroid().x - sorted.by_x.front()->centroid().x;
-  float range_y = sorted.by_y.back()->centroid().y - sorted.by_y.front()->centroid().y;
-  float range_z = sorted.by_z.back()->centroid().z - sorted.by_z.front()->centroid().z;
+  float range_x = sorted.by_x.back().centroid().x - sorted.by_x.front().centroid().x;
+  float range_y = sorted.by_y.back().centroid().y - sorted.by_y.front().centroid().y;
+  float range_z = sorted.by_z.back().centroid().z - sorted.by_z.front().centroid().z;
 
   float mid1, mid2;
   if (range_x >= range_y && range_x >= range_z) {
     _axis = X_AXIS;
-    mid1 = sorted.by_x[sorted.by_x.size() / 2 - 1]->centroid().x;
-    mid2 = sorted.by_x[sorted.by_x.size() / 2]->centroid().x;
+    mid1 = sorted.by_x[sorted.by_x.size() / 2 - 1].centroid().x;
+    mid2 = sorted.by_x[sorted.by_x.size() / 2].centroid().x;
   } else if (range_y >= range_x && range_y >= range_z) {
     _axis = Y_AXIS;
-    mid1 = sorted.by_y[sorted.by_y.size() / 2 - 1]->centroid().y;
-    mid2 = sorted.by_y[sorted.by_y.size() / 2]->centroid().y;
+    mid1 = sorted.by_y[sorted.by_y.size() / 2 - 1].centroid().y;
+    mid2 = sorted.by_y[sorted.by_y.size() / 2].centroid().y;
   } else {
     _axis = Z_AXIS;
-    mid1 = sorted.by_z[sorted.by_z.size() / 2 - 1]->centroid().z;
-    mid2 = sorted.by_z[sorted.by_z.size() / 2]->centroid().z;
+    mid1 = sorted.by_z[sorted.by_z.size() / 2 - 1].centroid().z;
+    mid2 = sorted.by_z[sorted.by_z.size() / 2].centroid().z;
   }
 
   _plane = 0.5f * (mid1 + mid2);
 
-  BBox bbox1(_bbox), bbox2(_bbox);
-  if (_axis == X_AXIS) {
-    bbox1.set_max_x(_plane);
-    bbox2.set_min_x(_plane);
-  } else if (_axis == Y_AXIS) {
-    bbox1.set_max_y(_plane);
-    bbox2.set_min_y(_plane);
-  } else {
-    bbox1.set_max_z(_plane);
-    bbox2.set_min_z(_plane);
-  }
+  BBox bbox1, bbox2;
+  split_bbox(_bbox, _axis, _plane, bbox1, bbox2);
+  return bbox1.volume() >= EPSILON && bbox2.volume() >= EPSILON;
+}
 
-  if (bbox1.volume() < EPSILON || bbox2.volume() < EPSILON) {
-    for (unsigned i = 0; i < sorted.by_x.size(); ++i) {
-      _faces.push_back(sorted.by_x[i]);
-    }
-    return;
-  }
+// Candidate planes for the SAH builder are taken at the bounds of each face
+// along the axis: at its minimum, above which it lies entirely, and just past
+// its maximum, below which it lies entirely. As in CompByAxis::face_split, a
+// face goes below a plane if its minimum is less than it, and above if its
+// maximum is not. Both the candidates and the counts on either side come from
+// one sweep over the node's lists sorted by lower and upper bounds.
+bool KDBuildNode::find_sah_split(const sorted_data &sorted, const KDTreeBuildParams &params) {
+  size_t n = sorted.by_x.size();
+  float area = _bbox.surface_area();
+  float best_cost = params.intersect_cost * n; // cost of making this a leaf
+  bool found = false;
+
+  for (int axis = X_AXIS; axis <= Z_AXIS; ++axis) {
+    CompBoundsByAxis lower = { { axis }, false };
+    CompBoundsByAxis upper = { { axis }, true };
+    const std::vector<Face> &by_lower = axis == X_AXIS ? sorted.by_x
+      : axis == Y_AXIS ? sorted.by_y : sorted.by_z;
+    const std::vector<Face> &by_upper = axis == X_AXIS ? sorted.upper_x
+      : axis == Y_AXIS ? sorted.upper_y : sorted.upper_z;
+    assert(by_upper.size() == n);
+
+    float lo = lower.comp.get_coord(_bbox.min());
+    float hi = lower.comp.get_coord(_bbox.max());
+
+    // Candidates are visited in increasing order, merged from the two lists,
+    // so the counts of minima and maxima below the plane only move forwards
+    size_t next_lower = 0, next_upper = 0;
+    size_t n_min_below = 0, n_max_below = 0;
+    while (next_lower < n || next_upper < n) {
+      float plane;
+      float upper_plane = next_upper < n
+        ? std::nextafter(upper.bound(by_upper[next_upper]), HUGE_VALF) : HUGE_VALF;
+      if (next_lower < n && lower.bound(by_lower[next_lower]) <= upper_plane) {
+        plane = lower.bound(by_lower[next_lower++]);
+      } else {
+        plane = upper_plane;
+        next_upper++;
+      }
 
-  CompByAxis comp = { _axis };
-  sorted_data sorted1, sorted2;
-  for (unsigned i = 0; i < sorted.by_x.size(); ++i) {
-    int splitx = comp.face_split(sorted.by_x[i], _plane);
-    int splity = comp.face_split(sorted.by_y[i], _plane);
-    int splitz = comp.face_split(sorted.by_z[i], _plane);
-
-    if (splitx == SPLIT_LEFT) {
-      sorted1.by_x.push_back(sorted.by_x[i]);
-    } else if (splitx == SPLIT_RIGHT) {
-      sorted2.by_x.push_back(sorted.by_x[i]);
-    } else {
-      sorted1.by_x.push_back(sorted.by_x[i]);
-      sorted2.by_x.push_back(sorted.by_x[i]);
-    }
+      if (plane <= lo || plane >= hi) {
+        continue;
+      }
 
-    if (splity == SPLIT_LEFT) {
-      sorted1.by_y.push_back(sorted.by_y[i]);
-    } else if (splity == SPLIT_RIGHT) {
-      sorted2.by_y.push_back(sorted.by_y[i]);
-    } else {
-      sorted1.by_y.push_back(sorted.by_y[i]);
-      sorted2.by_y.push_back(sorted.by_y[i]);
-    }
+      while (n_min_below < n && lower.bound(by_lower[n_min_below]) < plane) {
+        n_min_below++;
+      }
+      while (n_max_below < n && upper.bound(by_upper[n_max_below]) < plane) {
+        n_max_below++;
+      }
+      size_t n_below = n_min_below;
+      size_t n_above = n - n_max_below;
 
-    if (splitz == SPLIT_LEFT) {
-      sorted1.by_z.push_back(sorted.by_z[i]);
-    } else if (splitz == SPLIT_RIGHT) {
-      sorted2.by_z.push_back(sorted.by_z[i]);
-    } else {
-      sorted1.by_z.push_back(sorted.by_z[i]);
-      sorted2.by_z.push_back(sorted.by_z[i]);
-    }
-  }
+      BBox below, above;
+      split_bbox(_bbox, axis, plane, below, above);
 
-  _child1 = new KDTree();
-  _child2 = new KDTree();
+      float bonus = (n_below == 0 || n_above == 0) ? 1.0f - params.empty_bonus : 1.0f;
+      float cost = params.traversal_cost + params.intersect_cost * bonus
+        * (below.surface_area() * n_below + above.surface_area() * n_above) / area;
 
-  _child1->construct(sorted1, bbox1);
-  _child2->construct(sorted2, bbox2);
-}
+      if (cost < best_cost) {
+        best_cost = cost;
+        _axis = axis;
+        _plane = plane;
+        found = true;
+      }
+    }
+  }
 
-void KDTree::copy(const KDTree &other) {
-  _bbox = other._bbox;
-  _child1 = new KDTree(*other._child1);
-  _child2 = new KDTree(*other._child2);
-  _axis = other._axis;
-  _plane = other._plane;
-  _faces = other._faces;
+  return found;
 }
 
-void KDTree::move(KDTree &&other) {
-  _bbox = other._bbox;
-  _child1 = other._child1;
-  _child2 = other._child2;
-  _axis = other._axis;
-  _plane = other._plane;
-  _faces = std::move(other._faces);
+void KDBuildNode::construct(const sorted_data &sorted, const BBox &bbox,
+    const KDTreeBuildParams &params, unsigned depth)
+{
+  _bbox = bbox;
 
-  other._child1 = other._child2 = NULL;
-}
+  assert(sorted.by_x.size() == sorted.by_y.size());
+  assert(sorted.by_y.size() == sorted.by_z.size());
 
-void KDTree::destroy() {
-  if (_child1) {
-    delete _child1;
+  bool split = false;
+  if (!sorted.by_x.empty() && depth + 1 < KD_TREE_MAX_DEPTH) {
+    if (params.builder == KD_BUILD_SAH) {
+      split = find_sah_split(sorted, params);
+    } else {
+      split = find_median_split(sorted, params);
+    }
   }
 
-  if (_child2) {
-    delete _child2;
+  if (!split) {
+    for (unsigned i = 0; i < sorted.by_x.size(); ++i) {
+      _faces.push_back(sorted.by_x[i]);
+    }
+    return;
   }
 
-  _child1 = _child2 = NULL;
+  BBox bbox1, bbox2;
+  split_bbox(_bbox, _axis, _plane, bbox1, bbox2);
+
+  CompByAxis comp = { _axis };
+  sorted_data sorted1, sorted2;
+  split_faces(sorted.by_x, comp, _plane, sorted1.by_x, sorted2.by_x);
+  split_faces(sorted.by_y, comp, _plane, sorted1.by_y, sorted2.by_y);
+  split_faces(sorted.by_z, comp, _plane, sorted1.by_z, sorted2.by_z);
+  split_faces(sorted.upper_x, comp, _plane, sorted1.upper_x, sorted2.upper_x);
+  split_faces(sorted.upper_y, comp, _plane, sorted1.upper_y, sorted2.upper_y);
+  split_faces(sorted.upper_z, comp, _plane, sorted1.upper_z, sorted2.upper_z);
+
+  _child1 = new KDBuildNode();
+  _child2 = new KDBuildNode();
+
+  if (std::min(sorted1.by_x.size(), sorted2.by_x.size()) < KD_PARALLEL_BUILD_FACES) {
+    _child1->construct(sorted1, bbox1, params, depth + 1);
+    _child2->construct(sorted2, bbox2, params, depth + 1);
+    return;
+  }
 
-  _faces.clear();
+  // Build the lower subtree on the thread pool while this thread builds the
+  // upper one
+  construct_args args = { _child1, &sorted1, bbox1, &params, depth + 1 };
+  ThreadPool::TaskGroup group;
+  thread_pool().submit(construct_task, (void*) &args, group);
+  _child2->construct(sorted2, bbox2, params, depth + 1);
+  thread_pool().wait(group);
 }
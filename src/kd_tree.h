@@ -1,98 +1,256 @@
 #ifndef KD_TREE_H_
 #define KD_TREE_H_
 
-#include <unordered_set>
+#include <unordered_map>
 #include <vector>
 
 #include <cmath>
+#include <cstdint>
 
 #include <glm/glm.hpp>
 
 #include "debug_viz.h"
+#include "tri_packet.h"
+
+// Maximum depth of a KDTree. Traversal keeps a fixed-size stack of this many
+// entries, so construction stops splitting once this depth is reached.
+#define KD_TREE_MAX_DEPTH 64
+
+// KDTree construction strategies.
+#define KD_BUILD_MEDIAN 0 // split at the median centroid of the longest axis
+#define KD_BUILD_SAH    1 // split where the Surface Area Heuristic is minimized
+
+// Maximum number of rays traced together as a packet.
+#define RAY_PACKET_SIZE 16
 
 class Ray;
 class Mesh;
 class Face;
+struct Triangle;
+struct TriangleHit;
+
+// A ray prepared for slab tests against many boxes: the reciprocal of its
+// direction, and which way it points along each axis.
+struct SlabRay {
+  SlabRay(const glm::vec3 &origin, const glm::vec3 &dir);
+
+  glm::vec3 origin;
+  glm::vec3 inv_dir; // infinite along axes the ray is parallel to
+  int sign[3];       // 1 where the direction is negative (including -0), else 0
+};
+
+// Conservative bounds on the origins and directions of a packet of rays, for
+// culling the whole packet against a box at once.
+struct RayInterval {
+  RayInterval(const glm::vec3 *origins, const glm::vec3 *dirs, unsigned n);
+
+  // True if the directions of all rays lie in the same octant. The bounds below
+  // are only meaningful if this is set.
+  bool coherent;
+
+  glm::vec3 min_origin, max_origin;
+  glm::vec3 min_rcp, max_rcp; // bounds on the reciprocals of the directions
+
+  // Axes along which some ray's direction is zero; these are not used for culling.
+  bool parallel[3];
+};
 
 class BBox {
   public:
     BBox() = default;
-    BBox(const glm::vec3 &min, const glm::vec3 &max) : _min(min), _max(max) {
+    BBox(const glm::vec3 &min, const glm::vec3 &max) {
       assert(min.x <= max.x);
       assert(min.y <= max.y);
       assert(min.z <= max.z);
+      _bounds[0] = min;
+      _bounds[1] = max;
     }
 
-    const glm::vec3 &min() const { return _min; }
-    const glm::vec3 &max() const { return _max; }
+    const glm::vec3 &min() const { return _bounds[0]; }
+    const glm::vec3 &max() const { return _bounds[1]; }
+
+    void set_min_x(float x) { _bounds[0].x = x; }
+    void set_min_y(float y) { _bounds[0].y = y; }
+    void set_min_z(float z) { _bounds[0].z = z; }
+
+    void set_max_x(float x) { _bounds[1].x = x; }
+    void set_max_y(float y) { _bounds[1].y = y; }
+    void set_max_z(float z) { _bounds[1].z = z; }
 
-    void set_min_x(float x) { _min.x = x; }
-    void set_min_y(float y) { _min.y = y; }
-    void set_min_z(float z) { _min.z = z; }
+    float x_range() const { return max().x - min().x; }
+    float y_range() const { return max().y - min().y; }
+    float z_range() const { return max().z - min().z; }
 
-    void set_max_x(float x) { _max.x = x; }
-    void set_max_y(float y) { _max.y = y; }
-    void set_max_z(float z) { _max.z = z; }
+    // Clip the ray against this box, narrowing [t_near, t_far] to the portion
+    // of the ray inside it. Returns false if that portion is empty. Rays with a
+    // NaN component miss, as SlabRay moves them out to infinity. A ray lying
+    // exactly in the plane of a face counts as inside that face's slab.
+    bool clip_ray(const SlabRay &ray, float &t_near, float &t_far) const;
 
-    float x_range() const { return _max.x - _min.x; }
-    float y_range() const { return _max.y - _min.y; }
-    float z_range() const { return _max.z - _min.z; }
+    // Check whether any ray of a coherent packet might hit this box at a
+    // distance in [0, t_max]. This may report a hit when there is none, but
+    // never misses one.
+    bool interval_intersects(const RayInterval &iv, float t_max) const;
 
-    bool ray_intersects(const Ray &ray) const;
+    glm::vec3 center() const { return 0.5f * (min() + max()); }
+
+    // Get the bounding box of this box under the given transformation.
+    BBox transformed(const glm::mat4 &modelmat) const;
 
     float volume() const { return x_range() * y_range() * z_range(); }
+    float surface_area() const {
+      return 2.0f * (x_range()*y_range() + y_range()*z_range() + z_range()*x_range());
+    }
 
     void add_debug_lines(DebugViz &dbviz, const glm::mat4 &modelmat = glm::mat4(1.0)) const;
 
   private:
-    glm::vec3 _min;
-    glm::vec3 _max;
+    glm::vec3 _bounds[2]; // min and max, indexed by SlabRay::sign
 };
 
+// Number of boxes in a BBox4.
+#define BBOX4_WIDTH 4
+
+// Up to BBOX4_WIDTH boxes in structure-of-arrays layout, for clipping one ray
+// against all of them at once. Unused lanes hold empty boxes, which no ray hits.
+struct BBox4 {
+  float min_x[BBOX4_WIDTH], min_y[BBOX4_WIDTH], min_z[BBOX4_WIDTH];
+  float max_x[BBOX4_WIDTH], max_y[BBOX4_WIDTH], max_z[BBOX4_WIDTH];
+
+  void set(unsigned lane, const BBox &box);
+
+  // Fill a lane with an empty box.
+  void clear(unsigned lane);
+
+  // Get the box in a lane, which must not be empty.
+  BBox box(unsigned lane) const;
+
+  // Clip the ray against every box, as BBox::clip_ray with [0, t_max]. Returns
+  // a mask with bit i set if the ray hits box i, and stores the distance at
+  // which it enters each box hit in t_near[i].
+  unsigned clip_ray(const SlabRay &ray, float t_max, float t_near[BBOX4_WIDTH]) const;
+};
+
+// Parameters controlling how a KDTree is built.
+struct KDTreeBuildParams {
+  KDTreeBuildParams() :
+    builder(KD_BUILD_MEDIAN), traversal_cost(1.0), intersect_cost(2.0),
+    empty_bonus(0.5), max_leaf_faces(16) {}
+
+  int builder; // one of KD_BUILD_MEDIAN or KD_BUILD_SAH
+
+  // SAH cost of stepping through an interior node, and of testing one face.
+  // These are also used when reporting the expected cost of a tree.
+  float traversal_cost;
+  float intersect_cost;
+
+  // Fraction by which the SAH cost of a split is reduced when one side is
+  // empty, encouraging the builder to cut off empty space.
+  float empty_bonus;
+
+  // Median builder only: nodes with this many faces or fewer become leaves.
+  unsigned max_leaf_faces;
+};
+
+// Get and set the parameters used for KDTrees built from now on.
+const KDTreeBuildParams &kd_tree_build_params();
+void set_kd_tree_build_params(const KDTreeBuildParams &params);
+
+// Summary of the shape of a KDTree.
+struct KDTreeStats {
+  unsigned nodes;
+  unsigned leaves;
+  unsigned empty_leaves;
+  unsigned max_depth;
+  size_t face_refs; // total face references over all leaves
+
+  // Expected cost of tracing a ray that hits the tree's bounding box, according
+  // to the SAH with the cost constants of the build parameters.
+  float sah_cost;
+};
+
+class KDBuildNode;
+
+// A KD-tree over the faces of a Mesh, in the Mesh's object space.
+//
+// The tree is built as a tree of heap-allocated nodes, and then compiled into
+// one contiguous array of compact nodes. The vertex data of each leaf's faces
+// is copied into TriPackets, laid out for the SIMD intersection kernels, and
+// the packets of all leaves are kept in a single array. Only the compiled form
+// is kept.
 class KDTree {
   public:
-    KDTree() : _child1(NULL), _child2(NULL) {}
-    KDTree(const KDTree &other) { copy(other); }
-    KDTree(KDTree &&other) { move(std::move(other)); }
+    KDTree() {}
+    KDTree(const Mesh *mesh, const KDTreeBuildParams &params = kd_tree_build_params());
 
-    KDTree &operator=(const KDTree &other) { destroy(); copy(other); return *this; }
-    KDTree &operator=(KDTree &&other) { destroy(); move(std::move(other)); return *this; }
+    // Bounding box of the tree, in object space.
+    const BBox &bbox() const { return _bbox; }
 
-    ~KDTree() { destroy(); }
+    // Find the closest intersection, nearer than `hit.t`, of the object space
+    // ray `origin + t*dir` with the faces in this tree. Leaves are visited front
+    // to back, and traversal stops as soon as the closest hit is known. Returns
+    // true if `hit` was updated.
+    bool intersect(const glm::vec3 &origin, const glm::vec3 &dir, TriangleHit &hit) const;
 
-    KDTree(const Mesh *mesh);
+    // Check whether the object space ray `origin + t*dir` hits any face in this
+    // tree at a distance less than t_max. Traversal stops at the first such face
+    // found.
+    bool occluded(const glm::vec3 &origin, const glm::vec3 &dir, float t_max) const;
 
-    std::unordered_set<const Face*> collect_possible_faces(const Ray &ray,
-        const glm::mat4 &modelmat = glm::mat4(1.0)) const;
+    // Find the closest intersections of `n` object space rays at once, where n
+    // is at most RAY_PACKET_SIZE, as with intersect(). Rays whose directions lie
+    // in the same octant are traversed together, and otherwise one at a time.
+    // Returns a bit mask of the rays whose hits were updated.
+    uint32_t intersect_packet(const glm::vec3 *origins, const glm::vec3 *dirs,
+        unsigned n, TriangleHit *hits) const;
 
     void add_debug_lines(DebugViz &dbviz, const glm::mat4 &modelmat) const;
 
-    bool contains_face(const Face *f) const;
+    // Check that the face `f` of the Mesh is in every leaf it overlaps.
+    bool contains_face(const Face &f) const;
+
+    // Gather statistics about this tree. The SAH cost is computed with the cost
+    // constants in `params`, so that trees from different builders can be compared.
+    KDTreeStats stats(const KDTreeBuildParams &params = kd_tree_build_params()) const;
+
+    // Bytes taken up by the compiled node and triangle packet arrays.
+    size_t node_bytes() const { return _nodes.size() * sizeof(node); }
+    size_t packet_bytes() const { return _packets.size() * sizeof(TriPacket); }
 
   private:
-    void copy(const KDTree&);
-    void move(KDTree&&);
-    void destroy();
-
-    struct sorted_data {
-      std::vector<const Face*> by_x;
-      std::vector<const Face*> by_y;
-      std::vector<const Face*> by_z;
-    };
+    // A compiled tree node, 8 bytes in size. The low two bits of `bits` hold
+    // the split axis, or 3 for a leaf, and the remaining bits hold the index of
+    // the child above the split plane or the number of faces in the leaf. The
+    // child below the split plane always immediately follows its parent.
+    struct node {
+      union {
+        float plane;             // interior nodes: split plane position
+        uint32_t packet_offset;  // leaves: offset of first packet in _packets
+      };
+      uint32_t bits;
 
-    void construct(const sorted_data &sorted, const BBox &bbox);
-    void add_intersecting(const Ray &ray, std::unordered_set<const Face*> &set) const;
+      bool leaf() const { return (bits & 3) == 3; }
+      int axis() const { return bits & 3; }
+      uint32_t above_child() const { return bits >> 2; }
+      uint32_t num_faces() const { return bits >> 2; }
+      uint32_t num_packets() const {
+        return (num_faces() + TRI_PACKET_WIDTH - 1) / TRI_PACKET_WIDTH;
+      }
+    };
 
-    BBox _bbox;
-    KDTree *_child1;
-    KDTree *_child2;
+    uint32_t flatten(const KDBuildNode *build_node, const Mesh *mesh);
 
-    int _axis;
-    float _plane;
+    void add_debug_lines(uint32_t idx, const BBox &bbox,
+        DebugViz &dbviz, const glm::mat4 &modelmat) const;
+    bool contains_face(uint32_t idx, const Face &f) const;
+    float collect_stats(uint32_t idx, const BBox &bbox, KDTreeStats &stats,
+        const KDTreeBuildParams &params, unsigned depth) const;
 
-    std::vector<const Face*> _faces;
+    BBox _bbox;
+    std::vector<node> _nodes;
+    std::vector<TriPacket> _packets;
 
-    friend struct CompByAxis;
+    friend class MeshCache;
 };
 
 /*
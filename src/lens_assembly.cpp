@@ -1,12 +1,19 @@
 #include "lens_assembly.h"
 
+#include <algorithm>
 #include <fstream>
 #include <string>
 
+#include <cfloat>
 #include <cmath>
 
 #include "util.h"
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define LENS_BATCH_SSE
+#include <xmmintrin.h>
+#endif
+
 LensAssembly LensAssembly::from_la(const char *filename) {
   std::string dirs = dirname(filename);
 
@@ -58,6 +65,7 @@ LensAssembly LensAssembly::from_la(const char *filename) {
   }
 
   assembly.find_pupil();
+  assembly.find_pupil_bounds();
   return assembly;
 }
 
@@ -234,57 +242,526 @@ void LensAssembly::find_cardinal_points() {
   reduce(0, _surfaces.size(), &_system_power, &_system_p1, &_system_p2, NULL, NULL);
 }
 
-Ray LensAssembly::generate_ray(float x, float y) const {
-  glm::vec3 origin(x, y, _system_p2 + _dist);
+LensAssembly::pupil_bounds LensAssembly::trace_pupil_bounds(float r) const {
+  float z = _system_p2 + _dist;
+  float cell = 2*_exit_pupil_rad / LENS_PUPIL_GRID;
+
+  // Each ray of the grid that gets through grows the bounds by the cells
+  // around it, so that they are not too tight where they fall between rays
+  pupil_bounds b;
+  for (unsigned j = 0; j < LENS_PUPIL_GRID; ++j) {
+    for (unsigned i = 0; i < LENS_PUPIL_GRID; ++i) {
+      glm::vec2 p(-_exit_pupil_rad + (i + 0.5f)*cell, -_exit_pupil_rad + (j + 0.5f)*cell);
+      if (glm::length(p) > _exit_pupil_rad) {
+        continue;
+      }
 
-  float theta = 2*PI*randf(), r = sqrt(randf())*_exit_pupil_rad;
-  glm::vec3 pupil_pt(r*cos(theta), r*sin(theta), _exit_pupil_pos);
+      Ray unused(glm::vec3(0.0), glm::vec3(0.0, 0.0, -1.0));
+      if (trace_from_sensor(glm::vec3(r, 0.0, z), glm::vec3(p.x, p.y, _exit_pupil_pos), unused)) {
+        b.add(p - glm::vec2(cell));
+        b.add(p + glm::vec2(cell));
+      }
+    }
+  }
 
-  glm::vec3 direction = glm::normalize(pupil_pt - origin);
+  if (!b.empty()) {
+    b.lo = glm::max(b.lo, glm::vec2(-_exit_pupil_rad));
+    b.hi = glm::min(b.hi, glm::vec2(_exit_pupil_rad));
+  }
+  return b;
+}
+
+void LensAssembly::find_pupil_bounds() {
+  // The table reaches out to the first power of two (in millimeters) at which
+  // nothing gets through
+  _pupil_table_radius = 1.0;
+  while (_pupil_table_radius < LENS_MAX_SENSOR_RADIUS && !trace_pupil_bounds(_pupil_table_radius).empty()) {
+    _pupil_table_radius *= 2;
+  }
 
-  RayHit rayhit(origin, direction);
+  _pupil_table.resize(LENS_PUPIL_TABLE_SIZE);
+  for (unsigned i = 0; i < LENS_PUPIL_TABLE_SIZE; ++i) {
+    _pupil_table[i] = trace_pupil_bounds(_pupil_table_radius * i / (LENS_PUPIL_TABLE_SIZE - 1));
+  }
+}
 
-  for (unsigned _i = 0; _i < _surfaces.size(); ++_i) {
-    unsigned i = _surfaces.size() - _i - 1;
-    glm::vec3 center(0.0, 0.0, _surfaces[i].center());
+LensAssembly::pupil_bounds LensAssembly::pupil_bounds_at(float r) const {
+  if (_pupil_table.empty() || r > _pupil_table_radius) {
+    return pupil_bounds();
+  }
+
+  // Radii between two entries of the table get the union of both
+  float t = r / _pupil_table_radius * (LENS_PUPIL_TABLE_SIZE - 1);
+  unsigned i = std::min((unsigned) t, (unsigned) LENS_PUPIL_TABLE_SIZE - 2);
+  pupil_bounds b = _pupil_table[i];
+  b.add(_pupil_table[i + 1]);
+  return b;
+}
+
+bool LensAssembly::generate_ray(float x, float y, RNG &rng, Ray &ray) const {
+  RNG *rngs[1] = { &rng };
+  glm::vec3 origin, dir;
+  if (!generate_rays(&x, &y, 1, rngs, &origin, &dir)) {
+    return false;
+  }
+  ray = Ray(origin, dir);
+  return true;
+}
+
+uint32_t LensAssembly::generate_rays(const float *xs, const float *ys, unsigned n, RNG *const *rngs,
+    glm::vec3 *origins, glm::vec3 *dirs) const
+{
+  assert(n <= RAY_PACKET_SIZE);
+  float z = _system_p2 + _dist;
+  float rad2 = _exit_pupil_rad*_exit_pupil_rad;
+
+  // The table holds bounds for points on the x axis; the points drawn from
+  // them are rotated about the lens axis to where each sensor point is
+  float rs[RAY_PACKET_SIZE], cos_phi[RAY_PACKET_SIZE], sin_phi[RAY_PACKET_SIZE];
+  pupil_bounds bounds[RAY_PACKET_SIZE];
+  unsigned attempts[RAY_PACKET_SIZE];
+  uint32_t pending = 0, traced = 0;
+  for (unsigned i = 0; i < n; ++i) {
+    rs[i] = sqrt(xs[i]*xs[i] + ys[i]*ys[i]);
+    cos_phi[i] = rs[i] > 0.0 ? xs[i] / rs[i] : 1.0;
+    sin_phi[i] = rs[i] > 0.0 ? ys[i] / rs[i] : 0.0;
+    bounds[i] = pupil_bounds_at(rs[i]);
+    attempts[i] = 0;
+    if (!bounds[i].empty()) {
+      pending |= 1u << i;
+    }
+  }
 
-    if (fabs(_surfaces[i].surface_radius()) < EPSILON) {
-      if (! rayhit.intersect_plane(glm::vec3(0.0, 0.0, 1.0), center)) {
-        return generate_ray(x, y);
+  // Each round draws a point on the exit pupil for every ray still pending,
+  // and traces them all. Points outside the exit pupil are rejected too, so
+  // that the points that get through are uniform over it.
+  while (pending) {
+    lens_batch batch;
+    unsigned lanes[RAY_PACKET_SIZE];
+    unsigned m = 0;
+
+    for (unsigned i = 0; i < n; ++i) {
+      if (!(pending & (1u << i))) {
+        continue;
       }
-    } else {
-      if (!rayhit.intersect_sphere(center, fabs(_surfaces[i].surface_radius()))) {
-        // Ray didn't make it through the lenses
-        return generate_ray(x, y);
+
+      glm::vec2 p;
+      bool inside = false;
+      while (attempts[i] < LENS_MAX_ATTEMPTS && !inside) {
+        ++attempts[i];
+        p = bounds[i].lo + (bounds[i].hi - bounds[i].lo)*glm::vec2(rngs[i]->randf(), rngs[i]->randf());
+        inside = glm::dot(p, p) <= rad2;
+      }
+
+      if (!inside) {
+        pending &= ~(1u << i);
+        continue;
+      }
+
+      if (_use_fit) {
+        Ray ray(glm::vec3(0.0), glm::vec3(0.0, 0.0, -1.0));
+        if (fitted_ray(rs[i], p, cos_phi[i], sin_phi[i], ray)) {
+          origins[i] = ray.origin();
+          dirs[i] = ray.direction();
+          traced |= 1u << i;
+          pending &= ~(1u << i);
+        } else if (attempts[i] >= LENS_MAX_ATTEMPTS) {
+          pending &= ~(1u << i);
+        }
+        continue;
+      }
+
+      glm::vec3 pupil_pt(cos_phi[i]*p.x - sin_phi[i]*p.y, sin_phi[i]*p.x + cos_phi[i]*p.y,
+          _exit_pupil_pos);
+      batch.set(m, glm::vec3(xs[i], ys[i], z), pupil_pt);
+      lanes[m++] = i;
+    }
+
+    if (m == 0) {
+      continue;
+    }
+
+    uint32_t through = trace_batch(batch, m);
+    for (unsigned k = 0; k < m; ++k) {
+      unsigned i = lanes[k];
+      if (through & (1u << k)) {
+        origins[i] = glm::vec3(batch.ox[k], batch.oy[k], batch.oz[k]);
+        dirs[i] = glm::vec3(batch.dx[k], batch.dy[k], batch.dz[k]);
+        traced |= 1u << i;
+        pending &= ~(1u << i);
+      } else if (attempts[i] >= LENS_MAX_ATTEMPTS) {
+        pending &= ~(1u << i);
       }
+    }
+  }
+
+  uint64_t total_attempts = 0, blocked = 0;
+  for (unsigned i = 0; i < n; ++i) {
+    total_attempts += attempts[i];
+    if (!(traced & (1u << i))) {
+      ++blocked;
+    }
+  }
+
+  _counters.rays.fetch_add(n, std::memory_order_relaxed);
+  _counters.attempts.fetch_add(total_attempts, std::memory_order_relaxed);
+  if (blocked > 0) {
+    _counters.blocked.fetch_add(blocked, std::memory_order_relaxed);
+  }
+  return traced;
+}
 
-      glm::vec3 int_pt = rayhit.intersection_point();
-      if (glm::length(glm::vec2(int_pt.x, int_pt.y)) > _surfaces[i].aperture_radius()) {
-        return generate_ray(x, y);
+void LensAssembly::set_use_fit(bool use) {
+  if (use && _fit.empty()) {
+    fit();
+  }
+  _use_fit = use;
+}
+
+// Get where a ray leaving the lens crosses the plane of the front vertex (z = 0).
+static glm::vec2 front_plane_crossing(const Ray &ray) {
+  float t = -ray.origin().z / ray.direction().z;
+  glm::vec3 p = ray.point_at(t);
+  return glm::vec2(p.x, p.y);
+}
+
+void LensAssembly::fit() {
+  float z = _system_p2 + _dist;
+
+  _fit.resize(LENS_FIT_RADII * LENS_FIT_GRID * LENS_FIT_GRID);
+  for (unsigned k = 0; k < LENS_FIT_RADII; ++k) {
+    float r = _pupil_table_radius * k / (LENS_FIT_RADII - 1);
+    for (unsigned j = 0; j < LENS_FIT_GRID; ++j) {
+      for (unsigned i = 0; i < LENS_FIT_GRID; ++i) {
+        glm::vec2 p = _exit_pupil_rad * (2.0f*glm::vec2(i, j) / float(LENS_FIT_GRID - 1) - 1.0f);
+
+        fit_sample &f = _fit[(k*LENS_FIT_GRID + j)*LENS_FIT_GRID + i];
+        Ray ray(glm::vec3(0.0), glm::vec3(0.0, 0.0, -1.0));
+        if (trace_from_sensor(glm::vec3(r, 0.0, z), glm::vec3(p.x, p.y, _exit_pupil_pos), ray)) {
+          f.pos = front_plane_crossing(ray);
+          f.dir = glm::vec2(ray.direction().x, ray.direction().y);
+          f.mask = 1.0;
+        } else {
+          f.pos = f.dir = glm::vec2(0.0);
+          f.mask = 0.0;
+        }
       }
     }
+  }
 
-    float index_a = _indices[i+1];
-    float index_b = _indices[i];
-    glm::vec3 new_origin = rayhit.intersection_point();
-    glm::vec3 n = rayhit.norm();
-    if (n.z < 0.0) {
-      n = -n;
+  // Compare the table to rays traced from random points within its range
+  RNG rng(0, 0, 0);
+  unsigned both = 0, mismatched = 0;
+  _fit_error.mean_angle = _fit_error.max_angle = 0.0;
+  _fit_error.mean_offset = _fit_error.max_offset = 0.0;
+  for (unsigned n = 0; n < LENS_FIT_TEST_RAYS; ++n) {
+    float r = rng.randf() * _pupil_table_radius;
+    float theta = 2*PI*rng.randf(), rad = sqrt(rng.randf())*_exit_pupil_rad;
+    glm::vec2 p(rad*cos(theta), rad*sin(theta));
+
+    Ray traced(glm::vec3(0.0), glm::vec3(0.0, 0.0, -1.0));
+    Ray fitted(traced);
+    bool traced_ok = trace_from_sensor(glm::vec3(r, 0.0, z), glm::vec3(p.x, p.y, _exit_pupil_pos), traced);
+    bool fitted_ok = fitted_ray(r, p, 1.0, 0.0, fitted);
+    if (traced_ok != fitted_ok) {
+      ++mismatched;
+    }
+    if (!(traced_ok && fitted_ok)) {
+      continue;
     }
 
-    float costheta = glm::dot(n, -rayhit.ray().direction());
-    float sintheta = glm::length(glm::cross(n, -rayhit.ray().direction()));
-    float sinthetap = (index_a / index_b) * sintheta;
-    float costhetap = sqrt(1 - sinthetap*sinthetap);
-    glm::vec3 m = glm::normalize((-rayhit.ray().direction() - n*costheta) / sintheta);
+    float cos_angle = std::min(glm::dot(traced.direction(), fitted.direction()), 1.0f);
+    float angle = rad_to_deg(acos(cos_angle));
+    float offset = glm::length(front_plane_crossing(traced) - front_plane_crossing(fitted));
+    _fit_error.mean_angle += angle;
+    _fit_error.max_angle = std::max(_fit_error.max_angle, angle);
+    _fit_error.mean_offset += offset;
+    _fit_error.max_offset = std::max(_fit_error.max_offset, offset);
+    ++both;
+  }
 
-    glm::vec3 new_dir = -n*costhetap - m*sinthetap;
+  if (both > 0) {
+    _fit_error.mean_angle /= both;
+    _fit_error.mean_offset /= both;
+  }
+  _fit_error.mask_mismatch = float(mismatched) / LENS_FIT_TEST_RAYS;
+}
 
-    rayhit = RayHit(new_origin, new_dir);
+bool LensAssembly::fitted_ray(float r, const glm::vec2 &p, float cos_phi, float sin_phi,
+    Ray &out) const
+{
+  // Interpolate trilinearly between the eight entries around (r, p). The mask
+  // says whether the ray gets through; where it does, the rays of the entries
+  // that have one are blended.
+  float coords[3] = {
+    r / _pupil_table_radius * (LENS_FIT_RADII - 1),
+    (p.y / _exit_pupil_rad + 1.0f) / 2.0f * (LENS_FIT_GRID - 1),
+    (p.x / _exit_pupil_rad + 1.0f) / 2.0f * (LENS_FIT_GRID - 1),
+  };
+  unsigned sizes[3] = { LENS_FIT_RADII, LENS_FIT_GRID, LENS_FIT_GRID };
+
+  unsigned base[3];
+  float frac[3];
+  for (unsigned a = 0; a < 3; ++a) {
+    float c = std::min(std::max(coords[a], 0.0f), float(sizes[a] - 1));
+    base[a] = std::min((unsigned) c, sizes[a] - 2);
+    frac[a] = c - base[a];
+  }
+
+  float mask = 0.0;
+  glm::vec2 pos(0.0), dir(0.0);
+  for (unsigned corner = 0; corner < 8; ++corner) {
+    unsigned k = base[0] + (corner & 1);
+    unsigned j = base[1] + ((corner >> 1) & 1);
+    unsigned i = base[2] + ((corner >> 2) & 1);
+    float w = ((corner & 1) ? frac[0] : 1 - frac[0])
+      * (((corner >> 1) & 1) ? frac[1] : 1 - frac[1])
+      * (((corner >> 2) & 1) ? frac[2] : 1 - frac[2]);
+
+    const fit_sample &f = _fit[(k*LENS_FIT_GRID + j)*LENS_FIT_GRID + i];
+    mask += w * f.mask;
+    pos += (w * f.mask) * f.pos;
+    dir += (w * f.mask) * f.dir;
+  }
+
+  if (mask < 0.5) {
+    return false;
   }
 
-  origin = rayhit.ray().origin();
-  direction = rayhit.ray().direction();
+  pos /= mask;
+  dir /= mask;
+  float dir_z = -sqrt(std::max(1.0f - glm::dot(dir, dir), 0.0f));
+
+  out = Ray(glm::vec3(cos_phi*pos.x - sin_phi*pos.y, sin_phi*pos.x + cos_phi*pos.y, 0.0),
+      glm::vec3(cos_phi*dir.x - sin_phi*dir.y, sin_phi*dir.x + cos_phi*dir.y, dir_z));
+  return true;
+}
+
+bool LensAssembly::trace_from_sensor(const glm::vec3 &origin, const glm::vec3 &pupil_pt,
+    Ray &out) const
+{
+  lens_batch batch;
+  batch.set(0, origin, pupil_pt);
+  if (!trace_batch(batch, 1)) {
+    return false;
+  }
+
+  out = Ray(glm::vec3(batch.ox[0], batch.oy[0], batch.oz[0]),
+      glm::vec3(batch.dx[0], batch.dy[0], batch.dz[0]));
+  return true;
+}
+
+void LensAssembly::lens_batch::set(unsigned i, const glm::vec3 &origin, const glm::vec3 &pupil_pt) {
+  assert(i < RAY_PACKET_SIZE);
+  glm::vec3 dir = glm::normalize(pupil_pt - origin);
+  ox[i] = origin.x;
+  oy[i] = origin.y;
+  oz[i] = origin.z;
+  dx[i] = dir.x;
+  dy[i] = dir.y;
+  dz[i] = dir.z;
+}
+
+// Each surface is intersected as a sphere, taking the nearest hit in front of
+// the ray, or for flat surfaces as a plane, and the ray refracted there by
+// Snell's law in vector form, d' = eta*d + (eta*cos(i) - cos(t))*n, with the
+// normal n facing the sensor. Rays die if they miss a surface, pass outside
+// the aperture of a curved one, or are totally internally reflected. The SSE
+// and scalar kernels do the same operations in the same order, so they give
+// exactly the same rays.
+#ifdef LENS_BATCH_SSE
+uint32_t LensAssembly::trace_batch(lens_batch &b, unsigned n) const {
+  assert(n > 0 && n <= RAY_PACKET_SIZE);
+
+  // Lanes past n are filled with copies of the first ray, and ignored
+  unsigned groups = (n + 3) / 4;
+  for (unsigned i = n; i < 4*groups; ++i) {
+    b.ox[i] = b.ox[0]; b.oy[i] = b.oy[0]; b.oz[i] = b.oz[0];
+    b.dx[i] = b.dx[0]; b.dy[i] = b.dy[0]; b.dz[i] = b.dz[0];
+  }
+
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 two = _mm_set1_ps(2.0f);
+  const __m128 four = _mm_set1_ps(4.0f);
+  const __m128 sign = _mm_set1_ps(-0.0f);
+  const __m128 max_t = _mm_set1_ps(FLT_MAX);
+  const __m128 front = _mm_set1_ps(_surfaces.front().vertex());
+
+  uint32_t through = 0;
+  for (unsigned g = 0; g < groups; ++g) {
+    __m128 ox = _mm_loadu_ps(b.ox + 4*g), oy = _mm_loadu_ps(b.oy + 4*g), oz = _mm_loadu_ps(b.oz + 4*g);
+    __m128 dx = _mm_loadu_ps(b.dx + 4*g), dy = _mm_loadu_ps(b.dy + 4*g), dz = _mm_loadu_ps(b.dz + 4*g);
+    __m128 live = _mm_cmpeq_ps(zero, zero);
+
+    for (unsigned _i = 0; _i < _surfaces.size() && _mm_movemask_ps(live); ++_i) {
+      unsigned i = _surfaces.size() - _i - 1;
+      const LensSurface &surf = _surfaces[i];
+      __m128 zc = _mm_set1_ps(surf.center());
+
+      __m128 px, py, pz, nx, ny, nz;
+      if (fabs(surf.surface_radius()) < EPSILON) {
+        __m128 t = _mm_div_ps(_mm_sub_ps(zc, oz), dz);
+        live = _mm_and_ps(live, _mm_and_ps(_mm_cmpge_ps(t, zero), _mm_cmple_ps(t, max_t)));
+        px = _mm_add_ps(ox, _mm_mul_ps(t, dx));
+        py = _mm_add_ps(oy, _mm_mul_ps(t, dy));
+        pz = _mm_add_ps(oz, _mm_mul_ps(t, dz));
+        nx = zero;
+        ny = zero;
+        nz = one;
+      } else {
+        __m128 tz = _mm_sub_ps(oz, zc);
+        __m128 bb = _mm_mul_ps(two,
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, dx), _mm_mul_ps(oy, dy)), _mm_mul_ps(tz, dz)));
+        __m128 cc = _mm_sub_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, ox), _mm_mul_ps(oy, oy)), _mm_mul_ps(tz, tz)),
+            _mm_set1_ps(surf.surface_radius()*surf.surface_radius()));
+        __m128 d2 = _mm_sub_ps(_mm_mul_ps(bb, bb), _mm_mul_ps(four, cc));
+        __m128 s = _mm_sqrt_ps(d2);
+        __m128 t1 = _mm_mul_ps(_mm_add_ps(_mm_sub_ps(zero, bb), s), half);
+        __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(zero, bb), s), half);
+        __m128 near = _mm_cmpge_ps(t2, zero);
+        __m128 t = _mm_or_ps(_mm_and_ps(near, t2), _mm_andnot_ps(near, t1));
+        live = _mm_and_ps(live, _mm_and_ps(_mm_cmpge_ps(d2, zero), _mm_cmpge_ps(t, zero)));
+
+        px = _mm_add_ps(ox, _mm_mul_ps(t, dx));
+        py = _mm_add_ps(oy, _mm_mul_ps(t, dy));
+        pz = _mm_add_ps(oz, _mm_mul_ps(t, dz));
+        __m128 a = _mm_set1_ps(surf.aperture_radius()*surf.aperture_radius());
+        live = _mm_and_ps(live, _mm_cmple_ps(_mm_add_ps(_mm_mul_ps(px, px), _mm_mul_ps(py, py)), a));
+
+        nx = px;
+        ny = py;
+        nz = _mm_sub_ps(pz, zc);
+        __m128 inv = _mm_div_ps(one, _mm_sqrt_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz))));
+        nx = _mm_mul_ps(nx, inv);
+        ny = _mm_mul_ps(ny, inv);
+        nz = _mm_mul_ps(nz, inv);
+
+        __m128 flip = _mm_and_ps(_mm_cmplt_ps(nz, zero), sign);
+        nx = _mm_xor_ps(nx, flip);
+        ny = _mm_xor_ps(ny, flip);
+        nz = _mm_xor_ps(nz, flip);
+      }
+
+      __m128 eta = _mm_set1_ps(_indices[i+1] / _indices[i]);
+      __m128 cos_i = _mm_xor_ps(sign,
+          _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, dx), _mm_mul_ps(ny, dy)), _mm_mul_ps(nz, dz)));
+      __m128 k = _mm_sub_ps(one, _mm_mul_ps(_mm_mul_ps(eta, eta), _mm_sub_ps(one, _mm_mul_ps(cos_i, cos_i))));
+      live = _mm_and_ps(live, _mm_cmpge_ps(k, zero));
+      __m128 f = _mm_sub_ps(_mm_mul_ps(eta, cos_i), _mm_sqrt_ps(k));
+
+      dx = _mm_add_ps(_mm_mul_ps(eta, dx), _mm_mul_ps(f, nx));
+      dy = _mm_add_ps(_mm_mul_ps(eta, dy), _mm_mul_ps(f, ny));
+      dz = _mm_add_ps(_mm_mul_ps(eta, dz), _mm_mul_ps(f, nz));
+      __m128 inv = _mm_div_ps(one, _mm_sqrt_ps(
+          _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz))));
+      dx = _mm_mul_ps(dx, inv);
+      dy = _mm_mul_ps(dy, inv);
+      dz = _mm_mul_ps(dz, inv);
+
+      ox = px;
+      oy = py;
+      oz = pz;
+    }
+
+    _mm_storeu_ps(b.ox + 4*g, ox);
+    _mm_storeu_ps(b.oy + 4*g, oy);
+    _mm_storeu_ps(b.oz + 4*g, _mm_sub_ps(oz, front));
+    _mm_storeu_ps(b.dx + 4*g, dx);
+    _mm_storeu_ps(b.dy + 4*g, dy);
+    _mm_storeu_ps(b.dz + 4*g, dz);
+    through |= (uint32_t) _mm_movemask_ps(live) << (4*g);
+  }
+
+  return through & ((n < 32 ? 1u << n : 0u) - 1);
+}
+#else
+uint32_t LensAssembly::trace_batch(lens_batch &b, unsigned n) const {
+  assert(n > 0 && n <= RAY_PACKET_SIZE);
+
+  uint32_t through = 0;
+  for (unsigned r = 0; r < n; ++r) {
+    float ox = b.ox[r], oy = b.oy[r], oz = b.oz[r];
+    float dx = b.dx[r], dy = b.dy[r], dz = b.dz[r];
+    bool live = true;
+
+    for (unsigned _i = 0; _i < _surfaces.size() && live; ++_i) {
+      unsigned i = _surfaces.size() - _i - 1;
+      const LensSurface &surf = _surfaces[i];
+      float zc = surf.center();
+
+      float px, py, pz, nx, ny, nz;
+      if (fabs(surf.surface_radius()) < EPSILON) {
+        float t = (zc - oz) / dz;
+        live = t >= 0.0f && t <= FLT_MAX;
+        px = ox + t*dx;
+        py = oy + t*dy;
+        pz = oz + t*dz;
+        nx = ny = 0.0f;
+        nz = 1.0f;
+      } else {
+        float tz = oz - zc;
+        float bb = 2.0f * ((ox*dx + oy*dy) + tz*dz);
+        float cc = ((ox*ox + oy*oy) + tz*tz) - surf.surface_radius()*surf.surface_radius();
+        float d2 = bb*bb - 4.0f*cc;
+        float s = sqrtf(d2);
+        float t1 = ((0.0f - bb) + s) * 0.5f;
+        float t2 = ((0.0f - bb) - s) * 0.5f;
+        float t = t2 >= 0.0f ? t2 : t1;
+        live = d2 >= 0.0f && t >= 0.0f;
+
+        px = ox + t*dx;
+        py = oy + t*dy;
+        pz = oz + t*dz;
+        live = live && px*px + py*py <= surf.aperture_radius()*surf.aperture_radius();
+
+        nx = px;
+        ny = py;
+        nz = pz - zc;
+        float inv = 1.0f / sqrtf((nx*nx + ny*ny) + nz*nz);
+        nx *= inv;
+        ny *= inv;
+        nz *= inv;
+        if (nz < 0.0f) {
+          nx = -nx;
+          ny = -ny;
+          nz = -nz;
+        }
+      }
+
+      float eta = _indices[i+1] / _indices[i];
+      float cos_i = -((nx*dx + ny*dy) + nz*dz);
+      float k = 1.0f - (eta*eta) * (1.0f - cos_i*cos_i);
+      live = live && k >= 0.0f;
+      float f = eta*cos_i - sqrtf(k);
+
+      dx = eta*dx + f*nx;
+      dy = eta*dy + f*ny;
+      dz = eta*dz + f*nz;
+      float inv = 1.0f / sqrtf((dx*dx + dy*dy) + dz*dz);
+      dx *= inv;
+      dy *= inv;
+      dz *= inv;
+
+      ox = px;
+      oy = py;
+      oz = pz;
+    }
+
+    b.ox[r] = ox;
+    b.oy[r] = oy;
+    b.oz[r] = oz - _surfaces.front().vertex();
+    b.dx[r] = dx;
+    b.dy[r] = dy;
+    b.dz[r] = dz;
+    if (live) {
+      through |= 1u << r;
+    }
+  }
 
-  return Ray(glm::vec3(origin.x, origin.y, origin.z - _surfaces.front().vertex()), direction);
+  return through;
 }
+#endif /* LENS_BATCH_SSE */
@@ -1,15 +1,52 @@
 #ifndef _LENSASSEMBLY_H_
 #define _LENSASSEMBLY_H_
 
-#include <cmath>
-
+#include <atomic>
 #include <vector>
 
+#include <cmath>
+#include <cstdint>
+
 #include <glm/glm.hpp>
 
 #include "util.h"
 #include "raytracing.h"
 
+// Number of sensor radii the exit pupil bounds are tabulated at
+#define LENS_PUPIL_TABLE_SIZE 64
+
+// Number of points across the exit pupil traced for each entry of the table
+#define LENS_PUPIL_GRID 32
+
+// Largest sensor radius, in millimeters, the table may cover
+#define LENS_MAX_SENSOR_RADIUS 1024.0f
+
+// Most points on the exit pupil generate_ray() tries for one ray
+#define LENS_MAX_ATTEMPTS 64
+
+// Number of sensor radii, and of points across the exit pupil each way, the
+// table fitted to a lens is sampled at
+#define LENS_FIT_RADII 32
+#define LENS_FIT_GRID 32
+
+// Number of random rays the fitted table is checked against
+#define LENS_FIT_TEST_RAYS 4096
+
+// How far rays generated from the table fitted to a lens are from those traced
+// through its surfaces.
+struct LensFitError {
+  float mean_angle, max_angle;   // degrees between the ray directions
+  float mean_offset, max_offset; // mm between the rays where they leave the lens
+  float mask_mismatch;           // fraction of rays blocked by one but not the other
+};
+
+// What generate_ray() has done so far.
+struct LensRayStats {
+  uint64_t rays;      // rays generated
+  uint64_t attempts;  // points on the exit pupil tried for them
+  uint64_t blocked;   // rays for which every point tried was blocked
+};
+
 // ====================================================================
 // ====================================================================
 
@@ -40,7 +77,8 @@ class LensAssembly {
 
 public:
   // CONSTRUCTOR & DESTRUCTOR
-  LensAssembly() : _dist(0.0), _exit_pupil_pos(0.0), _exit_pupil_rad(0.0) {}
+  LensAssembly() : _dist(0.0), _exit_pupil_pos(0.0), _exit_pupil_rad(0.0),
+    _pupil_table_radius(0.0), _use_fit(false) {}
 
   static LensAssembly from_la(const char *filename);
 
@@ -54,8 +92,42 @@ public:
   // Get the number of surfaces in this LensAssembly.
   unsigned size() const { return _surfaces.size(); }
 
-  // Generate a physically-based ray through the lens assembly.
-  Ray generate_ray(float x, float y) const;
+  // Generate a physically-based ray through the lens assembly from the point
+  // (x, y) on the sensor, drawing the point it passes through on the exit
+  // pupil from `rng`. Points are drawn uniformly from the part of the pupil
+  // that light from (x, y) can get through, as bounded by the pupil table.
+  // Returns false, leaving `ray` alone, if LENS_MAX_ATTEMPTS points in a row
+  // are blocked; the sample then carries no light.
+  bool generate_ray(float x, float y, RNG &rng, Ray &ray) const;
+
+  // Generate rays from the `n` sensor points (xs[i], ys[i]) as generate_ray()
+  // does, where n is at most RAY_PACKET_SIZE, tracing all of them through the
+  // lens together. Ray i draws from rngs[i], and leaves the lens from
+  // origins[i] in direction dirs[i]; it is exactly the ray generate_ray() gives
+  // for the same point and RNG state. Returns a mask of the rays that got
+  // through; origins[i] and dirs[i] are left alone for the others.
+  uint32_t generate_rays(const float *xs, const float *ys, unsigned n, RNG *const *rngs,
+      glm::vec3 *origins, glm::vec3 *dirs) const;
+
+  // Generate rays from a table fitted to the lens rather than by tracing its
+  // surfaces, or switch back to tracing them. The table maps a sensor radius
+  // and a point on the exit pupil to the ray that leaves the lens, and whether
+  // any does; it is built the first time it is used, which must not be while
+  // rays are being generated.
+  void set_use_fit(bool use);
+  bool use_fit() const { return _use_fit; }
+
+  // Get the error of the fitted table, once it is built.
+  const LensFitError &fit_error() const { return _fit_error; }
+
+  // Get counts of the rays generated so far, and what they took.
+  LensRayStats stats() const {
+    LensRayStats s;
+    s.rays = _counters.rays;
+    s.attempts = _counters.attempts;
+    s.blocked = _counters.blocked;
+    return s;
+  }
 
   // Get the optical power of the surface at the given index.
   float optical_power(unsigned surface) const {
@@ -142,6 +214,78 @@ private:
   // subsystems in front of and behind the aperture stop.
   void find_cardinal_points();
 
+  // Tabulate the bounds of the part of the exit pupil that rays from the
+  // sensor get through, at points along the sensor's x axis.
+  void find_pupil_bounds();
+
+  // Rays traced through the lens together by trace_batch(), in structure-of-
+  // arrays layout
+  struct lens_batch {
+    float ox[RAY_PACKET_SIZE], oy[RAY_PACKET_SIZE], oz[RAY_PACKET_SIZE];
+    float dx[RAY_PACKET_SIZE], dy[RAY_PACKET_SIZE], dz[RAY_PACKET_SIZE];
+
+    // Set ray i to go from `origin` on the sensor through `pupil_pt` on the
+    // exit pupil.
+    void set(unsigned i, const glm::vec3 &origin, const glm::vec3 &pupil_pt);
+  };
+
+  // Trace the first n rays of a batch from the sensor out the front of the
+  // lens, leaving the ones that get through where and as they leave it.
+  // Returns a mask with bit i set if ray i got through.
+  uint32_t trace_batch(lens_batch &batch, unsigned n) const;
+
+  // Trace the ray from `origin` on the sensor through `pupil_pt` on the exit
+  // pupil out the front of the lens, as a batch of one. Returns false if a
+  // surface or aperture blocks it.
+  bool trace_from_sensor(const glm::vec3 &origin, const glm::vec3 &pupil_pt, Ray &out) const;
+
+  // A box around the points on the exit pupil that rays from one point on the
+  // sensor's x axis get through, or an empty box if there are none
+  struct pupil_bounds {
+    pupil_bounds() : lo(INFINITY), hi(-INFINITY) {}
+    bool empty() const { return lo.x > hi.x; }
+    void add(const glm::vec2 &p) { lo = glm::min(lo, p); hi = glm::max(hi, p); }
+    void add(const pupil_bounds &b) { lo = glm::min(lo, b.lo); hi = glm::max(hi, b.hi); }
+
+    glm::vec2 lo, hi;
+  };
+
+  // Find the bounds for the sensor point (r, 0) by tracing a grid of rays
+  // through the exit pupil from it.
+  pupil_bounds trace_pupil_bounds(float r) const;
+
+  // Get bounds on the exit pupil for all sensor points at radius r, rotated
+  // onto the x axis, from the table.
+  pupil_bounds pupil_bounds_at(float r) const;
+
+  // Build the fitted table, and measure its error against traced rays.
+  void fit();
+
+  // Look up the ray through the point p on the exit pupil from the sensor
+  // point (r, 0) in the fitted table, and rotate it about the lens axis by the
+  // angle with the given cosine and sine. Returns false if the table says the
+  // lens blocks it.
+  bool fitted_ray(float r, const glm::vec2 &p, float cos_phi, float sin_phi, Ray &out) const;
+
+  // An entry of the fitted table: where the ray crosses the plane of the
+  // front vertex, the x and y of its direction, and whether there is one
+  struct fit_sample {
+    glm::vec2 pos;
+    glm::vec2 dir;
+    float mask;
+  };
+
+  // Counters of generate_ray(), updated by any number of threads at once
+  struct ray_counters {
+    ray_counters() : rays(0), attempts(0), blocked(0) {}
+    ray_counters(const ray_counters &other) :
+      rays(other.rays.load()), attempts(other.attempts.load()), blocked(other.blocked.load()) {}
+
+    std::atomic<uint64_t> rays;
+    std::atomic<uint64_t> attempts;
+    std::atomic<uint64_t> blocked;
+  };
+
   // REPRESENTATION
   std::vector<LensSurface> _surfaces;
   std::vector<float> _indices;
@@ -169,6 +313,19 @@ private:
   // System exit pupil
   float _exit_pupil_pos;
   float _exit_pupil_rad;
+
+  // Exit pupil bounds at LENS_PUPIL_TABLE_SIZE evenly spaced sensor radii from
+  // 0 to _pupil_table_radius, beyond which no light gets through
+  std::vector<pupil_bounds> _pupil_table;
+  float _pupil_table_radius;
+
+  // Table fitted to the lens, indexed by sensor radius, then pupil y, then
+  // pupil x, over the same radii as the pupil table
+  std::vector<fit_sample> _fit;
+  LensFitError _fit_error;
+  bool _use_fit;
+
+  mutable ray_counters _counters;
 };
 
 // ====================================================================
@@ -0,0 +1,220 @@
+#include "light.h"
+
+#include <algorithm>
+
+#include <cassert>
+#include <cfloat>
+
+#include "material.h"
+#include "util.h"
+
+AreaLight::AreaLight(const std::vector<MeshInstance> &instances, size_t index)
+  : _instance(index), _area(0.0)
+{
+  assert(index < instances.size());
+  const MeshInstance &mi = instances[index];
+  const Mesh *m = mi.mesh();
+  _modelmat = mi.modelmat();
+
+  size_t n = m->faces_size();
+  if (n == 0) {
+    glerr() << "ERROR: emissive mesh instance has no faces" << std::endl;
+    exit(-1);
+  }
+
+  _bbox = m->kd_tree().bbox().transformed(_modelmat);
+  glm::vec3 emitted = mi.material()->emitted();
+  _power = (emitted.r + emitted.g + emitted.b) / 3;
+
+  std::vector<float> areas(n);
+  for (size_t i = 0; i < n; ++i) {
+    const Triangle &tri = m->triangle(i);
+    glm::vec3 e1 = apply_homog(_modelmat, tri.e1, VEC3_DIR);
+    glm::vec3 e2 = apply_homog(_modelmat, tri.e2, VEC3_DIR);
+    areas[i] = 0.5f*glm::length(glm::cross(e1, e2));
+    _area += areas[i];
+  }
+
+  // Build the alias table by Vose's method: scale the areas so they average
+  // 1, then pair off each face under 1 with one over 1, which fills in the
+  // rest of the under-full face's entry.
+  _table.resize(n);
+  std::vector<uint32_t> small, large;
+  for (size_t i = 0; i < n; ++i) {
+    areas[i] = _area > 0.0 ? areas[i] * n / _area : 1.0;
+    if (areas[i] < 1.0) {
+      small.push_back(i);
+    } else {
+      large.push_back(i);
+    }
+  }
+
+  while (!small.empty() && !large.empty()) {
+    uint32_t s = small.back(), l = large.back();
+    small.pop_back();
+    _table[s].prob = areas[s];
+    _table[s].alias = l;
+
+    areas[l] -= 1.0f - areas[s];
+    if (areas[l] < 1.0) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+
+  // Whatever is left is 1 up to rounding
+  for (unsigned i = 0; i < small.size(); ++i) {
+    _table[small[i]].prob = 1.0;
+    _table[small[i]].alias = small[i];
+  }
+  for (unsigned i = 0; i < large.size(); ++i) {
+    _table[large[i]].prob = 1.0;
+    _table[large[i]].alias = large[i];
+  }
+}
+
+glm::vec3 AreaLight::sample(const MeshInstance &mesh, RNG &rng, TriangleHit &hit) const {
+  // One number picks both the entry of the table and which of its two faces
+  double u = rng.randf() * _table.size();
+  uint32_t i = std::min(uint32_t(u), uint32_t(_table.size() - 1));
+  hit.face = u - i < _table[i].prob ? i : _table[i].alias;
+
+  glm::vec3 c = rand_barycentric(rng);
+  hit.beta = c.y;
+  hit.gamma = c.z;
+
+  const Triangle &tri = mesh.mesh()->triangle(hit.face);
+  glm::vec3 point = tri.a + hit.beta*tri.e1 + hit.gamma*tri.e2;
+  return apply_homog(_modelmat, point, VEC3_POINT);
+}
+
+// Orders light indices by the center of the light's bounds along one axis
+struct CompLightsByAxis {
+  const std::vector<AreaLight> *lights;
+  int axis;
+
+  bool operator()(uint32_t a, uint32_t b) const {
+    return (*lights)[a].bbox().center()[axis] < (*lights)[b].bbox().center()[axis];
+  }
+};
+
+void LightTree::build(const std::vector<AreaLight> &lights) {
+  _nodes.clear();
+  if (lights.empty()) {
+    return;
+  }
+
+  std::vector<uint32_t> order(lights.size());
+  for (unsigned i = 0; i < lights.size(); ++i) {
+    order[i] = i;
+  }
+  build_node(lights, order, 0, order.size());
+}
+
+void LightTree::build_node(const std::vector<AreaLight> &lights, std::vector<uint32_t> &order,
+    unsigned begin, unsigned end)
+{
+  glm::vec3 min(HUGE_VALF), max(-HUGE_VALF);
+  glm::vec3 cmin(HUGE_VALF), cmax(-HUGE_VALF);
+  float power = 0.0;
+  for (unsigned i = begin; i < end; ++i) {
+    const AreaLight &light = lights[order[i]];
+    min = glm::min(min, light.bbox().min());
+    max = glm::max(max, light.bbox().max());
+    cmin = glm::min(cmin, light.bbox().center());
+    cmax = glm::max(cmax, light.bbox().center());
+    power += light.power();
+  }
+
+  uint32_t idx = _nodes.size();
+  _nodes.push_back(node { BBox(min, max), power, order[begin], true });
+  if (end - begin == 1) {
+    return;
+  }
+
+  glm::vec3 extent = cmax - cmin;
+  int axis = 0;
+  if (extent.y > extent[axis]) {
+    axis = 1;
+  }
+  if (extent.z > extent[axis]) {
+    axis = 2;
+  }
+
+  // Split at the median centroid along the axis of greatest centroid spread.
+  // Lights with the same centroid are split by index, so every leaf still
+  // ends up with one light.
+  unsigned mid = (begin + end) / 2;
+  std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+      CompLightsByAxis { &lights, axis });
+
+  _nodes[idx].leaf = false;
+  build_node(lights, order, begin, mid);
+  _nodes[idx].offset = _nodes.size();
+  build_node(lights, order, mid, end);
+}
+
+float LightTree::importance(const node &n, const glm::vec3 &point, const glm::vec3 &norm) {
+  glm::vec3 center = n.bbox.center();
+  float radius = 0.5f*glm::distance(n.bbox.min(), n.bbox.max());
+  glm::vec3 to_center = center - point;
+  float dist = glm::length(to_center);
+  if (dist <= radius) {
+    return n.power;
+  }
+
+  // The bounding sphere of the node covers the directions within an angle of
+  // asin(radius/dist) of its center; the cosine is bounded by that of the
+  // angle from the normal to the nearest of them.
+  float sin_r = radius / dist;
+  float cos_r = sqrt(1.0f - sin_r*sin_r);
+  float cos_c = glm::dot(norm, to_center) / dist;
+  if (cos_c >= cos_r) {
+    return n.power;
+  }
+
+  float sin_c = sqrt(std::max(1.0f - cos_c*cos_c, 0.0f));
+  float cos_bound = cos_c*cos_r + sin_c*sin_r;
+  return n.power * std::max(cos_bound, 0.0f);
+}
+
+bool LightTree::pick(const glm::vec3 &point, const glm::vec3 &norm, float u,
+    unsigned &light, float &prob) const
+{
+  if (_nodes.empty() || importance(_nodes[0], point, norm) <= 0.0) {
+    return false;
+  }
+
+  uint32_t idx = 0;
+  prob = 1.0;
+  while (!_nodes[idx].leaf) {
+    uint32_t first = idx + 1, second = _nodes[idx].offset;
+    float a = importance(_nodes[first], point, norm);
+    float b = importance(_nodes[second], point, norm);
+
+    // The children's bounds are tighter than this node's, so both may be
+    // wholly behind the surface even though this node is not. Going by power
+    // then keeps the pick from failing partway down; the light it ends at
+    // adds nothing, but neither would any other under this node.
+    if (a + b <= 0.0) {
+      a = _nodes[first].power;
+      b = _nodes[second].power;
+    }
+    assert(a + b > 0.0);
+
+    float p = a / (a + b);
+    if (u < p) {
+      idx = first;
+      prob *= p;
+      u = u / p;
+    } else {
+      idx = second;
+      prob *= 1.0f - p;
+      u = (u - p) / (1.0f - p);
+    }
+    u = std::min(u, 1.0f - FLT_EPSILON/2);
+  }
+
+  light = _nodes[idx].offset;
+  return true;
+}
@@ -0,0 +1,107 @@
+// Sampling of the emissive mesh instances that light a scene.
+#ifndef LIGHT_H_
+#define LIGHT_H_
+
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "kd_tree.h"
+#include "mesh.h"
+#include "rng.h"
+
+// A mesh instance with an emissive material, set up to have points drawn
+// uniformly over its surface in world space. Each face is picked with
+// probability proportional to its area under the instance's transform, from an
+// alias table built once, and then a point is picked uniformly on the face, so
+// every draw costs O(1) whatever the size of the mesh.
+//
+// The table is built from the instance's transform at the time, so a light
+// must be made again if its instance is moved.
+class AreaLight {
+  public:
+    // Set up sampling of the mesh instance at the given index of `instances`.
+    AreaLight(const std::vector<MeshInstance> &instances, size_t index);
+
+    // Get the index of the light's mesh instance in the scene.
+    size_t instance() const { return _instance; }
+
+    // Get the light's surface area in world space.
+    float area() const { return _area; }
+
+    // Get the light's bounds in world space.
+    const BBox &bbox() const { return _bbox; }
+
+    // Get the brightness of the light's emitted color, the mean of its
+    // channels. As Material::shade() has no falloff with distance or area, it
+    // is what a light's contribution scales with.
+    float power() const { return _power; }
+
+    // Draw a point uniformly over the light's surface, which must belong to
+    // `mesh`, the light's instance. The face and barycentric coordinates of
+    // the point are stored in `hit`, and its `t` is left alone.
+    glm::vec3 sample(const MeshInstance &mesh, RNG &rng, TriangleHit &hit) const;
+
+  private:
+    // An entry of the alias table: face i is taken with probability `prob`,
+    // and otherwise face `alias`
+    struct alias_entry {
+      float prob;
+      uint32_t alias;
+    };
+
+    size_t _instance;
+    glm::mat4 _modelmat; // the instance's transform when the table was built
+    float _area;
+    BBox _bbox;
+    float _power;
+    std::vector<alias_entry> _table;
+};
+
+// A binary tree over the lights of a scene, for picking which light each shadow
+// sample goes to. The choice is made afresh for every shading point: going down
+// from the root, each child is taken in proportion to an estimate of how much
+// its lights add to the point, the total power of its lights times a bound on
+// the cosine between the surface normal and any direction into its bounds. So
+// lights behind the surface are rarely picked, and the cost of a sample grows
+// with the log of the number of lights rather than with their number. Every
+// light that can light the point has a nonzero chance of being picked.
+class LightTree {
+  public:
+    LightTree() {}
+
+    // Build the tree over the given lights.
+    void build(const std::vector<AreaLight> &lights);
+
+    // Pick a light for a shading point at `point` with normal `norm`, using
+    // the uniform random number `u` in [0, 1). Sets `light` to its index and
+    // `prob` to the probability it was picked with, and returns true; returns
+    // false only if no light can light the point, whatever `u` is. The light
+    // picked may still add nothing. The one number is rescaled at
+    // each level of the tree, so stratified values of `u` give stratified
+    // picks.
+    bool pick(const glm::vec3 &point, const glm::vec3 &norm, float u,
+        unsigned &light, float &prob) const;
+
+  private:
+    // A node of the tree, stored flattened as in BVH: the first child of an
+    // interior node immediately follows it, and `offset` holds the index of
+    // the second. Every leaf holds one light, whose index is its `offset`.
+    struct node {
+      BBox bbox;
+      float power;
+      uint32_t offset;
+      bool leaf;
+    };
+
+    void build_node(const std::vector<AreaLight> &lights, std::vector<uint32_t> &order,
+        unsigned begin, unsigned end);
+    static float importance(const node &n, const glm::vec3 &point, const glm::vec3 &norm);
+
+    std::vector<node> _nodes;
+};
+
+#endif /* LIGHT_H_ */
@@ -11,6 +11,7 @@
 #include "util.h"
 
 #include "mesh.h"
+#include "mesh_cache.h"
 
 static const char *USAGE =
 "Usage: bokeh [options] <scene file>\n"
@@ -18,10 +19,35 @@ static const char *USAGE =
 "Options:\n"
 "  -w<width>   --width <width>             Set the width of the window.\n"
 "  -h<height>  --height <height>           Set the height of the window.\n"
-"  -s<num>     --shadow-samples <num>      Set the number of shadow samples.\n"
-"  -a<num>     --antialias-samples <num>   Set the number of antialias samples.\n"
+"  -s<num>     --shadow-samples <num>      Set the number of shadow samples per hit.\n"
+"  -a<num>     --antialias-samples <num>   Set the number of samples per pixel (on\n"
+"                                          average, with --noise-threshold). If not\n"
+"                                          given, --output renders take one sample,\n"
+"                                          and the viewer keeps adding samples until\n"
+"                                          it is stopped.\n"
+"              --noise-threshold <t>       Sample adaptively: stop sampling pixels\n"
+"                                          once the relative error of their mean is\n"
+"                                          below <t> (e.g. 0.01), and spend more\n"
+"                                          samples where it is highest. Not supported\n"
+"                                          by the --progressive viewer.\n"
 "  -d<num>     --ray-depth <num>           Set the maximum raytree depth.\n"
 "  -p          --progressive               Enable progressive rendering.\n"
+"              --lens-fit                  Trace lens cameras through a table fitted to\n"
+"                                          the lens instead of its surfaces, and\n"
+"                                          print the table's error.\n"
+"              --output <file>             Render the scene to <file> (.ppm, .png or\n"
+"                                          .pfm) without opening a window, and exit.\n"
+"              --headless                  Render without a window; requires --output.\n"
+"              --kd-builder <median|sah>   Set the KD-tree construction strategy.\n"
+"              --kd-traversal-cost <cost>  Set the SAH cost of traversing a KD-tree node.\n"
+"              --kd-intersect-cost <cost>  Set the SAH cost of intersecting a face.\n"
+"              --kd-stats                  Print KD-tree statistics after loading.\n"
+"              --tri-kernel <scalar|sse|avx>\n"
+"                                          Force the triangle intersection kernel.\n"
+"              --mesh-cache <dir>          Cache loaded meshes in the given directory\n"
+"                                          (default: no cache).\n"
+"              --seed <num>                Set the seed of the render's random numbers\n"
+"                                          (default 0).\n"
 "  -h          --help                      Display this text and exit.\n"
 ;
 
@@ -55,6 +81,39 @@ bool parse_long_opt_uint(int argc, char **argv, const char *name, int *i, unsign
   return true;
 }
 
+bool parse_long_opt_str(int argc, char **argv, const char *name, int *i, const char **dest) {
+  if (strncmp(argv[*i], "--", 2) != 0) {
+    return false;
+  }
+
+  if (strcmp(argv[*i] + 2, name) != 0) {
+    return false;
+  }
+
+  if (*i + 1 >= argc) {
+    std::cerr << "ERROR: missing argument to option --" << name << std::endl;
+    usage(std::cerr, 2);
+  }
+
+  *dest = argv[*i + 1];
+  *i += 2;
+  return true;
+}
+
+bool parse_long_opt_float(int argc, char **argv, const char *name, int *i, float *dest) {
+  const char *val;
+  if (!parse_long_opt_str(argc, argv, name, i, &val)) {
+    return false;
+  }
+
+  if (sscanf(val, "%f", dest) != 1) {
+    std::cerr << "ERROR: invalid argument " << val << " to option --" << name << std::endl;
+    usage(std::cerr, 2);
+  }
+
+  return true;
+}
+
 bool parse_short_opt_uint(int argc, char **argv, char name, int *i, unsigned *dest) {
   if (argv[*i][0] != '-' || argv[*i][1] != name) {
     return false;
@@ -82,14 +141,82 @@ bool parse_short_opt_uint(int argc, char **argv, char name, int *i, unsigned *de
   return true;
 }
 
+// Switch the lens of the scene's camera to the table fitted to it, and report
+// how far the table is from tracing the lens exactly.
+void use_lens_fit(Scene &scene) {
+  LensAssembly *la = scene.lens_assembly();
+  if (!la) {
+    std::cerr << "WARNING: --lens-fit given, but the camera has no lens" << std::endl;
+    return;
+  }
+
+  la->set_use_fit(true);
+  const LensFitError &err = la->fit_error();
+  std::cout << "Lens fit: direction error " << err.mean_angle << " deg mean, "
+      << err.max_angle << " deg max; position error " << err.mean_offset << " mm mean, "
+      << err.max_offset << " mm max; " << 100*err.mask_mismatch << "% of rays vignetted differently"
+      << std::endl;
+}
+
+// Render the scene to an image file and return the exit code, without creating
+// a window or touching GL.
+int render_headless(const BokehCanvasConf &conf, const char *output, bool kd_stats) {
+  Scene scene = Scene::from_scn(conf.scnfile.c_str());
+  scene.set_shadow_samples(conf.shadow_samples);
+  scene.set_lens_samples(conf.antialias_samples);
+  scene.set_ray_bounces(conf.num_bounces);
+  scene.set_resolution(conf.width, conf.height);
+  scene.refresh_bvh();
+  if (conf.lens_fit) {
+    use_lens_fit(scene);
+  }
+
+  if (kd_stats) {
+    print_mesh_stats(std::cout);
+  }
+
+  // Adaptive renders run until they converge or spend their sample budget,
+  // however many passes that takes
+  RayTracing raytracing(&scene, conf.width, conf.height, false);
+  if (conf.noise_threshold > 0) {
+    raytracing.set_noise_threshold(conf.noise_threshold);
+    raytracing.set_sample_budget(std::max(conf.antialias_samples, 1u));
+  } else {
+    raytracing.set_max_passes(std::max(conf.antialias_samples, 1u));
+  }
+  raytracing.render();
+
+  const LensCamera *lens_camera = dynamic_cast<const LensCamera*>(scene.camera());
+  if (lens_camera && lens_camera->lens_assembly()) {
+    LensRayStats stats = lens_camera->lens_assembly()->stats();
+    if (stats.blocked > 0) {
+      std::cerr << "WARNING: the lens blocked every path tried for " << stats.blocked
+        << " of " << stats.rays << " camera rays, which were left black" << std::endl;
+    }
+  }
+
+  return raytracing.write(output) ? 0 : 1;
+}
+
 int main(int argc, char **argv) {
   BokehCanvasConf conf;
   conf.width = conf.height = 200;
   conf.shadow_samples = 1;
-  conf.antialias_samples = 1;
+  conf.antialias_samples = 0;
+  conf.noise_threshold = 0.0;
+  conf.lens_fit = false;
   conf.num_bounces = 1;
   conf.progressive = false;
 
+  KDTreeBuildParams kd_params;
+  const char *kd_builder = NULL;
+  bool kd_stats = false;
+  const char *kernel = NULL;
+  const char *mesh_cache = NULL;
+  unsigned seed = 0;
+  const char *output = NULL;
+  bool headless = false;
+
   int i = 1;
   while (i < argc) {
     if (argv[i][0] != '-') {
@@ -101,11 +228,31 @@ int main(int argc, char **argv) {
       if (parse_long_opt_uint(argc, argv, "height", &i, &conf.height)) continue;
       if (parse_long_opt_uint(argc, argv, "shadow-samples", &i, &conf.shadow_samples)) continue;
       if (parse_long_opt_uint(argc, argv, "antialias-samples", &i, &conf.antialias_samples)) continue;
+      if (parse_long_opt_float(argc, argv, "noise-threshold", &i, &conf.noise_threshold)) continue;
       if (parse_long_opt_uint(argc, argv, "ray-depth", &i, &conf.num_bounces)) continue;
+      if (parse_long_opt_str(argc, argv, "kd-builder", &i, &kd_builder)) continue;
+      if (parse_long_opt_float(argc, argv, "kd-traversal-cost", &i, &kd_params.traversal_cost)) continue;
+      if (parse_long_opt_float(argc, argv, "kd-intersect-cost", &i, &kd_params.intersect_cost)) continue;
+      if (parse_long_opt_str(argc, argv, "tri-kernel", &i, &kernel)) continue;
+      if (parse_long_opt_str(argc, argv, "mesh-cache", &i, &mesh_cache)) continue;
+      if (parse_long_opt_uint(argc, argv, "seed", &i, &seed)) continue;
+      if (parse_long_opt_str(argc, argv, "output", &i, &output)) continue;
       if (strcmp(argv[i], "--progressive") == 0) {
         conf.progressive = true;
         ++i;
         continue;
+      } else if (strcmp(argv[i], "--headless") == 0) {
+        headless = true;
+        ++i;
+        continue;
+      } else if (strcmp(argv[i], "--lens-fit") == 0) {
+        conf.lens_fit = true;
+        ++i;
+        continue;
+      } else if (strcmp(argv[i], "--kd-stats") == 0) {
+        kd_stats = true;
+        ++i;
+        continue;
       } else if (strcmp(argv[i], "--help") == 0) {
         usage(std::cout, 0);
       }
@@ -146,8 +293,81 @@ int main(int argc, char **argv) {
     usage(std::cerr, 2);
   }
 
+  if (headless && !output) {
+    std::cerr << "ERROR: --headless requires an --output file" << std::endl;
+    usage(std::cerr, 2);
+  }
+
+  if (output) {
+    std::string ext = file_extension(output);
+    if (ext != "ppm" && ext != "png" && ext != "pfm") {
+      std::cerr << "ERROR: unknown image format for " << output
+        << " (expected .ppm, .png or .pfm)" << std::endl;
+      usage(std::cerr, 2);
+    }
+  }
+
+  if (conf.noise_threshold < 0) {
+    std::cerr << "ERROR: the noise threshold must not be negative" << std::endl;
+    usage(std::cerr, 2);
+  }
+
+  if (conf.noise_threshold > 0 && conf.progressive && !output) {
+    std::cerr << "ERROR: --noise-threshold is not supported with --progressive" << std::endl;
+    usage(std::cerr, 2);
+  }
+
+  if (conf.width == 0 || conf.height == 0) {
+    std::cerr << "ERROR: image width and height must be nonzero" << std::endl;
+    usage(std::cerr, 2);
+  }
+
+  if (kd_builder) {
+    if (strcmp(kd_builder, "median") == 0) {
+      kd_params.builder = KD_BUILD_MEDIAN;
+    } else if (strcmp(kd_builder, "sah") == 0) {
+      kd_params.builder = KD_BUILD_SAH;
+    } else {
+      std::cerr << "ERROR: unknown KD-tree builder " << kd_builder << std::endl;
+      usage(std::cerr, 2);
+    }
+  }
+  set_kd_tree_build_params(kd_params);
+  MeshCache::set_dir(mesh_cache);
+  RNG::set_seed(seed);
+
+  if (kernel) {
+    int k = TRI_KERNEL_SCALAR;
+    if (strcmp(kernel, "scalar") == 0) {
+      k = TRI_KERNEL_SCALAR;
+    } else if (strcmp(kernel, "sse") == 0) {
+      k = TRI_KERNEL_SSE;
+    } else if (strcmp(kernel, "avx") == 0) {
+      k = TRI_KERNEL_AVX;
+    } else {
+      std::cerr << "ERROR: unknown triangle kernel " << kernel << std::endl;
+      usage(std::cerr, 2);
+    }
+
+    if (!set_tri_kernel(k)) {
+      std::cerr << "ERROR: triangle kernel " << kernel << " is not supported on this machine" << std::endl;
+      exit(-1);
+    }
+  }
+
+  if (output) {
+    return render_headless(conf, output, kd_stats);
+  }
+
   BokehCanvas canvas(conf);
   canvas.make_active();
+  if (conf.lens_fit) {
+    use_lens_fit(canvas.scene());
+  }
+
+  if (kd_stats) {
+    print_mesh_stats(std::cout);
+  }
 
   Canvas::run();
 
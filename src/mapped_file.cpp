@@ -0,0 +1,139 @@
+#include "mapped_file.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#if defined UNIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#elif defined WINDOWS
+#include <Windows.h>
+#include <direct.h>
+#endif
+
+bool MappedFile::open(const char *filename) {
+  close();
+
+# ifdef UNIX
+  int fd = ::open(filename, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    ::close(fd);
+    return false;
+  }
+
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+
+  _data = (const char*) data;
+  _size = st.st_size;
+# else
+  HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart <= 0) {
+    CloseHandle(file);
+    return false;
+  }
+
+  HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping == NULL) {
+    CloseHandle(file);
+    return false;
+  }
+
+  void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (data == NULL) {
+    CloseHandle(mapping);
+    CloseHandle(file);
+    return false;
+  }
+
+  _data = (const char*) data;
+  _size = size.QuadPart;
+  _file = file;
+  _mapping = mapping;
+# endif
+
+  return true;
+}
+
+void MappedFile::close() {
+  if (!_data) {
+    return;
+  }
+
+# ifdef UNIX
+  munmap((void*) _data, _size);
+# else
+  UnmapViewOfFile(_data);
+  CloseHandle((HANDLE) _mapping);
+  CloseHandle((HANDLE) _file);
+# endif
+
+  _data = NULL;
+  _size = 0;
+  _file = NULL;
+  _mapping = NULL;
+}
+
+bool file_stat(const char *filename, uint64_t &size, int64_t &mtime) {
+# ifdef UNIX
+  struct stat st;
+  if (stat(filename, &st) != 0) {
+    return false;
+  }
+# else
+  struct _stat64 st;
+  if (_stat64(filename, &st) != 0) {
+    return false;
+  }
+# endif
+
+  size = st.st_size;
+  mtime = st.st_mtime;
+  return true;
+}
+
+std::string absolute_path(const char *path) {
+# ifdef UNIX
+  char *abs = realpath(path, NULL);
+  if (!abs) {
+    return path;
+  }
+  std::string result(abs);
+  free(abs);
+  return result;
+# else
+  char abs[_MAX_PATH];
+  if (!_fullpath(abs, path, _MAX_PATH)) {
+    return path;
+  }
+  return abs;
+# endif
+}
+
+bool make_dir(const char *path) {
+# ifdef UNIX
+  int res = mkdir(path, 0777);
+# else
+  int res = _mkdir(path);
+# endif
+  return res == 0 || errno == EEXIST;
+}
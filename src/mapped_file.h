@@ -0,0 +1,53 @@
+// Read-only memory mapped files, and the other file system queries they are
+// used with.
+#ifndef MAPPED_FILE_H_
+#define MAPPED_FILE_H_
+
+#include <string>
+
+#include <cstddef>
+#include <cstdint>
+
+#if !defined UNIX && !defined WINDOWS
+#error "File mapping unsupported on this system"
+#endif
+
+// A whole file mapped read-only into memory. The mapping is released when the
+// MappedFile is closed or destroyed.
+class MappedFile {
+  public:
+    MappedFile() : _data(NULL), _size(0), _file(NULL), _mapping(NULL) {}
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile &operator=(const MappedFile&) = delete;
+
+    // Map the given file, closing any file mapped before. Returns false if it
+    // could not be opened or mapped, or is empty.
+    bool open(const char *filename);
+    void close();
+
+    const char *data() const { return _data; }
+    size_t size() const { return _size; }
+
+  private:
+    const char *_data;
+    size_t _size;
+
+    // Windows file and file mapping handles
+    void *_file;
+    void *_mapping;
+};
+
+// Get the size in bytes and last modification time of a file. Returns false if
+// the file does not exist or cannot be queried.
+bool file_stat(const char *filename, uint64_t &size, int64_t &mtime);
+
+// Get the absolute path of a file. Returns the path unchanged if it cannot be
+// resolved.
+std::string absolute_path(const char *path);
+
+// Create a directory, unless it exists already. Returns false on failure.
+bool make_dir(const char *path);
+
+#endif /* MAPPED_FILE_H_ */
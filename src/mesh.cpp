@@ -1,14 +1,21 @@
 #include "mesh.h"
 
+#include <algorithm>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <cassert>
+#include <cfloat>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
+#include "mapped_file.h"
+#include "mesh_cache.h"
 #include "shader_store.h"
+#include "threads.h"
 #include "util.h"
 
 #define SHADER_PROG_NAME "mesh_gouraud"
@@ -25,138 +32,378 @@ struct MeshVertData {
   glm::vec3 norm;
 };
 
-size_t HashVPair::operator()(const VPair &pair) const {
-  size_t idx_a = pair.a->index();
-  size_t idx_b = pair.b->index();
+// OBJ files are split into chunks of at least this many bytes, parsed in
+// parallel, when there are enough of them to go round more than one thread
+#define OBJ_PARSE_CHUNK_BYTES (256 * 1024)
 
-  size_t hash = 14235337;
+// Tokens of an OBJ line looked at by the parser; any after these are only
+// counted
+#define OBJ_MAX_TOKENS 6
 
-  for (unsigned i = 0; i < sizeof(size_t); ++i) {
-    hash = (hash << 13) + hash;
-    hash += idx_a & 0xff;
-    idx_a >>= 8;
+// A polygon of an OBJ file: the position and normal indices of its corners
+struct FaceIndexData {
+  int verts[4];
+  int norms[4];
+  unsigned size;
+};
+
+// The geometry parsed from all or part of an OBJ file
+struct ObjGeomData {
+  std::vector<glm::vec3> vert_pos;
+  std::vector<glm::vec3> vert_norm;
+  std::vector<FaceIndexData> faces;
+  std::string error; // the first error met, if any
+};
+
+// A whitespace-delimited token of an OBJ line, pointing into the file's data
+struct obj_token {
+  const char *begin;
+  const char *end;
+
+  bool is(const char *str) const {
+    size_t len = strlen(str);
+    return size_t(end - begin) == len && memcmp(begin, str, len) == 0;
   }
+};
 
-  for (unsigned i = 0; i < sizeof(size_t); ++i) {
-    hash = (hash << 13) + hash;
-    hash += idx_b & 0xff;
-    idx_b >>= 8;
+static inline bool is_obj_space(char c) {
+  return c == ' ' || c == '\t';
+}
+
+static inline bool is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+// Parse an integer from [begin, end) as sscanf() with "%d" would. Strings of
+// only a sign and digits are handled here, and anything else by sscanf().
+static bool scan_int(const char *begin, const char *end, int &n) {
+  const char *c = begin;
+  bool neg = false;
+  if (c < end && (*c == '-' || *c == '+')) {
+    neg = *c == '-';
+    ++c;
+  }
+
+  int value = 0;
+  unsigned digits = 0;
+  for (; c < end && is_digit(*c) && digits < 9; ++c, ++digits) {
+    value = 10*value + (*c - '0');
   }
 
-  return hash;
+  if (c == end && digits > 0) {
+    n = neg ? -value : value;
+    return true;
+  }
+  return sscanf(std::string(begin, end).c_str(), "%d", &n) == 1;
 }
 
-struct FaceIndexData {
-  std::vector<int> verts;
-  std::vector<int> norms;
-};
+// Parse a float from [begin, end) as sscanf() with "%f" would. Plain decimals
+// of up to 19 significant digits are handled here, and anything else by
+// sscanf().
+static bool scan_float(const char *begin, const char *end, float &f) {
+  // Powers of ten that doubles hold exactly
+  static const double pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+
+  const char *c = begin;
+  bool neg = false;
+  if (c < end && (*c == '-' || *c == '+')) {
+    neg = *c == '-';
+    ++c;
+  }
 
-void parse_geom_data(
-    std::istream &infile,
-    std::vector<glm::vec3> &vert_pos,
-    std::vector<glm::vec3> &vert_norm,
-    std::vector<FaceIndexData> &faces)
-{
-  std::string line;
-  while (std::getline(infile, line)) {
-    line = strip(line);
-    if (line.empty() || line[0] == '#') {
-      continue;
+  // The number is mantissa * 10^exp, with leading zeros left out of the
+  // mantissa's digits
+  uint64_t mantissa = 0;
+  int exp = 0;
+  unsigned digits = 0;
+  bool any_digits = false;
+  for (; c < end && is_digit(*c); ++c) {
+    any_digits = true;
+    if (mantissa != 0 || *c != '0') {
+      mantissa = 10*mantissa + (*c - '0');
+      ++digits;
+    }
+  }
+  if (c < end && *c == '.') {
+    for (++c; c < end && is_digit(*c); ++c) {
+      any_digits = true;
+      if (mantissa != 0 || *c != '0') {
+        mantissa = 10*mantissa + (*c - '0');
+        ++digits;
+      }
+      --exp;
+    }
+  }
+  if (any_digits && c < end && (*c == 'e' || *c == 'E')) {
+    ++c;
+    bool exp_neg = false;
+    if (c < end && (*c == '-' || *c == '+')) {
+      exp_neg = *c == '-';
+      ++c;
+    }
+    int e = 0;
+    bool exp_digits = false;
+    for (; c < end && is_digit(*c); ++c) {
+      exp_digits = true;
+      e = std::min(10*e + (*c - '0'), 1000);
+    }
+    exp += exp_neg ? -e : e;
+    any_digits = exp_digits;
+  }
+
+  if (c != end || !any_digits || digits > 19) {
+    return sscanf(std::string(begin, end).c_str(), "%f", &f) == 1;
+  }
+
+  if (mantissa == 0) {
+    f = neg ? -0.0f : 0.0f;
+    return true;
+  }
+
+  // Both the mantissa and the power of ten are exact as doubles, so `d` is
+  // the number correctly rounded to a double
+  if (mantissa <= (uint64_t(1) << 53) && exp >= -22 && exp <= 22) {
+    double d = exp < 0 ? mantissa / pow10[-exp] : mantissa * pow10[exp];
+
+    // Rounding to a double and then to a float gives the float nearest the
+    // number unless the double lands exactly halfway between two floats,
+    // where the low 29 bits of its mantissa are 1 followed by zeros
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    if (d >= FLT_MIN && d <= FLT_MAX && (bits & 0x1fffffff) != 0x10000000) {
+      f = float(neg ? -d : d);
+      return true;
+    }
+  }
+
+  return sscanf(std::string(begin, end).c_str(), "%f", &f) == 1;
+}
+
+// Parse the face vertex given by `token`, of the form "v", "v/vt" or
+// "v/vt/vn", into its position and normal indices, with 0 for no normal.
+// Returns an error message, or NULL on success.
+static const char *parse_face_vertex(const obj_token &token, int &pos_idx, int &norm_idx) {
+  const char *slash1 = (const char*) memchr(token.begin, '/', token.end - token.begin);
+  const char *pos_end = slash1 ? slash1 : token.end;
+  if (!scan_int(token.begin, pos_end, pos_idx)) {
+    return "ERROR: face vertex without position in OBJ";
+  }
+
+  if (pos_idx == 0) {
+    return "ERROR: face with invalid vertex index in OBJ";
+  }
+
+  // The normal index is the third field between slashes. A final empty
+  // field does not count.
+  norm_idx = 0;
+  const char *slash2 = slash1 ? (const char*) memchr(slash1 + 1, '/', token.end - slash1 - 1) : NULL;
+  if (slash2) {
+    const char *slash3 = (const char*) memchr(slash2 + 1, '/', token.end - slash2 - 1);
+    const char *norm_end = slash3 ? slash3 : token.end;
+    if ((slash3 || norm_end > slash2 + 1) && !scan_int(slash2 + 1, norm_end, norm_idx)) {
+      return "ERROR: face vertex with blank normal vector slot in OBJ";
     }
+  }
+
+  return NULL;
+}
 
-    auto tokens = split(line);
+// Parse the lines of an OBJ file in [begin, end), which must start at the
+// start of a line, into `geom`. Stops at the first error, leaving its message
+// in geom.error, and returns false.
+static bool parse_obj_lines(const char *begin, const char *end, ObjGeomData &geom) {
+  const char *line = begin;
+  while (line < end) {
+    const char *eol = (const char*) memchr(line, '\n', end - line);
+    if (!eol) {
+      eol = end;
+    }
 
-    if (tokens[0] == "v") {
-      if (tokens.size() != 4) {
-        glerr() << "ERROR: unsupported number of vertex coordinates in OBJ" << std::endl;
-        exit(-1);
+    obj_token tokens[OBJ_MAX_TOKENS];
+    unsigned num_tokens = 0;
+    const char *c = line;
+    while (1) {
+      while (c < eol && is_obj_space(*c)) {
+        ++c;
+      }
+      if (c == eol) {
+        break;
+      }
+
+      const char *start = c;
+      while (c < eol && !is_obj_space(*c)) {
+        ++c;
+      }
+      if (num_tokens < OBJ_MAX_TOKENS) {
+        tokens[num_tokens] = obj_token { start, c };
+      }
+      ++num_tokens;
+    }
+    line = eol + 1;
+
+    if (num_tokens == 0 || *tokens[0].begin == '#') {
+      continue;
+    }
+
+    if (tokens[0].is("v")) {
+      if (num_tokens != 4) {
+        geom.error = "ERROR: unsupported number of vertex coordinates in OBJ";
+        return false;
       }
 
       glm::vec3 pt;
       for (unsigned i = 1; i < 4; ++i) {
-        float f;
-        if (sscanf(tokens[i].c_str(), "%f", &f) != 1) {
-          glerr() << "ERROR: invalid vertex coordinate in OBJ" << std::endl;
-          exit(-1);
+        if (!scan_float(tokens[i].begin, tokens[i].end, pt[i-1])) {
+          geom.error = "ERROR: invalid vertex coordinate in OBJ";
+          return false;
         }
-        pt[i-1] = f;
       }
-      vert_pos.push_back(pt);
+      geom.vert_pos.push_back(pt);
 
-    } else if (tokens[0] == "vt") {
+    } else if (tokens[0].is("vt")) {
       continue;
-    } else if (tokens[0] == "vn") {
-      if (tokens.size() != 4) {
-        glerr() << "ERROR: more than three components given for vertex normal in OBJ" << std::endl;
-        exit(-1);
+    } else if (tokens[0].is("vn")) {
+      if (num_tokens != 4) {
+        geom.error = "ERROR: more than three components given for vertex normal in OBJ";
+        return false;
       }
 
       glm::vec3 n;
       for (unsigned i = 1; i < 4; ++i) {
-        float f;
-        if (sscanf(tokens[i].c_str(), "%f", &f) != 1) {
-          glerr() << "ERROR: invalid normal component in OBJ" << std::endl;
-          exit(-1);
+        if (!scan_float(tokens[i].begin, tokens[i].end, n[i-1])) {
+          geom.error = "ERROR: invalid normal component in OBJ";
+          return false;
         }
-        n[i-1] = f;
       }
-      vert_norm.push_back(glm::normalize(n));
+      geom.vert_norm.push_back(glm::normalize(n));
 
-    } else if (tokens[0] == "f") {
-      if (tokens.size() < 4 || tokens.size() > 5) {
-        glerr() << "ERROR: unsupported polygon type in OBJ" << std::endl;
-        exit(-1);
+    } else if (tokens[0].is("f")) {
+      if (num_tokens < 4 || num_tokens > 5) {
+        geom.error = "ERROR: unsupported polygon type in OBJ";
+        return false;
       }
 
       FaceIndexData f;
-      for (unsigned i = 1; i < tokens.size(); ++i) {
-        auto indices = split(tokens[i], "/", false);
-        int pos_idx, norm_idx = 0;
-
-        if (sscanf(indices[0].c_str(), "%d", &pos_idx) != 1) {
-          glerr() << "ERROR: face vertex without position in OBJ" << std::endl;
-          exit(-1);
+      f.size = num_tokens - 1;
+      for (unsigned i = 0; i < f.size; ++i) {
+        const char *error = parse_face_vertex(tokens[i+1], f.verts[i], f.norms[i]);
+        if (error) {
+          geom.error = error;
+          return false;
         }
+      }
+      geom.faces.push_back(f);
 
-        if (pos_idx == 0) {
-          glerr() << "ERROR: face with invalid vertex index in OBJ" << std::endl;
-          exit(-1);
-        }
+    } else {
+      geom.error = "ERROR: unsupported OBJ item '" +
+        std::string(tokens[0].begin, tokens[0].end) + "', aborting";
+      return false;
+    }
+  }
 
-        if (indices.size() >= 3 && sscanf(indices[2].c_str(), "%d", &norm_idx) != 1) {
-          glerr() << "ERROR: face vertex with blank normal vector slot in OBJ" << std::endl;
-          exit(-1);
-        }
+  return true;
+}
+
+struct parse_chunk_args {
+  const char *begin;
+  const char *end;
+  ObjGeomData *geom;
+};
+
+static void parse_chunk_task(void *argptr) {
+  parse_chunk_args *args = (parse_chunk_args*) argptr;
+  parse_obj_lines(args->begin, args->end, *args->geom);
+}
 
-        f.verts.push_back(pos_idx);
-        f.norms.push_back(norm_idx);
+// Append the geometry of `part`, parsed from the part of a file following
+// that `geom` was parsed from, to `geom`.
+static void append_geom_data(ObjGeomData &geom, const ObjGeomData &part) {
+  geom.vert_pos.insert(geom.vert_pos.end(), part.vert_pos.begin(), part.vert_pos.end());
+  geom.vert_norm.insert(geom.vert_norm.end(), part.vert_norm.begin(), part.vert_norm.end());
+  geom.faces.insert(geom.faces.end(), part.faces.begin(), part.faces.end());
+}
+
+// Parse an OBJ file into `geom`, with its indices made absolute and from 0.
+// Returns false on an error, leaving its message in geom.error.
+static bool parse_geom_data(const char *data, size_t size, ObjGeomData &geom) {
+  // Split big files at line breaks into one chunk per thread, each parsed on
+  // its own and then joined in order. As relative indices are only resolved
+  // below, once every vertex is known, the chunks need nothing from each
+  // other.
+  size_t chunks = std::min(size / OBJ_PARSE_CHUNK_BYTES, size_t(thread_pool().size()));
+  if (chunks < 2) {
+    parse_obj_lines(data, data + size, geom);
+  } else {
+    std::vector<ObjGeomData> parts(chunks);
+    std::vector<parse_chunk_args> args(chunks);
+    const char *begin = data;
+    for (unsigned i = 0; i < chunks; ++i) {
+      const char *end = data + size;
+      if (i + 1 < chunks) {
+        const char *split = std::max(data + size*(i+1)/chunks, begin);
+        const char *eol = (const char*) memchr(split, '\n', data + size - split);
+        end = eol ? eol + 1 : data + size;
       }
-      faces.push_back(f);
+      args[i] = parse_chunk_args { begin, end, &parts[i] };
+      begin = end;
+    }
 
-    } else {
-      glerr() << "ERROR: unsupported OBJ item '" << tokens[0] << "', aborting" << std::endl;
-      exit(-1);
+    ThreadPool::TaskGroup group;
+    for (unsigned i = 1; i < chunks; ++i) {
+      thread_pool().submit(parse_chunk_task, (void*) &args[i], group);
     }
+    parse_chunk_task((void*) &args[0]);
+    thread_pool().wait(group);
+
+    // Report the error nearest the start of the file, as parsing it all in
+    // one go would have
+    size_t num_pos = 0, num_norms = 0, num_faces = 0;
+    for (unsigned i = 0; i < chunks; ++i) {
+      if (!parts[i].error.empty()) {
+        geom.error = parts[i].error;
+        break;
+      }
+      num_pos += parts[i].vert_pos.size();
+      num_norms += parts[i].vert_norm.size();
+      num_faces += parts[i].faces.size();
+    }
+
+    if (geom.error.empty()) {
+      geom.vert_pos.reserve(num_pos);
+      geom.vert_norm.reserve(num_norms);
+      geom.faces.reserve(num_faces);
+      for (unsigned i = 0; i < chunks; ++i) {
+        append_geom_data(geom, parts[i]);
+      }
+    }
+  }
+
+  if (!geom.error.empty()) {
+    return false;
   }
 
+  std::vector<FaceIndexData> &faces = geom.faces;
   for (unsigned i = 0; i < faces.size(); ++i) {
-    for (unsigned j = 0; j < faces[i].verts.size(); ++j) {
+    for (unsigned j = 0; j < faces[i].size; ++j) {
       int pos_idx = faces[i].verts[j];
       int norm_idx = faces[i].norms[j];
 
       if (pos_idx < 0) {
-        pos_idx += vert_pos.size();
+        pos_idx += geom.vert_pos.size();
         if (pos_idx < 0) {
-          glerr() << "ERROR: face with invalid vertex index in OBJ" << std::endl;
-          exit(-1);
+          geom.error = "ERROR: face with invalid vertex index in OBJ";
+          return false;
         }
       }
 
       if (norm_idx < 0) {
-        norm_idx += vert_norm.size();
+        norm_idx += geom.vert_norm.size();
         if (norm_idx < 0) {
-          glerr() << "ERROR: face with invalid vertex normal index in OBJ" << std::endl;
-          exit(-1);
+          geom.error = "ERROR: face with invalid vertex normal index in OBJ";
+          return false;
         }
       }
 
@@ -164,27 +411,51 @@ void parse_geom_data(
       faces[i].norms[j] = norm_idx - 1;
     }
   }
+
+  return true;
 }
 
-Mesh Mesh::from_obj(std::istream &infile) {
-  std::vector<glm::vec3> vert_pos, vert_norm;
-  std::vector<FaceIndexData> faces;
-  parse_geom_data(infile, vert_pos, vert_norm, faces);
+Mesh Mesh::from_obj(const char *data, size_t size, std::string &error) {
+  ObjGeomData geom;
+  if (!parse_geom_data(data, size, geom)) {
+    error = geom.error;
+    return Mesh();
+  }
+  const std::vector<glm::vec3> &vert_pos = geom.vert_pos, &vert_norm = geom.vert_norm;
+  const std::vector<FaceIndexData> &faces = geom.faces;
 
   Mesh m;
 
+  size_t num_tris = 0;
+  for (unsigned i = 0; i < faces.size(); ++i) {
+    num_tris += faces[i].size - 2;
+  }
+  m._positions.reserve(vert_pos.size());
+  m._indices.reserve(3*num_tris);
+  m._opposites.reserve(3*num_tris);
+  m._triangles.reserve(num_tris);
+  m._edge_map.reserve(3*num_tris);
+
   for (unsigned i = 0; i < vert_pos.size(); ++i) {
     m.add_vert(vert_pos[i]);
   }
 
   for (unsigned i = 0; i < faces.size(); ++i) {
-    if (faces[i].verts.size() == 3) {
-      m.add_tri(faces[i].verts[0], faces[i].verts[1], faces[i].verts[2]);
-    } else {
-      m.add_quad(faces[i].verts[0], faces[i].verts[1], faces[i].verts[2], faces[i].verts[3]);
+    size_t first_face = m.faces_size();
+    const int *v = faces[i].verts;
+    bool added = m.try_add_tri(v[0], v[1], v[2]);
+    if (faces[i].size == 4) {
+      // Triangulated as by add_quad()
+      added = added && m.try_add_tri(v[0], v[2], v[3]);
+    }
+    if (!added) {
+      error = "ERROR: adding edge that already exists";
+      return Mesh();
     }
 
-    for (unsigned j = 0; j < faces[i].norms.size(); ++j) {
+    // Faces given normals in the OBJ file get them on the edges leading to
+    // each of their corners, found among the edges just added
+    for (unsigned j = 0; j < faces[i].size; ++j) {
       if (faces[i].norms[j] < 0) {
         continue;
       }
@@ -192,43 +463,49 @@ Mesh Mesh::from_obj(std::istream &infile) {
       size_t i2 = faces[i].verts[j];
 
       size_t i1 = j-1;
-      if (i1 > faces[i].verts.size()) {
-        i1 = faces[i].verts.size() - 1;
+      if (i1 > faces[i].size) {
+        i1 = faces[i].size - 1;
       }
       i1 = faces[i].verts[i1];
 
-      edge_map_t::iterator itr = m._edge_map.find(VPair { m.vert(i1), m.vert(i2) });
-      assert(itr != m._edge_map.end());
+      size_t e = 3*first_face;
+      while (m.edge(e).root_vert().index() != i1 || m.edge(e).vert().index() != i2) {
+        ++e;
+        assert(e < m.edges_size());
+      }
 
-      itr->second->set_vert_norm(vert_norm[faces[i].norms[j]]);
+      m._triangles[e / 3].norm(e % 3) = vert_norm[faces[i].norms[j]];
     }
   }
 
+  m.discard_edge_map();
   m.compute_vert_norms();
+  m.pack_triangles();
   m._kd_tree = KDTree(&m);
-  for (unsigned i = 0; i < m._faces.size(); ++i) {
-    assert(m._kd_tree.contains_face(m._faces[i]));
+  for (unsigned i = 0; i < m.faces_size(); ++i) {
+    assert(m._kd_tree.contains_face(m.face(i)));
   }
   return m;
 }
 
-Edge *Edge::next_ccw() const {
-  if (!_opposite) {
-    return NULL;
+Edge Edge::next_ccw() const {
+  Edge opp = opposite();
+  if (!opp.valid()) {
+    return opp;
   } else {
-    return _opposite->next()->next();
+    return opp.next().next();
   }
 }
 
-Edge *Edge::next_cw() const {
-  return _next->opposite();
+Edge Edge::next_cw() const {
+  return next().opposite();
 }
 
-static glm::vec3 compute_vert_norm(Edge *e) {
-  Edge *e1 = e;
+static glm::vec3 compute_vert_norm(Edge e) {
+  Edge e1 = e;
 
-  while (e->next_cw()) {
-    e = e->next_cw();
+  while (e.next_cw().valid()) {
+    e = e.next_cw();
     if (e == e1) {
       break;
     }
@@ -238,14 +515,14 @@ static glm::vec3 compute_vert_norm(Edge *e) {
   std::vector<glm::vec3> norms;
 
   while (1) {
-    glm::vec3 n = e->face()->norm();
+    glm::vec3 n = e.face().norm();
     norms.push_back(n);
 
-    if (!e->next_ccw()) {
+    if (!e.next_ccw().valid()) {
       break;
     }
 
-    e = e->next_ccw();
+    e = e.next_ccw();
     if (e == e1) {
       break;
     }
@@ -260,18 +537,17 @@ static glm::vec3 compute_vert_norm(Edge *e) {
 }
 
 void Mesh::compute_vert_norms() {
-  for (unsigned i = 0; i < _edges.size(); ++i) {
-    Edge *e = _edges[i];
-    if (glm::length(e->vert_norm()) < EPSILON) {
-      e->set_vert_norm(compute_vert_norm(e));
+  for (unsigned i = 0; i < _indices.size(); ++i) {
+    if (glm::length(_triangles[i / 3].norm(i % 3)) < EPSILON) {
+      _triangles[i / 3].norm(i % 3) = compute_vert_norm(edge(i));
     }
   }
 }
 
 glm::vec3 Face::norm() const {
   glm::vec3 a, b;
-  a = vert(1)->position() - vert(0)->position();
-  b = vert(2)->position() - vert(0)->position();
+  a = vert(1).position() - vert(0).position();
+  b = vert(2).position() - vert(0).position();
 
   return glm::normalize(glm::cross(a, b));
 }
@@ -284,9 +560,9 @@ glm::vec3 Face::norm_transformed(const glm::mat4 &modelmat) const {
 }
 
 glm::vec3 Face::centroid() const {
-  return (vert(0)->position()
-      + vert(1)->position()
-      + vert(2)->position())
+  return (vert(0).position()
+      + vert(1).position()
+      + vert(2).position())
     * 0.3333333333f;
 }
 
@@ -298,23 +574,11 @@ glm::vec3 Face::centroid_transformed(const glm::mat4 &modelmat) const {
 }
 
 float Face::area() const {
-  glm::vec3 lega = vert(1)->position() - vert(0)->position();
-  glm::vec3 legb = vert(2)->position() - vert(0)->position();
+  glm::vec3 lega = vert(1).position() - vert(0).position();
+  glm::vec3 legb = vert(2).position() - vert(0).position();
   return 0.5*glm::length(glm::cross(lega, legb));
 }
 
-Vertex *Face::vert(unsigned i) const {
-  assert(i < 3);
-  const Edge *e = _edge;
-  --i;
-  while (i < 3) {
-    e = e->next();
-    --i;
-  }
-
-  return e->vert();
-}
-
 glm::vec3 Face::point_at_transformed(const glm::mat4 &modelmat,
     float alpha, float beta, float gamma) const
 {
@@ -338,22 +602,22 @@ void Face::barycentric_coords_transformed(
   ::barycentric_coords(point, a, b, c, alpha, beta, gamma);
 }
 
-glm::vec3 Face::random_point() const {
-  glm::vec3 c = rand_barycentric();
+glm::vec3 Face::random_point(RNG &rng) const {
+  glm::vec3 c = rand_barycentric(rng);
   return point_at(c.x, c.y, c.z);
 }
 
-glm::vec3 Face::random_point_transformed(const glm::mat4 &modelmat) const {
-  glm::vec3 c = rand_barycentric();
+glm::vec3 Face::random_point_transformed(const glm::mat4 &modelmat, RNG &rng) const {
+  glm::vec3 c = rand_barycentric(rng);
   return point_at_transformed(modelmat, c.x, c.y, c.z);
 }
 
 void Face::verts_transformed(const glm::mat4 &transform,
     glm::vec3 &va, glm::vec3 &vb, glm::vec3 &vc) const
 {
-  glm::vec3 orig_a = vert(0)->position(),
-            orig_b = vert(1)->position(),
-            orig_c = vert(2)->position();
+  glm::vec3 orig_a = vert(0).position(),
+            orig_b = vert(1).position(),
+            orig_c = vert(2).position();
 
   glm::vec4 homog(orig_a.x, orig_a.y, orig_a.z, 1.0);
   homog = transform * homog;
@@ -369,14 +633,8 @@ void Face::verts_transformed(const glm::mat4 &transform,
 }
 
 glm::vec3 Face::interpolate_norm(float alpha, float beta, float gamma) const {
-  Edge *e = _edge;
-  glm::vec3 n1 = e->vert_norm();
-  e = e->next();
-  glm::vec3 n2 = e->vert_norm();
-  e = e->next();
-  glm::vec3 n3 = e->vert_norm();
-
-  return glm::normalize(alpha*n1 + beta*n2 + gamma*n3);
+  const Triangle &tri = _mesh->_triangles[_index];
+  return glm::normalize(alpha*tri.n0 + beta*tri.n1 + gamma*tri.n2);
 }
 
 glm::vec3 Face::interpolate_norm_transformed(const glm::mat4 &modelmat,
@@ -388,10 +646,26 @@ glm::vec3 Face::interpolate_norm_transformed(const glm::mat4 &modelmat,
   return glm::normalize(glm::vec3(n4.x, n4.y, n4.z));
 }
 
+void Mesh::pack_triangles() {
+  for (unsigned i = 0; i < _triangles.size(); ++i) {
+    Triangle &tri = _triangles[i];
+    tri.a = _positions[_indices[3*i]];
+    tri.e1 = _positions[_indices[3*i + 1]] - tri.a;
+    tri.e2 = _positions[_indices[3*i + 2]] - tri.a;
+  }
+}
+
+size_t Mesh::data_bytes() const {
+  return _positions.capacity() * sizeof(glm::vec3)
+    + (_indices.capacity() + _opposites.capacity()) * sizeof(uint32_t)
+    + _triangles.capacity() * sizeof(Triangle);
+}
+
 Mesh::Mesh(Mesh &&other) {
-  _vertices = std::move(other._vertices);
-  _edges = std::move(other._edges);
-  _faces = std::move(other._faces);
+  _positions = std::move(other._positions);
+  _indices = std::move(other._indices);
+  _opposites = std::move(other._opposites);
+  _triangles = std::move(other._triangles);
   _edge_map = std::move(other._edge_map);
   _inited_buf = other._inited_buf;
   _vbuf = other._vbuf;
@@ -404,23 +678,6 @@ Mesh::Mesh(Mesh &&other) {
 }
 
 Mesh::~Mesh() {
-  for (unsigned i = 0; i < _vertices.size(); ++i) {
-    delete _vertices[i];
-  }
-  _vertices.clear();
-
-  for (unsigned i = 0; i < _edges.size(); ++i) {
-    delete _edges[i];
-  }
-  _edges.clear();
-
-  for (unsigned i = 0; i < _faces.size(); ++i) {
-    delete _faces[i];
-  }
-  _faces.clear();
-
-  _edge_map.clear();
-
   if (_inited_buf) {
     glDeleteVertexArrays(1, &_vao);
     glDeleteBuffers(1, &_vbuf);
@@ -434,58 +691,63 @@ Mesh::~Mesh() {
 }
 
 size_t Mesh::add_vert(const glm::vec3 &position) {
-  _vertices.push_back(new Vertex(position, _vertices.size()));
-  return _vertices.size() - 1;
+  _positions.push_back(position);
+  return _positions.size() - 1;
 }
 
 size_t Mesh::add_tri(size_t v1, size_t v2, size_t v3) {
-  assert(v1 < _vertices.size());
-  assert(v2 < _vertices.size());
-  assert(v3 < _vertices.size());
-
-  Vertex *a = _vertices[v1];
-  Vertex *b = _vertices[v2];
-  Vertex *c = _vertices[v3];
-
-  Face *f = new Face();
-  Edge *ea = add_edge(c, a, f);
-  Edge *eb = add_edge(a, b, f);
-  Edge *ec = add_edge(b, c, f);
+  if (!try_add_tri(v1, v2, v3)) {
+    glerr() << "ERROR: adding edge that already exists" << std::endl;
+    exit(-1);
+  }
+  return _triangles.size() - 1;
+}
 
-  ea->set_next(eb);
-  eb->set_next(ec);
-  ec->set_next(ea);
+bool Mesh::try_add_tri(size_t v1, size_t v2, size_t v3) {
+  assert(v1 < _positions.size());
+  assert(v2 < _positions.size());
+  assert(v3 < _positions.size());
 
-  f->set_edge(ea);
+  // Edge 3i+k of face i leads to its vertex k
+  if (!add_edge(v3, v1) || !add_edge(v1, v2) || !add_edge(v2, v3)) {
+    return false;
+  }
 
-  _faces.push_back(f);
+  // The vertex normals are filled in later, and the positions by
+  // pack_triangles()
+  Triangle tri;
+  memset((void*) &tri, 0, sizeof(Triangle));
+  _triangles.push_back(tri);
 
-  return _faces.size() - 1;
+  return true;
 }
 
 std::pair<size_t, size_t> Mesh::add_quad(size_t v1, size_t v2, size_t v3, size_t v4) {
-  return std::make_pair(add_tri(v1, v2, v3), add_tri(v1, v3, v4));
+  // Added one at a time, as the order arguments are evaluated in is
+  // unspecified
+  size_t first = add_tri(v1, v2, v3);
+  return std::make_pair(first, add_tri(v1, v3, v4));
 }
 
-Edge *Mesh::add_edge(Vertex *root_vert, Vertex *vert, Face *face) {
-  edge_map_t::iterator itr = _edge_map.find({root_vert, vert});
-  if (itr != _edge_map.end()) {
-    glerr() << "ERROR: adding edge that already exists" << std::endl;
-    exit(-1);
+bool Mesh::add_edge(uint32_t root_vert, uint32_t vert) {
+  uint64_t key = (uint64_t(root_vert) << 32) | vert;
+  if (_edge_map.find(key) != _edge_map.end()) {
+    return false;
   }
 
-  Edge *e = new Edge(root_vert, vert, face);
+  uint32_t e = _indices.size();
+  uint32_t opposite = MESH_NO_INDEX;
 
-  itr = _edge_map.find({vert, root_vert});
+  edge_map_t::iterator itr = _edge_map.find((uint64_t(vert) << 32) | root_vert);
   if (itr != _edge_map.end()) {
-    e->set_opposite(itr->second);
-    itr->second->set_opposite(e);
+    opposite = itr->second;
+    _opposites[opposite] = e;
   }
 
-  _edge_map.insert(std::make_pair(VPair {root_vert, vert}, e));
-  _edges.push_back(e);
-
-  return e;
+  _edge_map.insert(std::make_pair(key, e));
+  _indices.push_back(vert);
+  _opposites.push_back(opposite);
+  return true;
 }
 
 void Mesh::lazy_init_shaders() {
@@ -555,31 +817,17 @@ void Mesh::lazy_init_buffers() {
 
   std::vector<MeshVertData> vert_data;
 
-  Edge *face_edges[6];
-  memset((void*) face_edges, 0, sizeof(face_edges));
-  for (unsigned i = 0; i < _faces.size(); ++i) {
-    Face *f = _faces[i];
-    Edge *ea = f->edge();
-    Edge *eb = ea->next();
-    Edge *ec = eb->next();
-
-    face_edges[0] = ea;
-    face_edges[1] = eb;
-    face_edges[2] = ec;
-
-    glm::vec3 face_norm = f->norm();
-    for (unsigned j = 0; j < 6; ++j) {
-      Edge *e = face_edges[j];
-      if (!e) {
-        break;
-      }
+  for (unsigned i = 0; i < _triangles.size(); ++i) {
+    glm::vec3 face_norm = face(i).norm();
+    for (unsigned j = 0; j < 3; ++j) {
+      Edge e = edge(3*i + j);
       MeshVertData vd;
-      vd.pos = e->vert()->position();
+      vd.pos = e.vert().position();
 
-      if (glm::length(e->vert_norm()) < EPSILON) {
+      if (glm::length(e.vert_norm()) < EPSILON) {
         vd.norm = face_norm;
       } else {
-        vd.norm = e->vert_norm();
+        vd.norm = e.vert_norm();
       }
 
       vert_data.push_back(vd);
@@ -625,25 +873,99 @@ static struct MeshManager {
   mesh_map_t meshes;
 } mesh_manager;
 
-Mesh::mesh_id add_mesh_from_obj(const char *name, const char *obj_filename) {
-  mesh_name_map_t::iterator itr = mesh_manager.mesh_names.find(name);
-  if (itr != mesh_manager.mesh_names.end()) {
-    return itr->second;
+// Move a Mesh loaded into memory of its own into the store under a name not
+// yet used
+static Mesh::mesh_id store_mesh(const char *name, Mesh *m) {
+  assert(mesh_manager.mesh_names.find(name) == mesh_manager.mesh_names.end());
+  Mesh::mesh_id id = next_mesh_id++;
+
+  m->discard_edge_map();
+  mesh_manager.meshes.insert(std::make_pair(id, m));
+  mesh_manager.mesh_names.insert(std::make_pair(name, id));
+
+  return id;
+}
+
+ObjLoad::ObjLoad(const char *obj_filename) : _filename(obj_filename), _mesh(NULL) {
+  thread_pool().submit(load_task, (void*) this, _task);
+}
+
+ObjLoad::~ObjLoad() {
+  wait();
+  delete _mesh;
+}
+
+void ObjLoad::wait() {
+  thread_pool().wait(_task);
+}
+
+void ObjLoad::load_task(void *loadptr) {
+  ObjLoad *load = (ObjLoad*) loadptr;
+  const char *filename = load->_filename.c_str();
+
+  load->_mesh = MeshCache::load(filename);
+  if (load->_mesh) {
+    return;
   }
 
-  Mesh::mesh_id id = next_mesh_id;
-  ++next_mesh_id;
+  MappedFile objfile;
+  const char *data = NULL;
+  size_t size = 0;
+  if (objfile.open(filename)) {
+    data = objfile.data();
+    size = objfile.size();
+  } else {
+    // Empty files cannot be mapped, but are empty meshes all the same
+    uint64_t file_size;
+    int64_t mtime;
+    if (!file_stat(filename, file_size, mtime) || file_size != 0) {
+      return;
+    }
+  }
 
-  std::ifstream objfile(obj_filename);
-  assert(objfile.good());
+  Mesh m = Mesh::from_obj(data, size, load->_error);
+  if (load->_error.empty()) {
+    load->_mesh = new Mesh(std::move(m));
+    MeshCache::store(filename, *load->_mesh);
+  }
+}
 
-  Mesh *m = new Mesh(Mesh::from_obj(objfile));
-  mesh_manager.meshes.insert(std::make_pair(id, m));
-  mesh_manager.mesh_names.insert(std::make_pair(name, id));
+Mesh::mesh_id ObjLoad::add(const char *name) {
+  wait();
+
+  Mesh::mesh_id id = get_mesh_id(name);
+  if (id != Mesh::NONE) {
+    return id;
+  }
+
+  if (!_error.empty()) {
+    glerr() << _error << std::endl;
+    exit(-1);
+  }
+
+  // As before loads were threaded, a file that cannot be opened gives an
+  // empty Mesh
+  if (!_mesh) {
+    glerr() << "WARNING: could not open OBJ file " << _filename
+      << "; using an empty mesh" << std::endl;
+    _mesh = new Mesh();
+  }
 
+  id = store_mesh(name, _mesh);
+  _mesh = NULL;
   return id;
 }
 
+Mesh::mesh_id add_mesh_from_obj(const char *name, const char *obj_filename) {
+  Mesh::mesh_id id = get_mesh_id(name);
+  if (id != Mesh::NONE) {
+    return id;
+  }
+
+  ObjLoad load(obj_filename);
+  return load.add(name);
+}
+
 Mesh::mesh_id get_mesh_id(const char *name) {
   mesh_name_map_t::iterator itr = mesh_manager.mesh_names.find(name);
   if (itr == mesh_manager.mesh_names.end()) {
@@ -659,13 +981,32 @@ Mesh::mesh_id add_mesh(const char *name, Mesh &&mesh) {
     return itr->second;
   }
 
-  Mesh::mesh_id id = next_mesh_id++;
-
-  Mesh *m = new Mesh(std::move(mesh));
-  mesh_manager.meshes.insert(std::make_pair(id, m));
-  mesh_manager.mesh_names.insert(std::make_pair(name, id));
+  return store_mesh(name, new Mesh(std::move(mesh)));
+}
 
-  return id;
+void print_mesh_stats(std::ostream &out) {
+  const KDTreeBuildParams &params = kd_tree_build_params();
+  out << "KD-tree builder: " << (params.builder == KD_BUILD_SAH ? "SAH" : "median")
+      << " (traversal cost " << params.traversal_cost
+      << ", intersection cost " << params.intersect_cost << "), "
+      << tri_kernel_name(tri_kernel()) << " triangle kernel" << std::endl;
+
+  for (mesh_name_map_t::iterator itr = mesh_manager.mesh_names.begin();
+      itr != mesh_manager.mesh_names.end(); ++itr)
+  {
+    const Mesh *m = mesh_manager.meshes.find(itr->second)->second;
+    KDTreeStats stats = m->kd_tree().stats();
+
+    out << "  " << itr->first << ": " << m->faces_size() << " faces, "
+        << stats.nodes << " nodes, " << stats.leaves << " leaves ("
+        << stats.empty_leaves << " empty), depth " << stats.max_depth << ", "
+        << float(stats.face_refs) / std::max(stats.leaves, 1u) << " faces/leaf, "
+        << "SAH cost " << stats.sah_cost << ", "
+        << (m->kd_tree().node_bytes() + m->kd_tree().packet_bytes()) / 1024 << " KB, "
+        << "mesh " << m->data_bytes() / 1024 << " KB ("
+        << float(m->data_bytes()) / std::max(m->faces_size(), size_t(1)) << " bytes/face)"
+        << std::endl;
+  }
 }
 
 void MeshInstance::draw() {
@@ -3,9 +3,12 @@
 #define MESH_H_
 
 #include <fstream>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
+#include <cassert>
+#include <cstdint>
 #include <cstring>
 
 #include <GL/glew.h>
@@ -17,6 +20,8 @@
 #include "debug_viz.h"
 #include "material.h"
 #include "kd_tree.h"
+#include "rng.h"
+#include "threads.h"
 
 class Vertex;
 class Edge;
@@ -46,94 +51,85 @@ struct MeshShaderInfo {
   GLuint lightpower_loc; // uniform light energy/power (float)
 };
 
+// Stored in place of the index of a missing element, such as the opposite of
+// an edge on the boundary of a Mesh.
+#define MESH_NO_INDEX UINT32_MAX
+
+// Vertex, Edge, and Face are handles to the elements of a Mesh: the index of
+// the element and the Mesh it belongs to. The Mesh keeps the elements' data in
+// flat arrays, and hands out handles by value.
 class Vertex {
   public:
-    void set_position(const glm::vec3 &newpos) { _position = newpos; }
-
-    const glm::vec3 &position() const { return _position; }
+    const glm::vec3 &position() const;
     size_t index() const { return _index; }
 
+    bool operator==(const Vertex &other) const { return _mesh == other._mesh && _index == other._index; }
+    bool operator!=(const Vertex &other) const { return !(*this == other); }
+
   private:
-    Vertex(const glm::vec3 &position, size_t index) : _index(index), _position(position) {}
+    Vertex(const Mesh *mesh, uint32_t index) : _mesh(mesh), _index(index) {}
 
-    size_t _index;
-    glm::vec3 _position;
+    const Mesh *_mesh;
+    uint32_t _index;
 
     friend class Mesh;
+    friend class Edge;
+    friend class Face;
 };
 
-struct VPair {
-  const Vertex *a, *b;
-  bool operator==(const VPair &other) const {
-    return a->index() == other.a->index() && b->index() == other.b->index();
-  }
-};
-
-struct HashVPair {
-  size_t operator()(const VPair &pair) const;
-};
-
-typedef std::unordered_map<VPair, Edge*, HashVPair> edge_map_t;
-
+// A half-edge. The edges of face i are edges 3i to 3i+2, in order around the
+// face, and edge 3i+k leads to the face's vertex k.
 class Edge {
   public:
+    // Whether this is an edge at all, rather than the opposite of a boundary
+    // edge, or the next edge around a vertex past the boundary
+    bool valid() const { return _index != MESH_NO_INDEX; }
+
     // Next edge counterclockwise around the face
-    Edge *next() const { return _next; }
+    Edge next() const { return Edge(_mesh, _index - _index % 3 + (_index + 1) % 3); }
 
     // Opposite half-edge
-    Edge *opposite() const { return _opposite; }
+    Edge opposite() const;
 
     // Counterclockwise-direction vertex
-    Vertex *vert() const { return _vert; }
+    Vertex vert() const;
 
     // Clockwise-direction vertex
-    Vertex *root_vert() const { return _root_vert; }
+    Vertex root_vert() const;
 
     // The face to the left of this Edge
-    Face *face() const { return _face; }
+    Face face() const;
 
     // The vertex normal of the counterclockwise-direction vertex for this edge's face
-    const glm::vec3 &vert_norm() const { return _vert_norm; }
+    const glm::vec3 &vert_norm() const;
 
     // Return the next Edge counterclockwise around this edge's vertex (NOT this
     // edge's face)
-    Edge *next_ccw() const;
+    Edge next_ccw() const;
 
     // Return the next edge clockwise around this edge's vertex (NOT this edge's
     // face)
-    Edge *next_cw() const;
+    Edge next_cw() const;
 
-    // Set various edge properties/member variables
-    void set_next(Edge *next) { _next = next; }
-    void set_opposite(Edge *opposite) { _opposite = opposite; }
-    void set_vert(Vertex *vert) { _vert = vert; }
-    void set_root_vert(Vertex *root_vert) { _root_vert = root_vert; }
-    void set_face(Face *face) { _face = face; }
-    void set_vert_norm(const glm::vec3 &norm) { _vert_norm = norm; }
+    size_t index() const { return _index; }
 
-  private:
-    Edge() : _next(NULL), _opposite(NULL), _vert(NULL), _root_vert(NULL), _face(NULL) {}
-    Edge(Vertex *root_vert, Vertex *vert, Face *face) :
-      _next(NULL), _opposite(NULL), _vert(vert), _root_vert(root_vert), _face(face) {}
+    bool operator==(const Edge &other) const { return _mesh == other._mesh && _index == other._index; }
+    bool operator!=(const Edge &other) const { return !(*this == other); }
 
-    Edge *_next;
-    Edge *_opposite;
-    Vertex *_vert;
-    Vertex *_root_vert;
-    Face *_face;
+  private:
+    Edge(const Mesh *mesh, uint32_t index) : _mesh(mesh), _index(index) {}
 
-    glm::vec3 _vert_norm;
+    const Mesh *_mesh;
+    uint32_t _index;
 
     friend class Mesh;
+    friend class Face;
 };
 
 class Face {
   public:
-    // One of the edges of this Face
-    Edge *edge() const { return _edge; }
-
-    // Set the edge that will be returned by this->edge()
-    void set_edge(Edge *edge) { _edge = edge; }
+    // One of the edges of this Face: the one leading to vert(0)
+    Edge edge() const { return Edge(_mesh, 3*_index); }
 
     // Get the surface normal of this Face.
     glm::vec3 norm() const;
@@ -151,11 +147,11 @@ class Face {
     float area() const;
 
     // Get the i'th vertex of this Face. `i` must be 0, 1, or 2.
-    Vertex *vert(unsigned i) const;
+    Vertex vert(unsigned i) const;
 
     // Get the point on this face with the given barycentric coordinates.
     glm::vec3 point_at(float alpha, float beta, float gamma) const {
-      return alpha*vert(0)->position() + beta*vert(1)->position() + gamma*vert(2)->position();
+      return alpha*vert(0).position() + beta*vert(1).position() + gamma*vert(2).position();
     }
 
     // Get the point on this face, under the given transformation, with the given
@@ -173,10 +169,10 @@ class Face {
         float &alpha, float &beta, float &gamma) const;
 
     // Generate a random point on this Face.
-    glm::vec3 random_point() const;
+    glm::vec3 random_point(RNG &rng) const;
 
     // Generate a random point on this Face under the given transformation.
-    glm::vec3 random_point_transformed(const glm::mat4 &modelmat) const;
+    glm::vec3 random_point_transformed(const glm::mat4 &modelmat, RNG &rng) const;
 
     // Get the vertices of this Face under the given transformation.
     void verts_transformed(const glm::mat4 &transform, glm::vec3 &va, glm::vec3 &vb, glm::vec3 &vc) const;
@@ -192,25 +188,54 @@ class Face {
     glm::vec3 interpolate_norm_transformed(const glm::mat4 &modelmat,
         float alpha, float beta, float gamma) const;
 
+    size_t index() const { return _index; }
+
+    bool operator==(const Face &other) const { return _mesh == other._mesh && _index == other._index; }
+    bool operator!=(const Face &other) const { return !(*this == other); }
+
   private:
-    Face() : _edge(NULL) {}
+    Face(const Mesh *mesh, uint32_t index) : _mesh(mesh), _index(index) {}
 
-    Edge *_edge;
+    const Mesh *_mesh;
+    uint32_t _index;
 
     friend class Mesh;
+    friend class Edge;
+};
+
+// The vertex data of a Face, packed for the ray tracer. This is also where the
+// Mesh keeps the vertex normals of its faces.
+struct Triangle {
+  glm::vec3 a;      // first vertex
+  glm::vec3 e1, e2; // edges from the first vertex to the second and third
+  glm::vec3 n0, n1, n2; // vertex normals
+
+  // Get the vertex normal interpolated at the given barycentric coordinates.
+  glm::vec3 interpolate_norm(float beta, float gamma) const {
+    return glm::normalize((1.0f - beta - gamma)*n0 + beta*n1 + gamma*n2);
+  }
+
+  // Get the normal of vertex i, which must be 0, 1, or 2.
+  const glm::vec3 &norm(unsigned i) const { return i == 0 ? n0 : (i == 1 ? n1 : n2); }
+  glm::vec3 &norm(unsigned i) { return i == 0 ? n0 : (i == 1 ? n1 : n2); }
+};
+
+// The closest intersection found so far between a ray and the Triangles of a Mesh.
+struct TriangleHit {
+  float t;
+  uint32_t face;     // index of the face hit
+  float beta, gamma; // barycentric coordinates of the hit point
 };
 
 class Mesh {
   public:
-    typedef std::vector<Vertex*>::const_iterator vert_iterator;
-    typedef std::vector<Edge*>::const_iterator edge_iterator;
-    typedef std::vector<Face*>::const_iterator face_iterator;
-
     typedef size_t mesh_id;
     static const mesh_id NONE;
 
-    // Create a Mesh by loading the given OBJ file
-    static Mesh from_obj(std::istream &infile);
+    // Create a Mesh from the contents of an OBJ file, `size` bytes at `data`.
+    // If the file has errors, sets `error` to the first and returns an empty
+    // Mesh.
+    static Mesh from_obj(const char *data, size_t size, std::string &error);
 
     Mesh() : _inited_buf(false), _vbuf(0), _vao(0) {}
     Mesh(Mesh &&other);
@@ -220,48 +245,96 @@ class Mesh {
     size_t add_vert(const glm::vec3 &position);
 
     // Return the vertex at index i
-    const Vertex *vert(size_t i) const {
-      assert(i < _vertices.size());
-      return _vertices[i];
+    Vertex vert(size_t i) const {
+      assert(i < _positions.size());
+      return Vertex(this, i);
     }
 
-    // Add a triangle face to this Mesh and return its index.
+    // Add a triangle face to this Mesh and return its index. Faces can only be
+    // added until the edge map is discarded.
     size_t add_tri(size_t v1, size_t v2, size_t v3);
 
     // Add a quad face to this Mesh by first triangulating it. Returns the
     // pair of indices of the two triangles added.
     std::pair<size_t, size_t> add_quad(size_t v1, size_t v2, size_t v3, size_t v4);
 
-    // Return the Face at index i
-    Face *face(size_t i) const {
-      assert(i < _faces.size());
-      return _faces[i];
+    // Free the map used to find the opposites of new edges, once all faces
+    // have been added. Meshes are done with it by the time they are in the
+    // global Mesh store.
+    void discard_edge_map() { edge_map_t().swap(_edge_map); }
+
+    // Return the Edge or Face at index i
+    Edge edge(size_t i) const {
+      assert(i < _indices.size());
+      return Edge(this, i);
     }
 
-    // Iterate over vertices, edges, and faces
-    vert_iterator verts_begin() const { return _vertices.begin(); }
-    vert_iterator verts_end() const { return _vertices.end(); }
-    edge_iterator edges_begin() const { return _edges.begin(); }
-    edge_iterator edges_end() const { return _edges.end(); }
-    face_iterator faces_begin() const { return _faces.begin(); }
-    face_iterator faces_end() const { return _faces.end(); }
+    Face face(size_t i) const {
+      assert(i < _triangles.size());
+      return Face(this, i);
+    }
 
     // Get the number of vertices, edges, and faces
-    size_t verts_size() const { return _vertices.size(); }
-    size_t edges_size() const { return _edges.size(); }
-    size_t faces_size() const { return _faces.size(); }
+    size_t verts_size() const { return _positions.size(); }
+    size_t edges_size() const { return _indices.size(); }
+    size_t faces_size() const { return _triangles.size(); }
+
+    // Get the number of bytes the vertices, edges, and faces take up, not
+    // counting the KDTree or the edge map.
+    size_t data_bytes() const;
+
+    // Get the packed data of the face at index i.
+    const Triangle &triangle(size_t i) const {
+      assert(i < _triangles.size());
+      return _triangles[i];
+    }
 
     const KDTree &kd_tree() const { return _kd_tree; }
     void compute_vert_norms();
 
-  private:
-    Edge *add_edge(Vertex *root_vert, Vertex *vert, Face *face);
+    // Pack the vertex positions of every face into the triangle array read by
+    // the ray tracer, alongside the vertex normals kept there. Must be called
+    // after the Mesh is modified.
+    void pack_triangles();
 
-    std::vector<Vertex*> _vertices;
-    std::vector<Edge*> _edges;
-    std::vector<Face*> _faces;
+    // Find the closest intersection, nearer than `hit.t`, of the object space
+    // ray `origin + t*dir` with this Mesh. Returns true if `hit` was updated.
+    bool intersect(const glm::vec3 &origin, const glm::vec3 &dir, TriangleHit &hit) const {
+      return _kd_tree.intersect(origin, dir, hit);
+    }
+
+    // Check whether the object space ray `origin + t*dir` hits this Mesh at a
+    // distance less than t_max.
+    bool occluded(const glm::vec3 &origin, const glm::vec3 &dir, float t_max) const {
+      return _kd_tree.occluded(origin, dir, t_max);
+    }
+
+    // Find the closest intersections of a packet of `n` object space rays with
+    // this Mesh. Returns a bit mask of the rays whose hits were updated.
+    uint32_t intersect_packet(const glm::vec3 *origins, const glm::vec3 *dirs,
+        unsigned n, TriangleHit *hits) const
+    {
+      return _kd_tree.intersect_packet(origins, dirs, n, hits);
+    }
+
+  private:
+    // Edges by the indices of their root and end vertices, in the high and low
+    // halves of the key
+    typedef std::unordered_map<uint64_t, uint32_t> edge_map_t;
+
+    // Add a triangle as add_tri() does, returning false if one of its edges
+    // was already added
+    bool try_add_tri(size_t v1, size_t v2, size_t v3);
+    bool add_edge(uint32_t root_vert, uint32_t vert);
+
+    std::vector<glm::vec3> _positions; // by vertex
+    std::vector<uint32_t> _indices;    // by edge: the index of its vertex
+    std::vector<uint32_t> _opposites;  // by edge, or MESH_NO_INDEX
+    std::vector<Triangle> _triangles;  // by face
     KDTree _kd_tree;
 
+    // Edges by vertex pair, while faces are being added. Empty once discarded,
+    // and for Meshes loaded from the MeshCache.
     edge_map_t _edge_map;
 
     static bool _s_inited;
@@ -277,13 +350,68 @@ class Mesh {
 
     DebugViz _dbviz;
 
+    friend class Vertex;
+    friend class Edge;
+    friend class Face;
     friend class MeshInstance;
+    friend class MeshCache;
 };
 
+inline const glm::vec3 &Vertex::position() const { return _mesh->_positions[_index]; }
+
+inline Edge Edge::opposite() const { return Edge(_mesh, _mesh->_opposites[_index]); }
+inline Vertex Edge::vert() const { return Vertex(_mesh, _mesh->_indices[_index]); }
+inline Vertex Edge::root_vert() const {
+  return Vertex(_mesh, _mesh->_indices[_index - _index % 3 + (_index + 2) % 3]);
+}
+inline Face Edge::face() const { return Face(_mesh, _index / 3); }
+inline const glm::vec3 &Edge::vert_norm() const { return _mesh->_triangles[_index / 3].norm(_index % 3); }
+
+inline Vertex Face::vert(unsigned i) const {
+  assert(i < 3);
+  return Vertex(_mesh, _mesh->_indices[3*_index + i]);
+}
+
 // Add a Mesh with the given name to the global Mesh store by loading the OBJ
-// file with the given filename.
+// file with the given filename. The Mesh is read from the MeshCache instead if
+// it holds an up to date entry for the file, and added to it otherwise.
 Mesh::mesh_id add_mesh_from_obj(const char *name, const char *obj_filename);
 
+// A Mesh being loaded from an OBJ file on the thread pool, from the MeshCache
+// if possible as with add_mesh_from_obj(), so that several can load at once.
+// Errors in the file are held until the Mesh is added to the global Mesh
+// store, so they are reported by the thread adding it, in the order Meshes are
+// added.
+class ObjLoad {
+  public:
+    // Start loading the OBJ file with the given filename.
+    explicit ObjLoad(const char *obj_filename);
+
+    // Wait for the load to finish, and free the Mesh if it was not added.
+    ~ObjLoad();
+
+    ObjLoad(const ObjLoad&) = delete;
+    ObjLoad &operator=(const ObjLoad&) = delete;
+
+    // Wait for the load to finish.
+    void wait();
+
+    // Wait for the load to finish, and move the Mesh into the global Mesh
+    // store with the given name, exiting if the file had errors. A file that
+    // could not be opened gives an empty Mesh, with a warning. As with
+    // add_mesh_from_obj(), if a Mesh of that name is already in the store, its
+    // ID is returned and the loaded Mesh is dropped.
+    Mesh::mesh_id add(const char *name);
+
+  private:
+    static void load_task(void *load);
+
+    std::string _filename;
+    Mesh *_mesh; // NULL until loaded, and if the file could not be opened
+    std::string _error;
+    ThreadPool::TaskGroup _task;
+};
+
 // Get the Mesh ID associated with the given name, or Mesh::NONE if no such Mesh
 // is in the store.
 Mesh::mesh_id get_mesh_id(const char *name);
@@ -291,6 +419,10 @@ Mesh::mesh_id get_mesh_id(const char *name);
 // Move a Mesh into the global Mesh store, assigning it the given name.
 Mesh::mesh_id add_mesh(const char *name, Mesh &&mesh);
 
+// Write a summary of each Mesh in the global Mesh store and its KDTree to the
+// given stream.
+void print_mesh_stats(std::ostream &out);
+
 // An instance of a Mesh with arbitrary transformation and material.
 class MeshInstance {
   public:
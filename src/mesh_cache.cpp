@@ -0,0 +1,286 @@
+#include "mesh_cache.h"
+
+#include <chrono>
+#include <fstream>
+#include <vector>
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+#include "kd_tree.h"
+#include "mapped_file.h"
+#include "mesh.h"
+#include "util.h"
+
+#define MESH_CACHE_MAGIC   "BOKEHMC"
+#define MESH_CACHE_VERSION 1
+
+// Written as-is, to tell the byte order of the machine that wrote a file
+#define MESH_CACHE_BYTE_ORDER 0x01020304u
+
+// Alignment of each array in a cache file
+#define MESH_CACHE_ALIGN 64
+
+static bool cache_enabled = false;
+static std::string cache_dir;
+
+// The start of a cache file. Everything up to `num_verts` is the key of the
+// entry, and must match exactly for the file to be used.
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+
+  // Sizes of the stored structures, which differ between some builds
+  uint32_t header_size, triangle_size, node_size, packet_size;
+
+  uint64_t obj_size;
+  int64_t obj_mtime;
+  uint32_t path_size; // length of the absolute OBJ path following the header
+
+  int32_t builder;
+  float traversal_cost, intersect_cost, empty_bonus;
+  uint32_t max_leaf_faces;
+
+  uint32_t num_verts, num_faces, num_nodes, num_packets;
+  float bbox_min[3], bbox_max[3];
+};
+
+// Offsets in a cache file of the arrays following the header. The vertex
+// positions, edge indices, and opposite edges are the Mesh's own arrays: three
+// vertex indices per face, and three indices of opposite edges (or
+// MESH_NO_INDEX).
+struct CacheLayout {
+  CacheLayout(const CacheHeader &h) {
+    path = sizeof(CacheHeader);
+    positions = align(path + h.path_size);
+    indices = align(positions + size_t(h.num_verts) * sizeof(glm::vec3));
+    opposites = align(indices + 3 * size_t(h.num_faces) * sizeof(uint32_t));
+    triangles = align(opposites + 3 * size_t(h.num_faces) * sizeof(uint32_t));
+    nodes = align(triangles + size_t(h.num_faces) * h.triangle_size);
+    packets = align(nodes + size_t(h.num_nodes) * h.node_size);
+    end = packets + size_t(h.num_packets) * h.packet_size;
+  }
+
+  static size_t align(size_t offset) {
+    return (offset + MESH_CACHE_ALIGN - 1) / MESH_CACHE_ALIGN * MESH_CACHE_ALIGN;
+  }
+
+  size_t path, positions, indices, opposites, triangles, nodes, packets, end;
+};
+
+// Fill in the key of the cache entry for an OBJ file, zeroing the rest.
+static CacheHeader make_key(const std::string &abs_path, uint64_t obj_size,
+    int64_t obj_mtime, size_t node_size)
+{
+  CacheHeader h;
+  memset((void*) &h, 0, sizeof(CacheHeader));
+
+  memcpy(h.magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC));
+  h.version = MESH_CACHE_VERSION;
+  h.byte_order = MESH_CACHE_BYTE_ORDER;
+
+  h.header_size = sizeof(CacheHeader);
+  h.triangle_size = sizeof(Triangle);
+  h.node_size = node_size;
+  h.packet_size = sizeof(TriPacket);
+
+  h.obj_size = obj_size;
+  h.obj_mtime = obj_mtime;
+  h.path_size = abs_path.size();
+
+  const KDTreeBuildParams &params = kd_tree_build_params();
+  h.builder = params.builder;
+  h.traversal_cost = params.traversal_cost;
+  h.intersect_cost = params.intersect_cost;
+  h.empty_bonus = params.empty_bonus;
+  h.max_leaf_faces = params.max_leaf_faces;
+
+  return h;
+}
+
+void MeshCache::set_dir(const char *dir) {
+  cache_enabled = dir != NULL;
+  if (dir) {
+    cache_dir = dir;
+  }
+}
+
+const char *MeshCache::dir() {
+  return cache_enabled ? cache_dir.c_str() : NULL;
+}
+
+std::string MeshCache::entry_path(const std::string &abs_obj_path) {
+  // 64-bit FNV-1a over the path and the build parameters, which are not
+  // otherwise part of the name, so entries built with different settings can
+  // be kept side by side
+  const KDTreeBuildParams &params = kd_tree_build_params();
+  uint64_t hash = 14695981039346656037ull;
+  for (unsigned i = 0; i < abs_obj_path.size(); ++i) {
+    hash = (hash ^ (unsigned char) abs_obj_path[i]) * 1099511628211ull;
+  }
+
+  const float floats[3] = { params.traversal_cost, params.intersect_cost, params.empty_bonus };
+  const uint32_t ints[2] = { uint32_t(params.builder), params.max_leaf_faces };
+  const unsigned char *bytes[2] = { (const unsigned char*) floats, (const unsigned char*) ints };
+  const size_t sizes[2] = { sizeof(floats), sizeof(ints) };
+  for (unsigned i = 0; i < 2; ++i) {
+    for (unsigned j = 0; j < sizes[i]; ++j) {
+      hash = (hash ^ bytes[i][j]) * 1099511628211ull;
+    }
+  }
+
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.mesh", (unsigned long long) hash);
+  return cache_dir + "/" + name;
+}
+
+Mesh *MeshCache::load(const char *obj_filename) {
+  if (!cache_enabled) {
+    return NULL;
+  }
+
+  uint64_t obj_size;
+  int64_t obj_mtime;
+  if (!file_stat(obj_filename, obj_size, obj_mtime)) {
+    return NULL;
+  }
+
+  std::string abs_path = absolute_path(obj_filename);
+  MappedFile file;
+  if (!file.open(entry_path(abs_path).c_str()) || file.size() < sizeof(CacheHeader)) {
+    return NULL;
+  }
+
+  CacheHeader h;
+  memcpy((void*) &h, file.data(), sizeof(CacheHeader));
+  CacheHeader key = make_key(abs_path, obj_size, obj_mtime, sizeof(KDTree::node));
+  if (memcmp(&h, &key, offsetof(CacheHeader, num_verts)) != 0) {
+    return NULL;
+  }
+
+  CacheLayout layout(h);
+  if (layout.end > file.size() || memcmp(file.data() + layout.path, abs_path.data(), h.path_size) != 0) {
+    return NULL;
+  }
+
+  const glm::vec3 *positions = (const glm::vec3*) (file.data() + layout.positions);
+  const uint32_t *indices = (const uint32_t*) (file.data() + layout.indices);
+  const uint32_t *opposites = (const uint32_t*) (file.data() + layout.opposites);
+  const Triangle *triangles = (const Triangle*) (file.data() + layout.triangles);
+  const KDTree::node *nodes = (const KDTree::node*) (file.data() + layout.nodes);
+  const TriPacket *packets = (const TriPacket*) (file.data() + layout.packets);
+
+  // Reject files with indices out of range, rather than crash on them later
+  uint32_t num_edges = 3 * h.num_faces;
+  for (uint32_t i = 0; i < num_edges; ++i) {
+    if (indices[i] >= h.num_verts || (opposites[i] != MESH_NO_INDEX && opposites[i] >= num_edges)) {
+      return NULL;
+    }
+  }
+  for (uint32_t i = 0; i < h.num_nodes; ++i) {
+    const KDTree::node &n = nodes[i];
+    if (n.leaf() ? (uint64_t(n.packet_offset) + n.num_packets() > h.num_packets)
+        : (n.above_child() <= i || n.above_child() >= h.num_nodes))
+    {
+      return NULL;
+    }
+    // The first num_faces() lanes of a leaf's packets hold its faces
+    if (n.leaf()) {
+      for (uint32_t j = 0; j < n.num_faces(); ++j) {
+        const TriPacket &p = packets[n.packet_offset + j / TRI_PACKET_WIDTH];
+        if (p.face[j % TRI_PACKET_WIDTH] >= h.num_faces) {
+          return NULL;
+        }
+      }
+    }
+  }
+
+  Mesh *m = new Mesh();
+  m->_positions.assign(positions, positions + h.num_verts);
+  m->_indices.assign(indices, indices + num_edges);
+  m->_opposites.assign(opposites, opposites + num_edges);
+  m->_triangles.assign(triangles, triangles + h.num_faces);
+
+  KDTree &tree = m->_kd_tree;
+  tree._bbox = BBox(glm::vec3(h.bbox_min[0], h.bbox_min[1], h.bbox_min[2]),
+      glm::vec3(h.bbox_max[0], h.bbox_max[1], h.bbox_max[2]));
+  tree._nodes.assign(nodes, nodes + h.num_nodes);
+  tree._packets.assign(packets, packets + h.num_packets);
+
+  return m;
+}
+
+void MeshCache::store(const char *obj_filename, const Mesh &mesh) {
+  if (!cache_enabled) {
+    return;
+  }
+
+  uint64_t obj_size;
+  int64_t obj_mtime;
+  if (!file_stat(obj_filename, obj_size, obj_mtime)) {
+    return;
+  }
+
+  if (!make_dir(cache_dir.c_str())) {
+    glerr() << "WARNING: could not create mesh cache directory " << cache_dir << std::endl;
+    return;
+  }
+
+  std::string abs_path = absolute_path(obj_filename);
+  const KDTree &tree = mesh._kd_tree;
+
+  CacheHeader h = make_key(abs_path, obj_size, obj_mtime, sizeof(KDTree::node));
+  h.num_verts = mesh._positions.size();
+  h.num_faces = mesh._triangles.size();
+  h.num_nodes = tree._nodes.size();
+  h.num_packets = tree._packets.size();
+  for (unsigned a = 0; a < 3; ++a) {
+    h.bbox_min[a] = tree._bbox.min()[a];
+    h.bbox_max[a] = tree._bbox.max()[a];
+  }
+
+  CacheLayout layout(h);
+  std::vector<char> buf(layout.end, 0);
+  memcpy(&buf[0], &h, sizeof(CacheHeader));
+  memcpy(&buf[layout.path], abs_path.data(), abs_path.size());
+
+  if (h.num_verts > 0) {
+    memcpy(&buf[layout.positions], &mesh._positions[0], h.num_verts * sizeof(glm::vec3));
+  }
+  if (h.num_faces > 0) {
+    memcpy(&buf[layout.indices], &mesh._indices[0], 3 * h.num_faces * sizeof(uint32_t));
+    memcpy(&buf[layout.opposites], &mesh._opposites[0], 3 * h.num_faces * sizeof(uint32_t));
+    memcpy(&buf[layout.triangles], &mesh._triangles[0], h.num_faces * sizeof(Triangle));
+  }
+  if (h.num_nodes > 0) {
+    memcpy(&buf[layout.nodes], &tree._nodes[0], h.num_nodes * sizeof(KDTree::node));
+  }
+  if (h.num_packets > 0) {
+    memcpy(&buf[layout.packets], &tree._packets[0], h.num_packets * sizeof(TriPacket));
+  }
+
+  // Write to a temporary file and move it into place, so that a file with the
+  // entry's name is always complete
+  std::string path = entry_path(abs_path);
+  std::string tmp_path = path + "." + std::to_string((uintptr_t) &mesh)
+    + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+
+  std::ofstream out(tmp_path.c_str(), std::ios::binary);
+  out.write(&buf[0], buf.size());
+  out.close();
+  if (!out) {
+    glerr() << "WARNING: could not write mesh cache file " << tmp_path << std::endl;
+    std::remove(tmp_path.c_str());
+    return;
+  }
+
+# ifdef WINDOWS
+  std::remove(path.c_str());
+# endif
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    glerr() << "WARNING: could not write mesh cache file " << path << std::endl;
+    std::remove(tmp_path.c_str());
+  }
+}
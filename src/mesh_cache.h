@@ -0,0 +1,37 @@
+// On-disk cache of the Meshes loaded from OBJ files, along with their KDTrees.
+#ifndef MESH_CACHE_H_
+#define MESH_CACHE_H_
+
+#include <string>
+
+#include <cstdint>
+
+class Mesh;
+
+// A cache file holds the vertices, faces, and vertex normals of a Mesh and its
+// compiled KDTree, each as one flat array laid out as in memory, so that loading
+// it is a matter of mapping the file and copying the arrays out. Files are named
+// by a hash of the OBJ file's absolute path and the KDTree build parameters, and
+// record the size and modification time of the OBJ file; an entry is only used
+// while all of these match. The cache is off until a directory is set.
+class MeshCache {
+  public:
+    // Set the directory cache files are kept in, or NULL to disable the cache.
+    static void set_dir(const char *dir);
+
+    // Get the cache directory, or NULL if the cache is disabled.
+    static const char *dir();
+
+    // Load the Mesh of the given OBJ file from the cache. Returns NULL if there
+    // is no up to date entry for it.
+    static Mesh *load(const char *obj_filename);
+
+    // Write a Mesh loaded from the given OBJ file to the cache. Failures are
+    // reported, but not fatal.
+    static void store(const char *obj_filename, const Mesh &mesh);
+
+  private:
+    static std::string entry_path(const std::string &abs_obj_path);
+};
+
+#endif /* MESH_CACHE_H_ */
@@ -12,6 +12,8 @@ class Primitive {
 
     virtual void draw() = 0;
     virtual bool intersect(RayHit &rayhit) const = 0;
+    virtual bool occludes(const Ray &ray, float t_max) const = 0;
+    virtual BBox bbox() const = 0;
     virtual void set_viewmat(const glm::mat4 &viewmat) = 0;
     virtual void set_projmat(const glm::mat4 &projmat) = 0;
     virtual void set_mtl(Material::mtl_id id) = 0;
@@ -34,6 +36,14 @@ class Sphere : public Primitive {
       }
     }
 
+    bool occludes(const Ray &ray, float t_max) const {
+      return ray.hits_sphere(_center, _radius, t_max);
+    }
+
+    BBox bbox() const {
+      return BBox(_center - glm::vec3(_radius), _center + glm::vec3(_radius));
+    }
+
     void set_viewmat(const glm::mat4 &viewmat) {
       _mesh_instance.set_viewmat(viewmat);
     }
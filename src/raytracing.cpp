@@ -1,9 +1,47 @@
 #include "raytracing.h"
 
+#include <algorithm>
+#include <utility>
+
 #include "scene.h"
 #include "mesh.h"
 #include "util.h"
 
+// Bring the given world space ray into the object space of a mesh instance. The
+// direction is not renormalized, so that distances along the object space ray
+// are the same as those along the world space ray.
+static void object_space_ray(const Ray &ray, const glm::mat4 &modelmat,
+    glm::vec3 &origin, glm::vec3 &dir)
+{
+  glm::mat4 inv_modelmat = glm::inverse(modelmat);
+  origin = apply_homog(inv_modelmat, ray.origin(), VEC3_POINT);
+  dir = apply_homog(inv_modelmat, ray.direction(), VEC3_DIR);
+}
+
+bool Ray::hits_mesh(const MeshInstance &mesh, float t_max) const {
+  glm::vec3 origin, dir;
+  object_space_ray(*this, mesh.modelmat(), origin, dir);
+  return mesh.mesh()->occluded(origin, dir, t_max);
+}
+
+bool Ray::hits_sphere(const glm::vec3 &center, float radius, float t_max) const {
+  glm::vec3 translated_origin(_origin - center);
+  float b = 2.0 * glm::dot(translated_origin, _direction);
+  float c = glm::dot(translated_origin, translated_origin) - radius*radius;
+
+  float d2 = b*b - 4*c;
+  if (d2 < 0.0) {
+    return false;
+  }
+
+  float d = sqrt(d2);
+
+  float t1 = (-b + d) / 2.0;
+  float t2 = (-b - d) / 2.0;
+
+  return (t1 >= 0.0 && t1 < t_max) || (t2 >= 0.0 && t2 < t_max);
+}
+
 bool RayHit::intersect_face(const Face &face, const glm::mat4 &modelmat) {
   glm::vec3 a, b, c, n;
   face.verts_transformed(modelmat, a, b, c);
@@ -36,22 +74,31 @@ bool RayHit::intersect_face(const Face &face, const glm::mat4 &modelmat) {
 
 bool RayHit::intersect_mesh(const MeshInstance &mesh) {
   glm::mat4 modelmat = mesh.modelmat();
-  Mesh *m = mesh.mesh();
-
-  std::unordered_set<const Face*> culled_faces = m->kd_tree().collect_possible_faces(ray(), modelmat);
 
-  bool intersected = false;
+  glm::vec3 origin, dir;
+  object_space_ray(_ray, modelmat, origin, dir);
 
-  for (auto itr = culled_faces.begin(); itr != culled_faces.end(); ++itr) {
-    intersected |= this->intersect_face(**itr, modelmat);
+  TriangleHit hit;
+  hit.t = intersected() ? _t : HUGE_VALF;
+  if (!mesh.mesh()->intersect(origin, dir, hit)) {
+    return false;
   }
 
-  if (intersected) {
-    _mesh_instance = &mesh;
-    _mtl_id = mesh.material_id();
-  }
+  set_mesh_hit(mesh, modelmat, hit);
+  return true;
+}
+
+void RayHit::set_mesh_hit(const MeshInstance &mesh, const glm::mat4 &modelmat,
+    const TriangleHit &hit)
+{
+  glm::vec3 n3 = mesh.mesh()->triangle(hit.face).interpolate_norm(hit.beta, hit.gamma);
+  glm::vec4 n4 = modelmat * glm::vec4(n3.x, n3.y, n3.z, 0.0);
 
-  return intersected;
+  _t = hit.t;
+  _modelmat = modelmat;
+  _norm = glm::normalize(glm::vec3(n4.x, n4.y, n4.z));
+  _mesh_instance = &mesh;
+  _mtl_id = mesh.material_id();
 }
 
 bool RayHit::intersect_sphere(const glm::vec3 &center, float radius) {
@@ -104,6 +151,36 @@ bool RayHit::intersect_plane(const glm::vec3 &normal, const glm::vec3 &s) {
   return true;
 }
 
+RayInterval RayPacket::interval() const {
+  glm::vec3 origins[RAY_PACKET_SIZE], dirs[RAY_PACKET_SIZE];
+  for (unsigned i = 0; i < _size; ++i) {
+    origins[i] = _hits[i].ray().origin();
+    dirs[i] = _hits[i].ray().direction();
+  }
+  return RayInterval(origins, dirs, _size);
+}
+
+void RayPacket::intersect_mesh(const MeshInstance &mesh) {
+  glm::mat4 modelmat = mesh.modelmat();
+  glm::mat4 inv_modelmat = glm::inverse(modelmat);
+
+  glm::vec3 origins[RAY_PACKET_SIZE], dirs[RAY_PACKET_SIZE];
+  TriangleHit hits[RAY_PACKET_SIZE];
+  for (unsigned i = 0; i < _size; ++i) {
+    const RayHit &rh = _hits[i];
+    origins[i] = apply_homog(inv_modelmat, rh.ray().origin(), VEC3_POINT);
+    dirs[i] = apply_homog(inv_modelmat, rh.ray().direction(), VEC3_DIR);
+    hits[i].t = rh.intersected() ? rh.t() : HUGE_VALF;
+  }
+
+  uint32_t updated = mesh.mesh()->intersect_packet(origins, dirs, _size, hits);
+  for (unsigned i = 0; i < _size; ++i) {
+    if (updated & (1u << i)) {
+      _hits[i].set_mesh_hit(mesh, modelmat, hits[i]);
+    }
+  }
+}
+
 const Material *RayHit::material() const {
   if (_mtl_id == Material::NONE) {
     return NULL;
@@ -209,62 +286,236 @@ void RayTracing::draw() {
 }
 
 bool RayTracing::trace_next_pixel() {
+  if (_max_passes != 0 && _pass >= _max_passes) {
+    return false;
+  }
+
   if (_trace_y >= _divs_y) {
     if (!increase_divs()) {
-      return false;
+      // Done at full resolution; refine with another sample of every pixel
+      ++_pass;
+      if (_max_passes != 0 && _pass >= _max_passes) {
+        return false;
+      }
+      _trace_x = _trace_y = 0;
     }
   }
 
   unsigned div_width = ceil((double) _image.width() / _divs_x);
   unsigned div_height = ceil((double) _image.height() / _divs_y);
 
-  double center_x = ((double) _trace_x + 0.5) * div_width;
-  double center_y = ((double) _trace_y + 0.5) * div_height;
-  unsigned x0 = _trace_x * div_width;
-  unsigned y0 = _trace_y * div_height;
+  // Trace a block of up to RAY_PACKET_WIDTH x RAY_PACKET_WIDTH divisions, one
+  // ray through the center of each, as a packet. Image positions are of the
+  // corner of a pixel, whose center the ray goes through.
+  unsigned n_x = std::min(_divs_x - _trace_x, (unsigned) RAY_PACKET_WIDTH);
+  unsigned n_y = std::min(_divs_y - _trace_y, (unsigned) RAY_PACKET_WIDTH);
+
+  double xs[RAY_PACKET_SIZE], ys[RAY_PACKET_SIZE];
+  unsigned samples[RAY_PACKET_SIZE];
+  glm::vec3 colors[RAY_PACKET_SIZE];
+  for (unsigned j = 0; j < n_y; ++j) {
+    for (unsigned i = 0; i < n_x; ++i) {
+      xs[j*n_x + i] = (_trace_x + i) * div_width + (div_width - 1) / 2.0;
+      ys[j*n_x + i] = (_trace_y + j) * div_height + (div_height - 1) / 2.0;
+      samples[j*n_x + i] = _pass;
+    }
+  }
 
-  glm::vec3 color = _scene->trace_ray(center_x, center_y, _scene->ray_bounces());
-  _image.set_pixel_range(x0, y0, div_width, div_height, glm::vec4(color.r, color.g, color.b, 1.0));
+  _scene->trace_rays(xs, ys, samples, n_x*n_y, colors, _scene->ray_bounces());
+
+  // The first pass replaces the coarser previews; later ones add to it
+  for (unsigned j = 0; j < n_y; ++j) {
+    for (unsigned i = 0; i < n_x; ++i) {
+      glm::vec3 color = colors[j*n_x + i];
+      unsigned x0 = (_trace_x + i) * div_width;
+      unsigned y0 = (_trace_y + j) * div_height;
+      if (_pass == 0) {
+        _accum.set_range(x0, y0, div_width, div_height, color);
+      } else {
+        _accum.add_sample(x0, y0, color);
+      }
+    }
+  }
   _dirty = true;
 
-  ++_trace_x;
+  _trace_x += n_x;
   if (_trace_x >= _divs_x) {
     _trace_x = 0;
-    ++_trace_y;
+    _trace_y += n_y;
   }
 
   return true;
 }
 
+// Trace a packet of samples for a threaded pass and add them to the image.
+void RayTracing::trace_samples(const double *xs, const double *ys, const unsigned *samples,
+    unsigned n)
+{
+  glm::vec3 colors[RAY_PACKET_SIZE];
+  _scene->trace_rays(xs, ys, samples, n, colors, _scene->ray_bounces());
+  for (unsigned i = 0; i < n; ++i) {
+    _accum.add_sample(xs[i], ys[i], colors[i]);
+  }
+  _dirty = true;
+}
+
 void raytracer_thread(void *argptr) {
-  RayTracing *rt = (RayTracing*) argptr;
-  unsigned x0, y0, w, h;
-  while (rt->next_section(x0, y0, w, h)) {
-    for (unsigned i = 0; i < w && rt->_threaded_raytrace; ++i) {
-      for (unsigned j = 0; j < h && rt->_threaded_raytrace; ++j) {
-        glm::vec3 color = rt->_scene->trace_ray(x0 + i, y0 + j, rt->_scene->ray_bounces());
-        rt->_image.set_pixel(x0 + i, y0 + j, glm::vec4(color.r, color.g, color.b, 1.0));
-        rt->_dirty = true;
+  RayTracing::render_worker *worker = (RayTracing::render_worker*) argptr;
+  RayTracing *rt = worker->rt;
+
+  Tile t;
+  while (rt->_threaded_raytrace && rt->_tiles.next(worker->index, t)) {
+    // Tiles are traced in blocks of up to RAY_PACKET_WIDTH x RAY_PACKET_WIDTH
+    // pixels, each traced as a packet
+    for (unsigned by = 0; by < t.h && rt->_threaded_raytrace; by += RAY_PACKET_WIDTH) {
+      // If another worker has run dry, hand it the bottom half of what is left
+      unsigned rows_left = t.h - by;
+      if (rows_left >= 2*RAY_PACKET_WIDTH && rt->_tiles.hungry()) {
+        unsigned split = (rows_left / RAY_PACKET_WIDTH / 2) * RAY_PACKET_WIDTH;
+        Tile rest = t;
+        rest.y = t.y + t.h - split;
+        rest.h = split;
+        if (rt->_tiles.give_back(worker->index, rest)) {
+          t.h -= split;
+        }
       }
+
+      for (unsigned bx = 0; bx < t.w && rt->_threaded_raytrace; bx += RAY_PACKET_WIDTH) {
+        unsigned n_x = std::min(t.w - bx, (unsigned) RAY_PACKET_WIDTH);
+        unsigned n_y = std::min(t.h - by, (unsigned) RAY_PACKET_WIDTH);
+
+        // Gather the samples the pass plans for the block into packets. A
+        // pixel's new samples follow on from those it already has.
+        double xs[RAY_PACKET_SIZE], ys[RAY_PACKET_SIZE];
+        unsigned samples[RAY_PACKET_SIZE];
+        unsigned n = 0;
+        for (unsigned j = 0; j < n_y; ++j) {
+          for (unsigned i = 0; i < n_x; ++i) {
+            unsigned x = t.x + bx + i;
+            unsigned y = t.y + by + j;
+            unsigned first = rt->_accum.samples(x, y);
+            unsigned count = rt->_plan[y*rt->_accum.width() + x];
+            for (unsigned s = 0; s < count; ++s) {
+              xs[n] = x;
+              ys[n] = y;
+              samples[n] = first + s;
+              if (++n == RAY_PACKET_SIZE) {
+                rt->trace_samples(xs, ys, samples, n);
+                n = 0;
+              }
+            }
+          }
+        }
+        if (n > 0) {
+          rt->trace_samples(xs, ys, samples, n);
+        }
+      }
+    }
+  }
+}
+
+void raytracer_passes(void *argptr) {
+  RayTracing *rt = (RayTracing*) argptr;
+  ThreadPool &pool = thread_pool();
+
+  while (rt->_threaded_raytrace && (rt->_max_passes == 0 || rt->_pass < rt->_max_passes)) {
+    if (!rt->plan_pass()) {
+      break; // converged, or out of samples
     }
+
+    // One task per worker; each takes tiles until the pass is done. Waiting
+    // runs tasks of the pass on this thread as well.
+    rt->_tiles.reset(rt->_accum.width(), rt->_accum.height(), pool.size());
+    for (unsigned i = 0; i < pool.size(); ++i) {
+      pool.submit(raytracer_thread, (void*) &rt->_workers[i], rt->_pass_tasks);
+    }
+    pool.wait(rt->_pass_tasks);
+
+    if (!rt->_threaded_raytrace) {
+      break; // the pass was cut short
+    }
+    ++rt->_pass;
   }
 }
 
 void RayTracing::start_threaded_raytrace() {
   _threaded_raytrace = true;
-  _section = 0;
 
-  // PROCESSOR_COUNT is defined in the CMake file; should match the number of
-  // processors available on your system
-  for (unsigned i = 0; i < PROCESSOR_COUNT; ++i) {
-    _threads.push_back(create_thread(raytracer_thread, (void*) this));
+  ThreadPool &pool = thread_pool();
+  _workers.resize(pool.size());
+  for (unsigned i = 0; i < pool.size(); ++i) {
+    _workers[i].rt = this;
+    _workers[i].index = i;
   }
+  pool.submit(raytracer_passes, (void*) this, _render_tasks);
 }
 
 void RayTracing::stop_threaded_raytrace() {
   _threaded_raytrace = false;
-  join_all_threads();
-  _threads.clear();
+  _tiles.cancel();
+  thread_pool().wait(_render_tasks);
+}
+
+void RayTracing::render() {
+  assert(_max_passes > 0 || _sample_budget > 0);
+  start_threaded_raytrace();
+  thread_pool().wait(_render_tasks);
+  _threaded_raytrace = false;
+}
+
+// Decide how many samples each pixel takes in the next threaded pass, in _plan.
+// Returns false if there is nothing left to trace.
+bool RayTracing::plan_pass() {
+  unsigned width = _accum.width(), height = _accum.height();
+  _plan.resize(width*height);
+
+  uint64_t taken = 0, planned = 0;
+  for (unsigned y = 0; y < height; ++y) {
+    for (unsigned x = 0; x < width; ++x) {
+      unsigned n = _accum.samples(x, y);
+      taken += n;
+
+      // Pixels take one sample a pass until their error can be trusted, and
+      // then as many as their error is multiples of the threshold
+      unsigned count = 1;
+      if (_noise_threshold > 0 && n >= ADAPTIVE_MIN_SAMPLES) {
+        float ratio = _accum.error(x, y, ADAPTIVE_ERROR_FLOOR) / _noise_threshold;
+        count = ratio <= 1.0 ? 0 : std::min((unsigned) ceil(ratio), (unsigned) ADAPTIVE_MAX_PASS_SAMPLES);
+      }
+      _plan[y*width + x] = count;
+      planned += count;
+    }
+  }
+
+  if (_sample_budget == 0) {
+    return planned > 0;
+  }
+
+  uint64_t budget = (uint64_t) _sample_budget * width * height;
+  uint64_t left = taken < budget ? budget - taken : 0;
+  if (planned <= left) {
+    return planned > 0;
+  }
+
+  // The budget does not cover the whole pass: spend what is left on the
+  // pixels with the highest errors, breaking ties by position so the image
+  // does not depend on the sort
+  std::vector<std::pair<float, unsigned>> order;
+  for (unsigned i = 0; i < _plan.size(); ++i) {
+    if (_plan[i] > 0) {
+      order.push_back(std::make_pair(-_accum.error(i % width, i / width, ADAPTIVE_ERROR_FLOOR), i));
+    }
+  }
+  std::sort(order.begin(), order.end());
+
+  planned = 0;
+  for (unsigned i = 0; i < order.size(); ++i) {
+    uint8_t &count = _plan[order[i].second];
+    count = std::min((uint64_t) count, left - planned);
+    planned += count;
+  }
+
+  return planned > 0;
 }
 
 bool RayTracing::increase_divs() {
@@ -307,13 +558,24 @@ void RayTracing::lazy_init_fbo() {
   handle_gl_error("[RayTracing::lazy_init_fbo] Leaving function");
 }
 
+bool RayTracing::write(const char *filename) {
+  if (file_extension(filename) == "pfm") {
+    return _accum.write_pfm(filename);
+  }
+
+  _accum.resolve(_image);
+  return _image.write(filename);
+}
+
 void RayTracing::pack_data() {
+  // Samples that land while the image is converted mark it dirty again
+  _dirty = false;
+  _accum.resolve(_image);
+
   glBindTexture(GL_TEXTURE_RECTANGLE, _tex);
   handle_gl_error("[RayTracing::pack_data] Binding texture");
 
   glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA8, _image.width(), _image.height(), 0,
       GL_RGBA, GL_UNSIGNED_BYTE, (const void*) _image.data());
   handle_gl_error("[RayTracing::pack_data] Leaving function");
-
-  _dirty = false;
 }
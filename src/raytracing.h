@@ -12,6 +12,7 @@
 #include "image.h"
 #include "material.h"
 #include "threads.h"
+#include "tile_scheduler.h"
 
 class Face;
 class Scene;
@@ -32,6 +33,12 @@ class Ray {
       return _origin + t*_direction;
     }
 
+    // Occlusion tests: check whether this ray hits the given mesh instance or
+    // sphere at a distance in [0, t_max). Unlike the RayHit intersection
+    // functions, these do not work out the normal of the hit.
+    bool hits_mesh(const MeshInstance &mesh, float t_max) const;
+    bool hits_sphere(const glm::vec3 &center, float radius, float t_max) const;
+
   private:
     glm::vec3 _origin;
     glm::vec3 _direction;
@@ -55,6 +62,12 @@ class RayHit {
     bool intersect_sphere(const glm::vec3 &center, float radius);
     bool intersect_plane(const glm::vec3 &normal, const glm::vec3 &s);
 
+    // Record a hit already known to be on the given mesh instance, as for a
+    // ray aimed at a point drawn on a light, without tracing the ray.
+    void set_hit(const MeshInstance &mesh, const TriangleHit &hit) {
+      set_mesh_hit(mesh, mesh.modelmat(), hit);
+    }
+
     bool intersected() const { return !std::isnan(_t); }
     glm::vec3 intersection_point() const { return _ray.point_at(_t); }
 
@@ -71,12 +84,60 @@ class RayHit {
     }
 
   private:
+    // An empty hit, to fill RayPacket's storage with
+    RayHit() :
+      _t(NAN), _ray(glm::vec3(0.0), glm::vec3(0.0, 0.0, 1.0)),
+      _mesh_instance(NULL), _mtl_id(Material::NONE) {}
+
+    void set_mesh_hit(const MeshInstance &mesh, const glm::mat4 &modelmat, const TriangleHit &hit);
+
     float _t;
     Ray _ray;
     const MeshInstance *_mesh_instance;
     glm::mat4 _modelmat;
     glm::vec3 _norm;
     Material::mtl_id _mtl_id;
+
+    friend class RayPacket;
+};
+
+// Samples every pixel takes before adaptive sampling trusts its error estimate
+#define ADAPTIVE_MIN_SAMPLES 4
+
+// Most samples adaptive sampling gives one pixel in a pass
+#define ADAPTIVE_MAX_PASS_SAMPLES 4
+
+// Brightness below which adaptive sampling judges the noise of a pixel as if
+// the pixel were this bright; see AccumBuffer::error()
+#define ADAPTIVE_ERROR_FLOOR 0.05f
+
+// Side of the square blocks of pixels whose primary rays are traced as packets.
+#define RAY_PACKET_WIDTH 4
+
+// A bundle of up to RAY_PACKET_SIZE rays, such as the primary rays through a
+// block of pixels, traced through the acceleration structures together.
+class RayPacket {
+  public:
+    RayPacket() : _size(0) {}
+
+    void add(const Ray &ray) {
+      assert(_size < RAY_PACKET_SIZE);
+      _hits[_size++] = RayHit(ray);
+    }
+
+    unsigned size() const { return _size; }
+    RayHit &operator[](unsigned i) { return _hits[i]; }
+    const RayHit &operator[](unsigned i) const { return _hits[i]; }
+
+    // Get conservative bounds on the rays of this packet.
+    RayInterval interval() const;
+
+    // Intersect every ray of this packet with the given mesh instance.
+    void intersect_mesh(const MeshInstance &mesh);
+
+  private:
+    RayHit _hits[RAY_PACKET_SIZE];
+    unsigned _size;
 };
 
 class RayTree;
@@ -143,41 +204,83 @@ class RayTracing {
   public:
     RayTracing(const Scene *scene, bool progressive = true)
       : _scene(scene), _image(Canvas::width(), Canvas::height()),
+      _accum(Canvas::width(), Canvas::height()),
       _dirty(true), _tex(0), _fbo(0),
-      _trace_x(0), _trace_y(0),
-      _section(0), _threaded_raytrace(false)
+      _trace_x(0), _trace_y(0), _pass(0), _max_passes(0),
+      _noise_threshold(0.0), _sample_budget(0), _threaded_raytrace(false)
     {
       set_progressive(progressive);
-      _section_lock = create_mutex();
     }
 
     RayTracing(const Scene *scene, unsigned width, unsigned height, bool progressive = true) :
-      _scene(scene), _image(width, height), _dirty(true), _fbo(0),
-      _trace_x(0), _trace_y(0),
-      _section(0), _threaded_raytrace(false)
+      _scene(scene), _image(width, height), _accum(width, height), _dirty(true), _fbo(0),
+      _trace_x(0), _trace_y(0), _pass(0), _max_passes(0),
+      _noise_threshold(0.0), _sample_budget(0), _threaded_raytrace(false)
     {
       set_progressive(progressive);
-      _section_lock = create_mutex();
     }
 
     ~RayTracing() {
       stop_threaded_raytrace();
-      destroy_mutex(_section_lock);
     }
 
     void draw();
+
+    // Trace the next block of the progressive render. Until the image is done
+    // at full resolution, blocks of pixels at coarser resolutions are filled
+    // with one sample each; after that, each pass over the image adds one
+    // sample to every pixel. Returns false once max_passes() passes are done.
     bool trace_next_pixel();
+
+    // Start tracing passes over the image on the thread pool until max_passes()
+    // passes are done, the samples are used up or converge (see
+    // set_noise_threshold() and set_sample_budget()), or the trace is stopped.
     void start_threaded_raytrace();
     void stop_threaded_raytrace();
 
+    // Trace passes over the image on the thread pool as start_threaded_raytrace()
+    // does, and return once they are done. At least one of max_passes() or
+    // sample_budget() must not be 0.
+    void render();
+
+    // Set the number of passes after which threaded tracing stops, or 0 to
+    // keep refining the image until the trace is stopped. Without a noise
+    // threshold each pass adds one sample to every pixel.
+    void set_max_passes(unsigned n) { _max_passes = n; }
+    unsigned max_passes() const { return _max_passes; }
+
+    // Set the relative error (see AccumBuffer::error()) below which a pixel of
+    // a threaded trace takes no more samples, or 0 to sample every pixel the
+    // same. Once every pixel has ADAPTIVE_MIN_SAMPLES samples, each pass only
+    // samples pixels whose error is above the threshold, taking more samples of
+    // those with higher errors, and tracing stops when none are left.
+    void set_noise_threshold(float threshold) { _noise_threshold = threshold; }
+    float noise_threshold() const { return _noise_threshold; }
+
+    // Set the number of samples per pixel, on average, that a threaded trace
+    // may take in all, or 0 for no limit. Passes the budget cannot cover in
+    // full are spent on the pixels with the highest errors.
+    void set_sample_budget(unsigned samples_per_pixel) { _sample_budget = samples_per_pixel; }
+    unsigned sample_budget() const { return _sample_budget; }
+
+    // Get the number of passes over the whole image done so far.
+    unsigned passes() const { return _pass; }
+
     void reset() {
+      _accum.clear();
       _image.clear_to_color(pixel_color(0,0,0,1));
       _trace_x = _trace_y = 0;
       _divs_x = _starting_divs_x;
       _divs_y = _starting_divs_y;
+      _pass = 0;
     }
 
-    Image &image() { return _image; }
+    // Get the samples traced so far.
+    const AccumBuffer &accum() const { return _accum; }
+
+    // Write the image to a file. PFM files get the mean of each pixel's samples
+    // at full precision, and other formats the clamped 8-bit display image.
+    bool write(const char *filename);
 
   private:
     void lazy_init_fbo();
@@ -192,36 +295,12 @@ class RayTracing {
       }
     }
     bool increase_divs();
-
-    bool next_section(unsigned &x0, unsigned &y0, unsigned &w, unsigned &h) {
-      if (!_threaded_raytrace) {
-        return false;
-      }
-
-      lock_mutex(_section_lock);
-      unsigned sec = _section++;
-      unlock_mutex(_section_lock);
-
-      unsigned div_w = ceil((double) _image.width() / _starting_divs_x);
-      unsigned div_h = ceil((double) _image.height() / _starting_divs_y);
-
-      unsigned x = sec % _starting_divs_x;
-      unsigned y = sec / _starting_divs_x;
-
-      if (y >= _starting_divs_y) {
-        return false;
-      }
-
-      x0 = x * div_w;
-      y0 = y * div_h;
-      w = std::min(div_w, _image.width() - x0);
-      h = std::min(div_h, _image.height() - y0);
-
-      return true;
-    }
+    bool plan_pass();
+    void trace_samples(const double *xs, const double *ys, const unsigned *samples, unsigned n);
 
     const Scene *_scene;
-    Image _image;
+    Image _image; // display format, converted from _accum when uploaded
+    AccumBuffer _accum;
 
     bool _dirty;
 
@@ -231,11 +310,23 @@ class RayTracing {
     unsigned _starting_divs_x, _starting_divs_y;
     unsigned _divs_x, _divs_y;
     unsigned _trace_x, _trace_y;
-
-    std::vector<thread_id> _threads;
-    mutex_t _section_lock;
-    unsigned _section;
+    unsigned _pass, _max_passes;
+    float _noise_threshold;
+    unsigned _sample_budget;
+
+    // What each render task is handed: the raytrace, and which worker it is
+    struct render_worker {
+      RayTracing *rt;
+      unsigned index;
+    };
+
+    ThreadPool::TaskGroup _render_tasks; // the task running the passes
+    ThreadPool::TaskGroup _pass_tasks; // the workers of the current pass
+    TileScheduler _tiles;
+    std::vector<uint8_t> _plan; // samples each pixel takes in the current pass
+    std::vector<render_worker> _workers;
     bool _threaded_raytrace;
+    friend void raytracer_passes(void*);
     friend void raytracer_thread(void*);
 };
 
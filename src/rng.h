@@ -0,0 +1,58 @@
+// Random number streams for rendering.
+#ifndef RNG_H_
+#define RNG_H_
+
+#include <cstdint>
+
+// A counter-based random number generator, giving the stream of random numbers
+// for one sample of one pixel. Rather than carrying state from one number to
+// the next, the i-th number of a stream is a hash of the seed, the pixel, the
+// sample index, and i (the dimension), so a stream depends only on where it is
+// used and not on which thread uses it or what was traced before it. Renders
+// with the same seed are identical at any thread count.
+//
+// An RNG is meant to be made on the stack for each sample and passed down the
+// tracing calls; it must not be shared between threads.
+class RNG {
+  public:
+    RNG(uint32_t x, uint32_t y, uint32_t sample) : _dim(0) {
+      uint64_t stream = mix(((uint64_t) _seed << 32) | sample);
+      _key = mix(stream ^ (((uint64_t) x << 32) | y));
+    }
+
+    // An empty stream, only meant to be assigned over, so RNGs can be kept in
+    // fixed-size arrays.
+    RNG() : _key(0), _dim(0) {}
+
+    // Set the seed every stream is derived from. Must not be called while
+    // rendering.
+    static void set_seed(uint32_t seed) { _seed = seed; }
+    static uint32_t seed() { return _seed; }
+
+    // Generate a random floating-point value in the range [0, 1).
+    double randf() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+    // Generate a random integer.
+    uint32_t randi() { return next() >> 32; }
+
+    // Get the number of values drawn from this stream so far.
+    uint32_t dimension() const { return _dim; }
+
+  private:
+    uint64_t next() { return mix(_key + 0x9e3779b97f4a7c15ULL * ++_dim); }
+
+    // The SplitMix64 finalizer: a bijection on 64-bit integers in which every
+    // input bit affects every output bit.
+    static uint64_t mix(uint64_t z) {
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      return z ^ (z >> 31);
+    }
+
+    uint64_t _key;
+    uint32_t _dim;
+
+    static uint32_t _seed;
+};
+
+#endif /* RNG_H_ */
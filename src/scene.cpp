@@ -2,6 +2,7 @@
 
 #include <fstream>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 #include <algorithm>
 
@@ -20,16 +21,43 @@ Scene Scene::from_scn(const char *filename) {
   std::ifstream scnfile(filename);
   assert(scnfile.good());
 
-  Scene scene;
+  std::vector<std::vector<std::string>> directives;
   std::string line;
-
   while (std::getline(scnfile, line)) {
     line = strip(line);
     if (line.empty() || line[0] == '#') {
       continue;
     }
 
-    auto tokens = split(line);
+    directives.push_back(split(line));
+  }
+
+  // Load every mesh the file declares at once on the thread pool, except
+  // those whose names are taken, before going through the directives in
+  // order. Each is only added to the store, or its errors reported, at its
+  // own directive, so that which meshes can be instanced where, and which
+  // error a broken file stops at, are as if they were loaded one by one.
+  // Malformed directives are left for the loop below to report.
+  std::unordered_map<std::string, ObjLoad*> loads;
+  for (unsigned i = 0; i < directives.size(); ++i) {
+    const std::vector<std::string> &tokens = directives[i];
+    if (tokens[0] == "mesh" && tokens.size() == 3 && get_mesh_id(tokens[1].c_str()) == Mesh::NONE
+        && loads.find(tokens[1]) == loads.end())
+    {
+      loads[tokens[1]] = new ObjLoad(concat_path(dirs, tokens[2]).c_str());
+    }
+  }
+
+  // The directives below exit on errors, which must not happen while loads
+  // are running
+  for (std::unordered_map<std::string, ObjLoad*>::iterator itr = loads.begin(); itr != loads.end(); ++itr) {
+    itr->second->wait();
+  }
+
+  Scene scene;
+
+  for (unsigned i = 0; i < directives.size(); ++i) {
+    const std::vector<std::string> &tokens = directives[i];
 
     if (tokens[0] == "mesh") {
       if (tokens.size() != 3) {
@@ -37,7 +65,12 @@ Scene Scene::from_scn(const char *filename) {
         exit(-1);
       }
 
-      add_mesh_from_obj(tokens[1].c_str(), concat_path(dirs, tokens[2]).c_str());
+      // Meshes of names already taken are never loaded, as with
+      // add_mesh_from_obj()
+      if (get_mesh_id(tokens[1].c_str()) == Mesh::NONE) {
+        assert(loads.find(tokens[1]) != loads.end());
+        loads[tokens[1]]->add(tokens[1].c_str());
+      }
     } else if (tokens[0] == "materials") {
       if (tokens.size() != 2) {
         glerr() << "ERROR: incorrect number of arguments for new MTL file in SCN" << std::endl;
@@ -119,7 +152,7 @@ Scene Scene::from_scn(const char *filename) {
       if (!scene._mesh_instances.empty()) {
         const Material *mtl = scene._mesh_instances.back().material();
         if (glm::length(mtl->emitted()) > EPSILON) {
-          scene._lights.push_back(scene._mesh_instances.size() - 1);
+          scene._lights.push_back(AreaLight(scene._mesh_instances, scene._mesh_instances.size() - 1));
         }
       }
 
@@ -208,10 +241,18 @@ Scene Scene::from_scn(const char *filename) {
   if (!scene._mesh_instances.empty()) {
     const Material *mtl = scene._mesh_instances.back().material();
     if (glm::length(mtl->emitted()) > EPSILON) {
-      scene._lights.push_back(scene._mesh_instances.size() - 1);
+      scene._lights.push_back(AreaLight(scene._mesh_instances, scene._mesh_instances.size() - 1));
     }
   }
 
+  for (std::unordered_map<std::string, ObjLoad*>::iterator itr = loads.begin(); itr != loads.end(); ++itr) {
+    delete itr->second;
+  }
+
+  scene._light_tree.build(scene._lights);
+  scene._bvh.build(scene._mesh_instances, scene._primitives);
+  scene.refresh_camera();
+
   return scene;
 }
 
@@ -246,42 +287,105 @@ void Scene::draw() {
 #define RAY_TYPE_REFLECT  1
 
 glm::vec3 Scene::trace_ray(double x, double y, RayTreeNode *treenode, int bounces) const {
+  unsigned samples = std::max(_lens_samples, 1u);
+
+  glm::vec3 color(0.0);
+  for (unsigned i = 0; i < samples; ++i) {
+    RNG rng(uint32_t(x), uint32_t(y), i);
+    Ray ray(glm::vec3(0.0), glm::vec3(0.0, 0.0, -1.0));
+    if (primary_ray(x, y, i, rng, ray)) {
+      color += trace_ray(ray, treenode, bounces + 1, RAY_TYPE_ROOT, rng);
+    }
+  }
+
+  return color / float(samples);
+}
+
+void Scene::trace_rays(const double *xs, const double *ys, const unsigned *samples, unsigned n,
+    glm::vec3 *colors, int bounces) const
+{
+  assert(n <= RAY_PACKET_SIZE);
+
+  RayPacket packet;
+  RNG rngs[RAY_PACKET_SIZE];
+  RNG *lane_rngs[RAY_PACKET_SIZE];
+
+  double us[RAY_PACKET_SIZE], vs[RAY_PACKET_SIZE];
+
+  for (unsigned i = 0; i < n; ++i) {
+    rngs[i] = RNG(uint32_t(xs[i]), uint32_t(ys[i]), samples[i]);
+    lane_rngs[i] = &rngs[i];
+    film_position(xs[i], ys[i], samples[i], rngs[i], us[i], vs[i]);
+  }
+
+  // Samples the camera blocks are black; the packet holds only the others
+  uint32_t cast = _view.cast_rays(us, vs, n, lane_rngs, packet);
+  if (cast == (1u << n) - 1) {
+    trace_packet(packet, bounces + 1, colors, lane_rngs);
+    return;
+  }
+
+  RNG *cast_rngs[RAY_PACKET_SIZE];
+  unsigned m = 0;
+  for (unsigned i = 0; i < n; ++i) {
+    if (cast & (1u << i)) {
+      cast_rngs[m++] = lane_rngs[i];
+    }
+  }
+
+  glm::vec3 cast_colors[RAY_PACKET_SIZE];
+  if (m > 0) {
+    trace_packet(packet, bounces + 1, cast_colors, cast_rngs);
+  }
+  for (unsigned i = 0, k = 0; i < n; ++i) {
+    colors[i] = (cast & (1u << i)) ? cast_colors[k++] : glm::vec3(0.0);
+  }
+}
+
+bool Scene::primary_ray(double x, double y, unsigned sample, RNG &rng, Ray &ray) const {
+  double u, v;
+  film_position(x, y, sample, rng, u, v);
+  return _view.cast_ray(u, v, rng, ray);
+}
+
+void Scene::film_position(double x, double y, unsigned sample, RNG &rng, double &u, double &v) const {
   double center_x = x + 0.5;
   double center_y = y + 0.5;
 
-  if (_lens_samples <= 1) {
-    double norm_x = center_x / Canvas::width();
-    double norm_y = center_y / Canvas::height();
-    return trace_ray(_camera->cast_ray(norm_x, norm_y), treenode, bounces + 1, RAY_TYPE_ROOT);
+  // The first sample of a pixel goes through its center, and later ones are
+  // jittered across it
+  if (sample > 0) {
+    center_x += rng.randf() - 0.5;
+    center_y += rng.randf() - 0.5;
   }
 
-  glm::vec3 color(0.0);
+  u = center_x / _width;
+  v = center_y / _height;
+}
 
-  for (unsigned i = 0; i < _lens_samples; ++i) {
-    double rand_x = randf() - 0.5, rand_y = randf() - 0.5;
-    double norm_x = (center_x + rand_x) / Canvas::width();
-    double norm_y = (center_y + rand_y) / Canvas::height();
-    glm::vec3 raycolor = trace_ray(_camera->cast_ray(norm_x, norm_y), treenode, bounces + 1, RAY_TYPE_ROOT);
-    color += raycolor;
-  }
+static Ray reflected_ray(const RayHit &rayhit) {
+  glm::vec3 n = rayhit.norm();
+  glm::vec3 origin = rayhit.intersection_point() + EPSILON*n;
+  glm::vec3 incident = rayhit.ray().direction();
+  glm::vec3 reflected = incident - 2.0f*glm::dot(incident, n)*n;
+
+  return Ray(origin, reflected);
+}
 
-  return color / float(_lens_samples);
+static glm::vec3 clamp_color(glm::vec3 color) {
+  color.r = std::min(color.r, 1.0f);
+  color.g = std::min(color.g, 1.0f);
+  color.b = std::min(color.b, 1.0f);
+  return color;
 }
 
-glm::vec3 Scene::trace_ray(const Ray &ray, RayTreeNode *treenode, int level, int type) const {
+glm::vec3 Scene::trace_ray(const Ray &ray, RayTreeNode *treenode, int level, int type, RNG &rng) const {
   if (level <= 0) {
     return glm::vec3(0,0,0);
   }
 
   RayHit rayhit(ray);
-
-  for (unsigned i = 0; i < _mesh_instances.size(); ++i) {
-    rayhit.intersect_mesh(_mesh_instances[i]);
-  }
-
-  for (unsigned i = 0; i < _primitives.size(); ++i) {
-    _primitives[i]->intersect(rayhit);
-  }
+  intersect(rayhit);
 
   glm::vec3 raytree_color;
   if (type == RAY_TYPE_ROOT) {
@@ -294,77 +398,130 @@ glm::vec3 Scene::trace_ray(const Ray &ray, RayTreeNode *treenode, int level, int
     treenode->add_child(rayhit, raytree_color);
   }
 
+  glm::vec3 color;
+  if (!shade(rayhit, treenode, color, rng)) {
+    return color;
+  }
+
+  const Material *mtl = rayhit.material();
+  if (mtl->reflect_on()) {
+    color += mtl->specular() * trace_ray(reflected_ray(rayhit), treenode, level-1, RAY_TYPE_REFLECT, rng);
+  }
+
+  return clamp_color(color);
+}
+
+void Scene::trace_packet(RayPacket &packet, int level, glm::vec3 *colors, RNG *const *rngs) const {
+  if (level <= 0) {
+    for (unsigned i = 0; i < packet.size(); ++i) {
+      colors[i] = glm::vec3(0,0,0);
+    }
+    return;
+  }
+
+  intersect(packet);
+
+  // The reflections of the whole packet are traced together as the next packet
+  bool lit[RAY_PACKET_SIZE];
+  RayPacket reflections;
+  unsigned reflected_from[RAY_PACKET_SIZE];
+  RNG *reflected_rngs[RAY_PACKET_SIZE];
+
+  for (unsigned i = 0; i < packet.size(); ++i) {
+    lit[i] = shade(packet[i], NULL, colors[i], *rngs[i]);
+    if (lit[i] && packet[i].material()->reflect_on()) {
+      reflected_from[reflections.size()] = i;
+      reflected_rngs[reflections.size()] = rngs[i];
+      reflections.add(reflected_ray(packet[i]));
+    }
+  }
+
+  if (reflections.size() > 0) {
+    glm::vec3 reflected_colors[RAY_PACKET_SIZE];
+    trace_packet(reflections, level-1, reflected_colors, reflected_rngs);
+    for (unsigned k = 0; k < reflections.size(); ++k) {
+      unsigned i = reflected_from[k];
+      colors[i] += packet[i].material()->specular() * reflected_colors[k];
+    }
+  }
+
+  for (unsigned i = 0; i < packet.size(); ++i) {
+    if (lit[i]) {
+      colors[i] = clamp_color(colors[i]);
+    }
+  }
+}
+
+bool Scene::shade(const RayHit &rayhit, RayTreeNode *treenode, glm::vec3 &color, RNG &rng) const {
   if (!rayhit.intersected()) {
-    return _bg_color;
+    color = _bg_color;
+    return false;
   }
 
-  glm::vec3 color;
+  color = glm::vec3(0.0);
   const Material *mtl = rayhit.material();
   if (mtl) {
     if (mtl->emittance_power() > 0.0) {
-      glm::vec3 ret = mtl->emitted();
-      ret += float(atan(mtl->emittance_power()) / PI)*(glm::vec3(1.0) - mtl->emitted());
-      return ret;
+      color = mtl->emitted();
+      color += float(atan(mtl->emittance_power()) / PI)*(glm::vec3(1.0) - mtl->emitted());
+      return false;
     } else {
       color += mtl->ambient();
     }
   }
 
-  for (unsigned i = 0; i < _lights.size(); ++i) {
-    const MeshInstance *mi = &_mesh_instances[_lights[i]];
-    const Mesh *m = mi->mesh();
-    //const Material *light_mtl = mi->material();
-    glm::mat4 modelmat = mi->modelmat();
-    glm::vec3 lightcolor;
-
-    for (unsigned j = 0; j < _shadow_samples; ++j) {
-      const Face *f = m->face(randi() % m->faces_size());
-      glm::vec3 facepoint = f->random_point_transformed(modelmat);
-      glm::vec3 origin(rayhit.intersection_point() + EPSILON*rayhit.norm());
-
-      RayHit lightray(origin, facepoint-origin);
-      if (!lightray.intersect_mesh(*mi)) {
-        --j;
-        continue;
-      }
-      float light_t = lightray.t();
+  glm::vec3 origin(rayhit.intersection_point() + EPSILON*rayhit.norm());
+
+  // Each shadow ray goes to a light picked by the light tree, and straight to
+  // a point drawn on it. Points are drawn over the whole light, so on a curved
+  // light many are hidden behind its near side; the ray then lights the point
+  // from where it first meets the light, rather than being taken as shadowed.
+  // Dividing by the probability of the pick makes the mean of the samples the
+  // sum of the lights' contributions. The picks are stratified, so that with
+  // as many samples as lights of the same power, each light gets one.
+  glm::vec3 lightcolor;
+  for (unsigned j = 0; j < _shadow_samples; ++j) {
+    unsigned l;
+    float prob;
+    float u = (j + rng.randf()) / _shadow_samples;
+    if (!_light_tree.pick(origin, rayhit.norm(), u, l, prob)) {
+      continue;
+    }
 
-      for (unsigned m = 0; m < _mesh_instances.size(); ++m) {
-        lightray.intersect_mesh(_mesh_instances[m]);
-      }
+    const AreaLight &light = _lights[l];
+    const MeshInstance &mi = _mesh_instances[light.instance()];
 
-      for (unsigned m = 0; m < _primitives.size(); ++m) {
-        _primitives[m]->intersect(lightray);
-      }
+    TriangleHit hit;
+    glm::vec3 lightpoint = light.sample(mi, rng, hit);
+    hit.t = glm::distance(lightpoint, origin);
+    if (hit.t < EPSILON) {
+      continue;
+    }
 
-      if (treenode) {
-        treenode->add_child(lightray, glm::vec3(0, 1, 0));
-      }
+    RayHit lightray(origin, lightpoint - origin);
+    lightray.set_hit(mi, hit);
+    if (lightray.intersect_mesh(mi)) {
+      hit.t = lightray.t();
+    }
 
-      if (lightray.t() < light_t) {
+    if (treenode) {
+      // The ray tree shows where each shadow ray ends, so find its closest hit
+      RayHit closest(lightray.ray());
+      intersect(closest);
+      treenode->add_child(closest, glm::vec3(0, 1, 0));
+      if (closest.t() < hit.t - EPSILON) {
         continue;
       }
-
-      lightcolor += mtl->shade(rayhit, lightray);
+    } else if (occluded(lightray.ray(), hit.t - EPSILON)) {
+      continue;
     }
 
-    color += lightcolor / float(_shadow_samples);
+    lightcolor += mtl->shade(rayhit, lightray) / prob;
   }
 
-  if (mtl->reflect_on()) {
-    glm::vec3 n = rayhit.norm();
-    glm::vec3 origin = rayhit.intersection_point() + EPSILON*n;
-    glm::vec3 incident = rayhit.ray().direction();
-    glm::vec3 reflected = incident - 2.0f*glm::dot(incident, n)*n;
-
-    Ray reflect(origin, reflected);
-    color += mtl->specular() * trace_ray(reflect, treenode, level-1, RAY_TYPE_REFLECT);
-  }
+  color += lightcolor / float(_shadow_samples);
 
-  color.r = std::min(color.r, 1.0f);
-  color.g = std::min(color.g, 1.0f);
-  color.b = std::min(color.b, 1.0f);
-  return color;
+  return true;
 }
 
 void Scene::visualize_raytree(double x, double y) {
@@ -5,8 +5,10 @@
 
 #include <glm/glm.hpp>
 
+#include "bvh.h"
 #include "camera.h"
 #include "kd_tree.h"
+#include "light.h"
 #include "mesh.h"
 #include "primitive.h"
 #include "raytracing.h"
@@ -15,27 +17,41 @@ class Scene {
   public:
     Scene(Scene &&other) {
       _mesh_instances = std::move(other._mesh_instances);
+      _primitives = std::move(other._primitives);
+      other._primitives.clear();
+      _bvh = std::move(other._bvh);
       _lights = std::move(other._lights);
+      _light_tree = std::move(other._light_tree);
       _raytree = std::move(other._raytree);
       _camera = other._camera;
       other._camera = NULL;
+      _view = other._view;
       _draw_kdtree = other._draw_kdtree;
       _shadow_samples = other._shadow_samples;
       _lens_samples = other._lens_samples;
       _ray_bounces = other._ray_bounces;
+      _width = other._width;
+      _height = other._height;
       _bg_color = other._bg_color;
     }
 
     Scene &operator=(Scene &&other) {
       _mesh_instances = std::move(other._mesh_instances);
+      _primitives = std::move(other._primitives);
+      other._primitives.clear();
+      _bvh = std::move(other._bvh);
       _lights = std::move(other._lights);
+      _light_tree = std::move(other._light_tree);
       _raytree = std::move(other._raytree);
       _camera = other._camera;
       other._camera = NULL;
+      _view = other._view;
       _draw_kdtree = other._draw_kdtree;
       _shadow_samples = other._shadow_samples;
       _lens_samples = other._lens_samples;
       _ray_bounces = other._ray_bounces;
+      _width = other._width;
+      _height = other._height;
       _bg_color = other._bg_color;
       return *this;
     }
@@ -57,38 +73,113 @@ class Scene {
     unsigned ray_bounces() const { return _ray_bounces; }
 
     void set_shadow_samples(unsigned n) { _shadow_samples = n; }
+    // Set the number of primary rays trace_ray() averages, as used by
+    // visualize_raytree(). RayTracing takes its samples per pixel in passes of
+    // trace_rays() instead.
     void set_lens_samples(unsigned n) { _lens_samples = n; }
     void set_ray_bounces(unsigned n) { _ray_bounces = n; }
 
+    // Set the size in pixels of the image rays are traced for, which image
+    // positions are given in, and the aspect ratio of the camera to match.
+    void set_resolution(unsigned width, unsigned height) {
+      _width = width;
+      _height = height;
+      if (_camera) {
+        _camera->set_aspect(double(width) / height);
+      }
+      refresh_camera();
+    }
+
+    unsigned width() const { return _width; }
+    unsigned height() const { return _height; }
+
     Camera *camera() { return _camera; }
 
+    // Get the lens assembly of the camera, or NULL if it does not have one.
+    LensAssembly *lens_assembly() {
+      LensCamera *lens_camera = dynamic_cast<LensCamera*>(_camera);
+      return lens_camera ? lens_camera->lens_assembly() : NULL;
+    }
+
+    // Trace lens_samples() primary rays through the image position (x, y), and
+    // get the mean of their colors. Each sample draws its random numbers from
+    // the RNG stream for that sample of the pixel (x, y) falls in, so the color
+    // does not depend on what else is being traced, or where.
     glm::vec3 trace_ray(double x, double y, int bounces) const {
       return trace_ray(x, y, NULL, bounces);
     }
     glm::vec3 trace_ray(double x, double y, RayTreeNode *treenode, int bounces) const;
+
+    // Trace sample samples[i] of each of the `n` image positions (xs[i], ys[i])
+    // as a packet, where n is at most RAY_PACKET_SIZE, and write their colors to
+    // `colors`. Each color is exactly that sample's contribution to what
+    // trace_ray(xs[i], ys[i], bounces) averages. A position may appear more
+    // than once, with different samples.
+    void trace_rays(const double *xs, const double *ys, const unsigned *samples, unsigned n,
+        glm::vec3 *colors, int bounces) const;
+    // Trace the ray tree through the image position (x, y), against the BVH of
+    // the last refresh_bvh() and from the camera snapshot of the last
+    // refresh_camera().
     void visualize_raytree(double x, double y);
 
+    // Rebuild the top-level BVH if any mesh instance or primitive has moved
+    // since it was last built. Must not be called while rays are being traced.
+    void refresh_bvh() { _bvh.refresh(_mesh_instances, _primitives); }
+
+    // Take a new snapshot of the camera for primary rays to be cast from, after
+    // it has moved. Must not be called while rays are being traced.
+    void refresh_camera() {
+      if (_camera) {
+        _view = _camera->snapshot();
+      }
+    }
+
     void set_draw_kdtree(bool set) { _draw_kdtree = set; }
     void toggle_draw_kdtree() { _draw_kdtree = !_draw_kdtree; }
 
     void draw();
 
   private:
-    Scene() : _camera(NULL), _draw_kdtree(false), _shadow_samples(1), _lens_samples(1), _ray_bounces(1) {}
-    glm::vec3 trace_ray(const Ray &ray, RayTreeNode *treenode, int level, int type) const;
+    Scene() : _camera(NULL), _draw_kdtree(false), _shadow_samples(1), _lens_samples(1), _ray_bounces(1),
+      _width(1), _height(1) {}
+    glm::vec3 trace_ray(const Ray &ray, RayTreeNode *treenode, int level, int type, RNG &rng) const;
+
+    // Get the primary ray of the given sample of image position (x, y). Returns
+    // false if the camera blocks it.
+    bool primary_ray(double x, double y, unsigned sample, RNG &rng, Ray &ray) const;
+
+    // Get where on the screen, from 0 to 1 on each axis, the given sample of
+    // image position (x, y) goes through.
+    void film_position(double x, double y, unsigned sample, RNG &rng, double &u, double &v) const;
+
+    // Trace a packet of rays, where ray i draws its random numbers from rngs[i].
+    void trace_packet(RayPacket &packet, int level, glm::vec3 *colors, RNG *const *rngs) const;
+
+    // Compute the color of the surface hit by `rayhit` under direct light.
+    // Returns false if that is already the final color of the ray, as for rays
+    // that miss or hit a light, and true if reflections are still to be added.
+    bool shade(const RayHit &rayhit, RayTreeNode *treenode, glm::vec3 &color, RNG &rng) const;
+
+    bool intersect(RayHit &hit) const { return _bvh.intersect(hit); }
+    void intersect(RayPacket &packet) const { _bvh.intersect(packet); }
+    bool occluded(const Ray &ray, float t_max) const { return _bvh.occluded(ray, t_max); }
 
     std::vector<MeshInstance> _mesh_instances;
     std::vector<Primitive*> _primitives;
+    BVH _bvh;
     DebugViz _dbviz;
-    std::vector<size_t> _lights;
+    std::vector<AreaLight> _lights;
+    LightTree _light_tree;
     RayTree _raytree;
     Camera *_camera;
+    CameraSnapshot _view; // the camera as of the last refresh_camera()
     glm::vec3 _bg_color;
     bool _draw_kdtree;
 
     unsigned _shadow_samples;
     unsigned _lens_samples;
     unsigned _ray_bounces;
+    unsigned _width, _height;
 };
 
 #endif /* SCENE_H_ */
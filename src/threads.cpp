@@ -2,9 +2,22 @@
 
 #include <unordered_map>
 
+#include <cassert>
+#include <climits>
+
+#ifdef UNIX
+#include <unistd.h>
+#endif
+
 static thread_id _next_thread_id = 1;
 static std::unordered_map<thread_id, thread_t> _threads;
 
+// Guards _next_thread_id and _threads, which are used from several threads
+static mutex_t _threads_lock() {
+  static mutex_t lock = create_mutex();
+  return lock;
+}
+
 struct _thread_args {
   thread_func func;
   void *arg;
@@ -27,7 +40,6 @@ thread_id create_thread(thread_func func, void *arg) {
   argstruct->func = func;
   argstruct->arg = arg;
 
-  thread_id tid = _next_thread_id++;
   thread_t thread;
 
 # ifdef UNIX
@@ -36,18 +48,25 @@ thread_id create_thread(thread_func func, void *arg) {
   thread = CreateThread(NULL, 0, _thread_driver, (void*) argstruct, 0, NULL);
 # endif
 
+  lock_mutex(_threads_lock());
+  thread_id tid = _next_thread_id++;
   _threads.insert(std::make_pair(tid, thread));
+  unlock_mutex(_threads_lock());
 
   return tid;
 }
 
 void join_thread(thread_id tid) {
+  lock_mutex(_threads_lock());
   auto itr = _threads.find(tid);
   if (itr == _threads.end()) {
+    unlock_mutex(_threads_lock());
     return;
   }
 
   thread_t thread = itr->second;
+  _threads.erase(itr);
+  unlock_mutex(_threads_lock());
 
 # ifdef UNIX
   pthread_join(thread, NULL);
@@ -55,31 +74,18 @@ void join_thread(thread_id tid) {
   WaitForSingleObject(thread, INFINITE);
   CloseHandle(thread);
 # endif
-
-  _threads.erase(itr);
-}
-
-void join_all_threads() {
-  for (auto itr = _threads.begin(); itr != _threads.end(); ++itr) {
-#   ifdef UNIX
-    pthread_join(itr->second, NULL);
-#   else
-    WaitForSingleObject(itr->second, INFINITE);
-    CloseHandle(itr->second);
-#   endif
-  }
-
-  _threads.clear();
-  _next_thread_id = 1;
 }
 
 bool try_join_thread(thread_id tid) {
+  lock_mutex(_threads_lock());
   auto itr = _threads.find(tid);
   if (itr == _threads.end()) {
+    unlock_mutex(_threads_lock());
     return true;
   }
 
   thread_t thread = itr->second;
+  unlock_mutex(_threads_lock());
 
 # ifdef UNIX
   return pthread_tryjoin_np(thread, NULL) == 0;
@@ -125,3 +131,196 @@ void destroy_mutex(mutex_t mutex) {
   CloseHandle(mutex);
 # endif
 }
+
+#ifdef UNIX
+struct _semaphore {
+  pthread_mutex_t lock;
+  pthread_cond_t posted;
+  unsigned count;
+};
+#endif
+
+semaphore_t create_semaphore(unsigned count) {
+  semaphore_t sem;
+
+# ifdef UNIX
+  sem = new _semaphore;
+  pthread_mutex_init(&sem->lock, NULL);
+  pthread_cond_init(&sem->posted, NULL);
+  sem->count = count;
+# else
+  sem = CreateSemaphoreA(NULL, count, LONG_MAX, NULL);
+# endif
+
+  return sem;
+}
+
+bool wait_semaphore(semaphore_t sem) {
+# ifdef UNIX
+  if (pthread_mutex_lock(&sem->lock) != 0) {
+    return false;
+  }
+  // Wakeups may be spurious
+  while (sem->count == 0) {
+    pthread_cond_wait(&sem->posted, &sem->lock);
+  }
+  sem->count--;
+  return pthread_mutex_unlock(&sem->lock) == 0;
+# else
+  return WaitForSingleObject(sem, INFINITE) != WAIT_FAILED;
+# endif
+}
+
+bool post_semaphore(semaphore_t sem) {
+# ifdef UNIX
+  if (pthread_mutex_lock(&sem->lock) != 0) {
+    return false;
+  }
+  sem->count++;
+  pthread_cond_signal(&sem->posted);
+  return pthread_mutex_unlock(&sem->lock) == 0;
+# else
+  return ReleaseSemaphore(sem, 1, NULL);
+# endif
+}
+
+void destroy_semaphore(semaphore_t sem) {
+# ifdef UNIX
+  pthread_cond_destroy(&sem->posted);
+  pthread_mutex_destroy(&sem->lock);
+  delete sem;
+# else
+  CloseHandle(sem);
+# endif
+}
+
+unsigned hardware_threads() {
+# ifdef UNIX
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+# else
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  long n = info.dwNumberOfProcessors;
+# endif
+
+  return n > 0 ? n : PROCESSOR_COUNT;
+}
+
+ThreadPool::ThreadPool(unsigned workers) :
+  _lock(create_mutex()), _available(create_semaphore(0)), _stopping(false)
+{
+  for (unsigned i = 0; i < workers; ++i) {
+    _workers.push_back(create_thread(worker, (void*) this));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  lock_mutex(_lock);
+  assert(_tasks.empty());
+  _stopping = true;
+  unlock_mutex(_lock);
+
+  for (unsigned i = 0; i < _workers.size(); ++i) {
+    post_semaphore(_available);
+  }
+  for (unsigned i = 0; i < _workers.size(); ++i) {
+    join_thread(_workers[i]);
+  }
+
+  destroy_semaphore(_available);
+  destroy_mutex(_lock);
+}
+
+void ThreadPool::submit(thread_func func, void *arg, TaskGroup &group) {
+  lock_mutex(_lock);
+  _tasks.push_back(task { func, arg, &group });
+  group._pending++;
+  unlock_mutex(_lock);
+
+  post_semaphore(_available);
+}
+
+bool ThreadPool::run_one(TaskGroup *group) {
+  lock_mutex(_lock);
+  std::deque<task>::iterator itr = _tasks.begin();
+  while (itr != _tasks.end() && group && itr->group != group) {
+    ++itr;
+  }
+  if (itr == _tasks.end()) {
+    unlock_mutex(_lock);
+    return false;
+  }
+  task t = *itr;
+  _tasks.erase(itr);
+  unlock_mutex(_lock);
+
+  t.func(t.arg);
+
+  lock_mutex(_lock);
+  bool wake = --t.group->_pending == 0 && t.group->_waiting;
+  if (wake) {
+    t.group->_waiting = false;
+  }
+  unlock_mutex(_lock);
+
+  if (wake) {
+    post_semaphore(t.group->_done);
+  }
+  return true;
+}
+
+void ThreadPool::wait(TaskGroup &group) {
+  while (1) {
+    lock_mutex(_lock);
+    if (group._pending == 0) {
+      unlock_mutex(_lock);
+      return;
+    }
+    unlock_mutex(_lock);
+
+    // Help with the group's queued tasks rather than sit idle. Tasks of other
+    // groups are left alone, since they may take arbitrarily long or wait on
+    // this thread's caller.
+    if (run_one(&group)) {
+      continue;
+    }
+
+    // None of the group's tasks are queued, so the rest are all running
+    // elsewhere, and the last of them to finish wakes this thread
+    lock_mutex(_lock);
+    bool sleep = group._pending > 0;
+    if (sleep) {
+      group._waiting = true;
+    }
+    unlock_mutex(_lock);
+
+    if (sleep) {
+      wait_semaphore(group._done);
+    }
+  }
+}
+
+void ThreadPool::worker(void *pool) {
+  ThreadPool *tp = (ThreadPool*) pool;
+  while (1) {
+    wait_semaphore(tp->_available);
+
+    // Threads in wait() also take tasks, so the queue may be empty even though
+    // the semaphore was posted for it
+    if (tp->run_one(NULL)) {
+      continue;
+    }
+
+    lock_mutex(tp->_lock);
+    bool stopping = tp->_stopping;
+    unlock_mutex(tp->_lock);
+    if (stopping) {
+      return;
+    }
+  }
+}
+
+ThreadPool &thread_pool() {
+  static ThreadPool pool(hardware_threads());
+  return pool;
+}
@@ -1,16 +1,24 @@
 #ifndef THREADS_H_
 #define THREADS_H_
 
+#include <deque>
+#include <vector>
+
 #include <cstdint>
 
 #if defined UNIX
 #include <pthread.h>
+// Unnamed POSIX semaphores are missing on some systems (OS X), so semaphores
+// are built from a mutex and a condition variable
+struct _semaphore;
 typedef pthread_t thread_t;
 typedef pthread_mutex_t* mutex_t;
+typedef _semaphore* semaphore_t;
 #elif defined WINDOWS
 #include <Windows.h>
 typedef HANDLE thread_t;
 typedef HANDLE mutex_t;
+typedef HANDLE semaphore_t;
 #else
 #error "Threads API unsupported on this system"
 #endif
@@ -20,7 +28,6 @@ typedef uint32_t thread_id;
 
 thread_id create_thread(thread_func func, void *arg);
 void join_thread(thread_id thread);
-void join_all_threads();
 bool try_join_thread(thread_id thread);
 
 mutex_t create_mutex();
@@ -28,4 +35,77 @@ bool lock_mutex(mutex_t mutex);
 bool unlock_mutex(mutex_t mutex);
 void destroy_mutex(mutex_t mutex);
 
+semaphore_t create_semaphore(unsigned count);
+bool wait_semaphore(semaphore_t sem);
+bool post_semaphore(semaphore_t sem);
+void destroy_semaphore(semaphore_t sem);
+
+// Get the number of processors available, as detected at runtime. Falls back
+// to the build machine's PROCESSOR_COUNT if detection fails.
+unsigned hardware_threads();
+
+// A set of long-lived worker threads running tasks from a shared queue, in the
+// order they were submitted.
+class ThreadPool {
+  public:
+    // A set of tasks that can be waited on together.
+    class TaskGroup {
+      public:
+        TaskGroup() : _pending(0), _waiting(false), _done(create_semaphore(0)) {}
+        ~TaskGroup() { destroy_semaphore(_done); }
+
+        TaskGroup(const TaskGroup&) = delete;
+        TaskGroup &operator=(const TaskGroup&) = delete;
+
+      private:
+        unsigned _pending; // tasks submitted but not yet finished
+        bool _waiting;     // a thread is blocked on _done
+        semaphore_t _done;
+
+        friend class ThreadPool;
+    };
+
+    // Start the given number of worker threads.
+    explicit ThreadPool(unsigned workers);
+
+    // Stop the workers. All submitted tasks must have been waited on.
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool &operator=(const ThreadPool&) = delete;
+
+    unsigned size() const { return _workers.size(); }
+
+    // Queue `func(arg)` to be run on a worker as part of `group`.
+    void submit(thread_func func, void *arg, TaskGroup &group);
+
+    // Wait for every task of `group` to finish. While any tasks of the group are
+    // queued, the calling thread runs them itself, so tasks may wait on tasks
+    // they submit.
+    void wait(TaskGroup &group);
+
+  private:
+    struct task {
+      thread_func func;
+      void *arg;
+      TaskGroup *group;
+    };
+
+    // Run the first queued task of `group`, or of any group if it is NULL.
+    // Returns false if there was no such task.
+    bool run_one(TaskGroup *group);
+
+    static void worker(void *pool);
+
+    std::vector<thread_id> _workers;
+    std::deque<task> _tasks;
+    mutex_t _lock;
+    semaphore_t _available; // posted once per task submitted, and once per worker to stop
+    bool _stopping;
+};
+
+// Get the thread pool shared by rendering, KDTree construction, and mesh
+// loading. It is started on first use, with one worker per processor.
+ThreadPool &thread_pool();
+
 #endif /* THREADS_H_ */
@@ -0,0 +1,185 @@
+#include "tile_scheduler.h"
+
+#include <algorithm>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <cassert>
+
+// Room left in each deque for parts of tiles given back
+#define TILE_DEQUE_SLACK 64
+
+// Spread the low 16 bits of `v` out to the even bits of the result.
+static uint32_t part_by_1(uint32_t v) {
+  v &= 0xffff;
+  v = (v | (v << 8)) & 0x00ff00ff;
+  v = (v | (v << 4)) & 0x0f0f0f0f;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
+
+// Position of the tile at (x, y) along the Z-order curve.
+static uint32_t morton_code(uint32_t x, uint32_t y) {
+  return part_by_1(x) | (part_by_1(y) << 1);
+}
+
+static uint64_t pack_tile(const Tile &tile) {
+  assert(tile.x < 0x10000 && tile.y < 0x10000 && tile.w < 0x10000 && tile.h < 0x10000);
+  return uint64_t(tile.x) | (uint64_t(tile.y) << 16)
+    | (uint64_t(tile.w) << 32) | (uint64_t(tile.h) << 48);
+}
+
+static Tile unpack_tile(uint64_t packed) {
+  Tile tile;
+  tile.x = packed & 0xffff;
+  tile.y = (packed >> 16) & 0xffff;
+  tile.w = (packed >> 32) & 0xffff;
+  tile.h = (packed >> 48) & 0xffff;
+  return tile;
+}
+
+bool TileScheduler::work_deque::push(uint64_t tile) {
+  int64_t b = bottom.load();
+  int64_t t = top.load();
+  if (b - t > mask) {
+    return false;
+  }
+
+  tiles[b & mask].store(tile);
+  bottom.store(b + 1);
+  return true;
+}
+
+bool TileScheduler::work_deque::pop(uint64_t &tile) {
+  int64_t b = bottom.load() - 1;
+  bottom.store(b);
+  int64_t t = top.load();
+
+  if (t > b) {
+    bottom.store(b + 1);
+    return false;
+  }
+
+  tile = tiles[b & mask].load();
+  if (t == b) {
+    // The last tile: a thief may be taking it at the same time
+    bool won = top.compare_exchange_strong(t, t + 1);
+    bottom.store(b + 1);
+    return won;
+  }
+
+  return true;
+}
+
+bool TileScheduler::work_deque::steal(uint64_t &tile) {
+  int64_t t = top.load();
+  int64_t b = bottom.load();
+  if (t >= b) {
+    return false;
+  }
+
+  tile = tiles[t & mask].load();
+  return top.compare_exchange_strong(t, t + 1);
+}
+
+void TileScheduler::reset(unsigned width, unsigned height, unsigned workers) {
+  assert(workers > 0);
+
+  unsigned tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+  unsigned tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+  std::vector<std::pair<uint32_t, uint32_t>> order; // Morton code, tile index
+  for (unsigned ty = 0; ty < tiles_y; ++ty) {
+    for (unsigned tx = 0; tx < tiles_x; ++tx) {
+      order.push_back(std::make_pair(morton_code(tx, ty), ty * tiles_x + tx));
+    }
+  }
+  std::sort(order.begin(), order.end());
+
+  delete[] _deques;
+  _deques = new work_deque[workers];
+  _workers = workers;
+
+  for (unsigned w = 0; w < workers; ++w) {
+    size_t begin = order.size() * w / workers;
+    size_t end = order.size() * (w + 1) / workers;
+
+    size_t capacity = 1;
+    while (capacity < end - begin + TILE_DEQUE_SLACK) {
+      capacity *= 2;
+    }
+
+    work_deque &d = _deques[w];
+    d.tiles = new std::atomic<uint64_t>[capacity];
+    d.mask = capacity - 1;
+
+    // Push the run backwards, so the owner takes it in Z-order and thieves
+    // take from the far end
+    for (size_t i = end; i > begin; --i) {
+      unsigned tx = order[i - 1].second % tiles_x;
+      unsigned ty = order[i - 1].second / tiles_x;
+
+      Tile tile;
+      tile.x = tx * TILE_SIZE;
+      tile.y = ty * TILE_SIZE;
+      tile.w = std::min((unsigned) TILE_SIZE, width - tile.x);
+      tile.h = std::min((unsigned) TILE_SIZE, height - tile.y);
+      d.push(pack_tile(tile));
+    }
+  }
+
+  _active.store(workers);
+  _hungry.store(0);
+  _cancelled.store(false);
+}
+
+bool TileScheduler::next(unsigned worker, Tile &tile) {
+  assert(worker < _workers);
+
+  if (_cancelled.load()) {
+    return false;
+  }
+
+  uint64_t packed;
+  if (_deques[worker].pop(packed)) {
+    tile = unpack_tile(packed);
+    return true;
+  }
+
+  _active--;
+  _hungry++;
+
+  bool found = false;
+  while (!found && !_cancelled.load()) {
+    // Only active workers give tiles back, and an inactive worker's deque is
+    // empty; so once none are active, there is nothing left to steal.
+    bool done = _active.load() == 0;
+
+    for (unsigned i = 1; i < _workers && !found; ++i) {
+      found = _deques[(worker + i) % _workers].steal(packed);
+    }
+
+    if (done) {
+      break;
+    }
+    if (!found) {
+      std::this_thread::yield();
+    }
+  }
+
+  _hungry--;
+  if (!found) {
+    return false;
+  }
+
+  _active++;
+  tile = unpack_tile(packed);
+  return true;
+}
+
+bool TileScheduler::give_back(unsigned worker, const Tile &tile) {
+  assert(worker < _workers);
+  return _deques[worker].push(pack_tile(tile));
+}
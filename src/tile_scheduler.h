@@ -0,0 +1,82 @@
+// Distribution of the tiles of an image among the workers rendering it.
+#ifndef TILE_SCHEDULER_H_
+#define TILE_SCHEDULER_H_
+
+#include <atomic>
+
+#include <cstddef>
+#include <cstdint>
+
+// Width and height of the tiles an image is first cut into, in pixels.
+#define TILE_SIZE 32
+
+// A rectangle of pixels handed out to a worker.
+struct Tile {
+  unsigned x, y; // top left pixel
+  unsigned w, h;
+};
+
+// A work-stealing tile scheduler. The tiles of the image are ordered along a
+// Z-order (Morton) curve, and each worker starts with a contiguous run of them
+// in its own deque. A worker takes tiles from the front of its run, and once it
+// runs out, steals from the back of another worker's. While any worker is out
+// of work, others hand back the unrendered part of the tile they are on.
+//
+// The deques are lock-free: taking a tile from one's own deque costs a few
+// uncontended atomic operations, and only the last tile of a deque is ever
+// fought over.
+class TileScheduler {
+  public:
+    TileScheduler() : _deques(NULL), _workers(0), _active(0), _hungry(0), _cancelled(false) {}
+    ~TileScheduler() { delete[] _deques; }
+
+    TileScheduler(const TileScheduler&) = delete;
+    TileScheduler &operator=(const TileScheduler&) = delete;
+
+    // Cut an image into tiles and deal them out to `workers` workers. Must not
+    // be called while workers are taking tiles.
+    void reset(unsigned width, unsigned height, unsigned workers);
+
+    // Get the next tile for the given worker, from its own deque or by stealing.
+    // Returns false once every tile has been handed out and no worker can give
+    // any more back, or the scheduler is cancelled.
+    bool next(unsigned worker, Tile &tile);
+
+    // Check whether any worker is waiting for a tile.
+    bool hungry() const { return _hungry.load() > 0; }
+
+    // Give back part of the tile the given worker is on, for a hungry worker to
+    // take. Returns false if the worker's deque is full, in which case the
+    // worker must render the tile itself.
+    bool give_back(unsigned worker, const Tile &tile);
+
+    // Make every call to next() return false from now on.
+    void cancel() { _cancelled.store(true); }
+
+  private:
+    // A fixed-capacity Chase-Lev deque of packed tiles. The owner pushes and
+    // pops at the bottom, thieves take from the top.
+    struct work_deque {
+      work_deque() : top(0), bottom(0), tiles(NULL), mask(0) {}
+      ~work_deque() { delete[] tiles; }
+
+      std::atomic<int64_t> top;
+      char pad[64]; // keep thieves' and the owner's counters on separate cache lines
+      std::atomic<int64_t> bottom;
+      std::atomic<uint64_t> *tiles;
+      int64_t mask; // capacity - 1, where capacity is a power of two
+
+      bool push(uint64_t tile);
+      bool pop(uint64_t &tile);
+      bool steal(uint64_t &tile);
+    };
+
+    work_deque *_deques;
+    unsigned _workers;
+
+    std::atomic<unsigned> _active; // workers not waiting in next()
+    std::atomic<unsigned> _hungry; // workers trying to steal
+    std::atomic<bool> _cancelled;
+};
+
+#endif /* TILE_SCHEDULER_H_ */
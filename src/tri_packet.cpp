@@ -0,0 +1,411 @@
+#include "tri_packet.h"
+
+#include <cmath>
+
+#include "mesh.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define TRI_PACKET_SSE
+#include <xmmintrin.h>
+
+#if defined(__GNUC__) || defined(_MSC_VER)
+#define TRI_PACKET_AVX
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+#endif
+
+// The AVX kernel is compiled for AVX regardless of the flags the rest of the
+// program is built with, and only run if the CPU supports it.
+#ifdef __GNUC__
+#define TARGET_AVX __attribute__((target("avx")))
+#else
+#define TARGET_AVX
+#endif
+
+void TriPacket::set(unsigned lane, const Triangle &tri, uint32_t id) {
+  assert(lane < TRI_PACKET_WIDTH);
+  ax[lane] = tri.a.x;
+  ay[lane] = tri.a.y;
+  az[lane] = tri.a.z;
+  e1x[lane] = tri.e1.x;
+  e1y[lane] = tri.e1.y;
+  e1z[lane] = tri.e1.z;
+  e2x[lane] = tri.e2.x;
+  e2y[lane] = tri.e2.y;
+  e2z[lane] = tri.e2.z;
+  face[lane] = id;
+}
+
+void TriPacket::clear(unsigned lane) {
+  assert(lane < TRI_PACKET_WIDTH);
+  ax[lane] = ay[lane] = az[lane] = 0.0f;
+  e1x[lane] = e1y[lane] = e1z[lane] = 0.0f;
+  e2x[lane] = e2y[lane] = e2z[lane] = 0.0f;
+  face[lane] = 0;
+}
+
+// Take the hits in the lanes set in `lanes` that are closer than `hit.t`, in lane
+// order. All kernels report hits through here, so they break ties the same way.
+static inline bool take_closest(const TriPacket *packets, unsigned lanes, unsigned width,
+    const float *t, const float *beta, const float *gamma, TriangleHit &hit)
+{
+  bool updated = false;
+  for (unsigned i = 0; i < width; ++i) {
+    if ((lanes & (1u << i)) && t[i] < hit.t) {
+      const TriPacket &pk = packets[i / TRI_PACKET_WIDTH];
+      hit = TriangleHit { t[i], pk.face[i % TRI_PACKET_WIDTH], beta[i], gamma[i] };
+      updated = true;
+    }
+  }
+  return updated;
+}
+
+// Moller-Trumbore test of one lane of a packet. The operations are the same, and
+// in the same order, as those of the vector kernels, so that the results are
+// identical.
+static inline bool intersect_lane(const TriPacket &pk, unsigned i,
+    const glm::vec3 &o, const glm::vec3 &d, float t_max,
+    float &t, float &beta, float &gamma)
+{
+  float px = d.y*pk.e2z[i] - pk.e2y[i]*d.z;
+  float py = d.z*pk.e2x[i] - pk.e2z[i]*d.x;
+  float pz = d.x*pk.e2y[i] - pk.e2x[i]*d.y;
+  float det = (pk.e1x[i]*px + pk.e1y[i]*py) + pk.e1z[i]*pz;
+  float inv_det = 1.0f / det;
+
+  float sx = o.x - pk.ax[i];
+  float sy = o.y - pk.ay[i];
+  float sz = o.z - pk.az[i];
+  beta = ((sx*px + sy*py) + sz*pz) * inv_det;
+
+  float qx = sy*pk.e1z[i] - pk.e1y[i]*sz;
+  float qy = sz*pk.e1x[i] - pk.e1z[i]*sx;
+  float qz = sx*pk.e1y[i] - pk.e1x[i]*sy;
+  gamma = ((d.x*qx + d.y*qy) + d.z*qz) * inv_det;
+  t = ((pk.e2x[i]*qx + pk.e2y[i]*qy) + pk.e2z[i]*qz) * inv_det;
+
+  return det != 0.0f && beta >= 0.0f && beta <= 1.0f
+    && gamma >= 0.0f && beta + gamma <= 1.0f && t >= 0.0f && t < t_max;
+}
+
+static bool intersect_scalar(const TriPacket *packets, unsigned count,
+    const glm::vec3 &origin, const glm::vec3 &dir, TriangleHit &hit)
+{
+  bool updated = false;
+  for (unsigned p = 0; p < count; ++p) {
+    float t[TRI_PACKET_WIDTH], beta[TRI_PACKET_WIDTH], gamma[TRI_PACKET_WIDTH];
+    unsigned lanes = 0;
+    for (unsigned i = 0; i < TRI_PACKET_WIDTH; ++i) {
+      if (intersect_lane(packets[p], i, origin, dir, hit.t, t[i], beta[i], gamma[i])) {
+        lanes |= 1u << i;
+      }
+    }
+    if (lanes) {
+      updated |= take_closest(&packets[p], lanes, TRI_PACKET_WIDTH, t, beta, gamma, hit);
+    }
+  }
+  return updated;
+}
+
+static bool occlude_scalar(const TriPacket *packets, unsigned count,
+    const glm::vec3 &origin, const glm::vec3 &dir, float t_max)
+{
+  for (unsigned p = 0; p < count; ++p) {
+    for (unsigned i = 0; i < TRI_PACKET_WIDTH; ++i) {
+      float t, beta, gamma;
+      if (intersect_lane(packets[p], i, origin, dir, t_max, t, beta, gamma)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+#ifdef TRI_PACKET_SSE
+// Test the four lanes of a packet, returning a bit mask of the lanes hit at a
+// distance less than t_max.
+static inline unsigned intersect_packet_sse(const TriPacket &pk,
+    const __m128 o[3], const __m128 d[3], float t_max,
+    float *t_out, float *beta_out, float *gamma_out)
+{
+  __m128 zero = _mm_setzero_ps();
+  __m128 one = _mm_set1_ps(1.0f);
+
+  __m128 e1x = _mm_loadu_ps(pk.e1x), e1y = _mm_loadu_ps(pk.e1y), e1z = _mm_loadu_ps(pk.e1z);
+  __m128 e2x = _mm_loadu_ps(pk.e2x), e2y = _mm_loadu_ps(pk.e2y), e2z = _mm_loadu_ps(pk.e2z);
+
+  __m128 px = _mm_sub_ps(_mm_mul_ps(d[1], e2z), _mm_mul_ps(e2y, d[2]));
+  __m128 py = _mm_sub_ps(_mm_mul_ps(d[2], e2x), _mm_mul_ps(e2z, d[0]));
+  __m128 pz = _mm_sub_ps(_mm_mul_ps(d[0], e2y), _mm_mul_ps(e2x, d[1]));
+  __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+  __m128 inv_det = _mm_div_ps(one, det);
+
+  __m128 sx = _mm_sub_ps(o[0], _mm_loadu_ps(pk.ax));
+  __m128 sy = _mm_sub_ps(o[1], _mm_loadu_ps(pk.ay));
+  __m128 sz = _mm_sub_ps(o[2], _mm_loadu_ps(pk.az));
+  __m128 beta = _mm_mul_ps(
+      _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv_det);
+
+  __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(e1y, sz));
+  __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(e1z, sx));
+  __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(e1x, sy));
+  __m128 gamma = _mm_mul_ps(
+      _mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], qx), _mm_mul_ps(d[1], qy)), _mm_mul_ps(d[2], qz)), inv_det);
+  __m128 t = _mm_mul_ps(
+      _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+  __m128 mask = _mm_cmpneq_ps(det, zero);
+  mask = _mm_and_ps(mask, _mm_cmpge_ps(beta, zero));
+  mask = _mm_and_ps(mask, _mm_cmple_ps(beta, one));
+  mask = _mm_and_ps(mask, _mm_cmpge_ps(gamma, zero));
+  mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(beta, gamma), one));
+  mask = _mm_and_ps(mask, _mm_cmpge_ps(t, zero));
+  mask = _mm_and_ps(mask, _mm_cmplt_ps(t, _mm_set1_ps(t_max)));
+
+  unsigned lanes = _mm_movemask_ps(mask);
+  if (lanes && t_out) {
+    _mm_storeu_ps(t_out, t);
+    _mm_storeu_ps(beta_out, beta);
+    _mm_storeu_ps(gamma_out, gamma);
+  }
+  return lanes;
+}
+
+static bool intersect_sse(const TriPacket *packets, unsigned count,
+    const glm::vec3 &origin, const glm::vec3 &dir, TriangleHit &hit)
+{
+  __m128 o[3] = { _mm_set1_ps(origin.x), _mm_set1_ps(origin.y), _mm_set1_ps(origin.z) };
+  __m128 d[3] = { _mm_set1_ps(dir.x), _mm_set1_ps(dir.y), _mm_set1_ps(dir.z) };
+
+  bool updated = false;
+  for (unsigned p = 0; p < count; ++p) {
+    float t[4], beta[4], gamma[4];
+    unsigned lanes = intersect_packet_sse(packets[p], o, d, hit.t, t, beta, gamma);
+    if (lanes) {
+      updated |= take_closest(&packets[p], lanes, 4, t, beta, gamma, hit);
+    }
+  }
+  return updated;
+}
+
+static bool occlude_sse(const TriPacket *packets, unsigned count,
+    const glm::vec3 &origin, const glm::vec3 &dir, float t_max)
+{
+  __m128 o[3] = { _mm_set1_ps(origin.x), _mm_set1_ps(origin.y), _mm_set1_ps(origin.z) };
+  __m128 d[3] = { _mm_set1_ps(dir.x), _mm_set1_ps(dir.y), _mm_set1_ps(dir.z) };
+
+  for (unsigned p = 0; p < count; ++p) {
+    if (intersect_packet_sse(packets[p], o, d, t_max, NULL, NULL, NULL)) {
+      return true;
+    }
+  }
+  return false;
+}
+#endif /* TRI_PACKET_SSE */
+
+#ifdef TRI_PACKET_AVX
+// Load the same field of two consecutive packets into one register.
+TARGET_AVX static inline __m256 load_pair(const float *lo, const float *hi) {
+  return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(lo)), _mm_loadu_ps(hi), 1);
+}
+
+// Test the eight lanes of two consecutive packets, returning a bit mask of the
+// lanes hit at a distance less than t_max.
+TARGET_AVX static inline unsigned intersect_pair_avx(const TriPacket *pk,
+    const __m256 o[3], const __m256 d[3], float t_max,
+    float *t_out, float *beta_out, float *gamma_out)
+{
+  __m256 zero = _mm256_setzero_ps();
+  __m256 one = _mm256_set1_ps(1.0f);
+
+  __m256 e1x = load_pair(pk[0].e1x, pk[1].e1x);
+  __m256 e1y = load_pair(pk[0].e1y, pk[1].e1y);
+  __m256 e1z = load_pair(pk[0].e1z, pk[1].e1z);
+  __m256 e2x = load_pair(pk[0].e2x, pk[1].e2x);
+  __m256 e2y = load_pair(pk[0].e2y, pk[1].e2y);
+  __m256 e2z = load_pair(pk[0].e2z, pk[1].e2z);
+
+  __m256 px = _mm256_sub_ps(_mm256_mul_ps(d[1], e2z), _mm256_mul_ps(e2y, d[2]));
+  __m256 py = _mm256_sub_ps(_mm256_mul_ps(d[2], e2x), _mm256_mul_ps(e2z, d[0]));
+  __m256 pz = _mm256_sub_ps(_mm256_mul_ps(d[0], e2y), _mm256_mul_ps(e2x, d[1]));
+  __m256 det = _mm256_add_ps(
+      _mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+  __m256 inv_det = _mm256_div_ps(one, det);
+
+  __m256 sx = _mm256_sub_ps(o[0], load_pair(pk[0].ax, pk[1].ax));
+  __m256 sy = _mm256_sub_ps(o[1], load_pair(pk[0].ay, pk[1].ay));
+  __m256 sz = _mm256_sub_ps(o[2], load_pair(pk[0].az, pk[1].az));
+  __m256 beta = _mm256_mul_ps(_mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), inv_det);
+
+  __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(e1y, sz));
+  __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(e1z, sx));
+  __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(e1x, sy));
+  __m256 gamma = _mm256_mul_ps(_mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(d[0], qx), _mm256_mul_ps(d[1], qy)), _mm256_mul_ps(d[2], qz)), inv_det);
+  __m256 t = _mm256_mul_ps(_mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv_det);
+
+  __m256 mask = _mm256_cmp_ps(det, zero, _CMP_NEQ_UQ);
+  mask = _mm256_and_ps(mask, _mm256_cmp_ps(beta, zero, _CMP_GE_OQ));
+  mask = _mm256_and_ps(mask, _mm256_cmp_ps(beta, one, _CMP_LE_OQ));
+  mask = _mm256_and_ps(mask, _mm256_cmp_ps(gamma, zero, _CMP_GE_OQ));
+  mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(beta, gamma), one, _CMP_LE_OQ));
+  mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+  mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, _mm256_set1_ps(t_max), _CMP_LT_OQ));
+
+  unsigned lanes = _mm256_movemask_ps(mask);
+  if (lanes && t_out) {
+    _mm256_storeu_ps(t_out, t);
+    _mm256_storeu_ps(beta_out, beta);
+    _mm256_storeu_ps(gamma_out, gamma);
+  }
+  return lanes;
+}
+
+TARGET_AVX static bool intersect_avx(const TriPacket *packets, unsigned count,
+    const glm::vec3 &origin, const glm::vec3 &dir, TriangleHit &hit)
+{
+  __m256 o[3] = { _mm256_set1_ps(origin.x), _mm256_set1_ps(origin.y), _mm256_set1_ps(origin.z) };
+  __m256 d[3] = { _mm256_set1_ps(dir.x), _mm256_set1_ps(dir.y), _mm256_set1_ps(dir.z) };
+
+  bool updated = false;
+  unsigned p = 0;
+  for (; p + 1 < count; p += 2) {
+    float t[8], beta[8], gamma[8];
+    unsigned lanes = intersect_pair_avx(&packets[p], o, d, hit.t, t, beta, gamma);
+    if (lanes) {
+      updated |= take_closest(&packets[p], lanes, 8, t, beta, gamma, hit);
+    }
+  }
+
+  // An odd packet left over goes through the SSE kernel
+  if (p < count) {
+    updated |= intersect_sse(&packets[p], 1, origin, dir, hit);
+  }
+
+  return updated;
+}
+
+TARGET_AVX static bool occlude_avx(const TriPacket *packets, unsigned count,
+    const glm::vec3 &origin, const glm::vec3 &dir, float t_max)
+{
+  __m256 o[3] = { _mm256_set1_ps(origin.x), _mm256_set1_ps(origin.y), _mm256_set1_ps(origin.z) };
+  __m256 d[3] = { _mm256_set1_ps(dir.x), _mm256_set1_ps(dir.y), _mm256_set1_ps(dir.z) };
+
+  unsigned p = 0;
+  for (; p + 1 < count; p += 2) {
+    if (intersect_pair_avx(&packets[p], o, d, t_max, NULL, NULL, NULL)) {
+      return true;
+    }
+  }
+
+  return p < count && occlude_sse(&packets[p], 1, origin, dir, t_max);
+}
+
+static bool cpu_has_avx() {
+#ifdef __GNUC__
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx");
+#else
+  int info[4];
+  __cpuid(info, 1);
+  bool osxsave = (info[2] & (1 << 27)) != 0;
+  bool avx = (info[2] & (1 << 28)) != 0;
+  return osxsave && avx && (_xgetbv(0) & 6) == 6;
+#endif
+}
+#endif /* TRI_PACKET_AVX */
+
+static bool kernel_supported(int kernel) {
+  switch (kernel) {
+    case TRI_KERNEL_SCALAR:
+      return true;
+
+#ifdef TRI_PACKET_SSE
+    case TRI_KERNEL_SSE:
+      return true;
+#endif
+
+#ifdef TRI_PACKET_AVX
+    case TRI_KERNEL_AVX:
+      return cpu_has_avx();
+#endif
+
+    default:
+      return false;
+  }
+}
+
+static int best_kernel() {
+  int kernel = TRI_KERNEL_AVX;
+  while (!kernel_supported(kernel)) {
+    --kernel;
+  }
+  return kernel;
+}
+
+static int active_kernel = best_kernel();
+
+bool intersect_tri_packets(const TriPacket *packets, unsigned count,
+    const glm::vec3 &origin, const glm::vec3 &dir, TriangleHit &hit)
+{
+  switch (active_kernel) {
+#ifdef TRI_PACKET_AVX
+    case TRI_KERNEL_AVX:
+      return intersect_avx(packets, count, origin, dir, hit);
+#endif
+#ifdef TRI_PACKET_SSE
+    case TRI_KERNEL_SSE:
+      return intersect_sse(packets, count, origin, dir, hit);
+#endif
+    default:
+      return intersect_scalar(packets, count, origin, dir, hit);
+  }
+}
+
+bool tri_packets_occlude(const TriPacket *packets, unsigned count,
+    const glm::vec3 &origin, const glm::vec3 &dir, float t_max)
+{
+  switch (active_kernel) {
+#ifdef TRI_PACKET_AVX
+    case TRI_KERNEL_AVX:
+      return occlude_avx(packets, count, origin, dir, t_max);
+#endif
+#ifdef TRI_PACKET_SSE
+    case TRI_KERNEL_SSE:
+      return occlude_sse(packets, count, origin, dir, t_max);
+#endif
+    default:
+      return occlude_scalar(packets, count, origin, dir, t_max);
+  }
+}
+
+int tri_kernel() {
+  return active_kernel;
+}
+
+bool set_tri_kernel(int kernel) {
+  if (!kernel_supported(kernel)) {
+    return false;
+  }
+
+  active_kernel = kernel;
+  return true;
+}
+
+const char *tri_kernel_name(int kernel) {
+  switch (kernel) {
+    case TRI_KERNEL_SCALAR:
+      return "scalar";
+    case TRI_KERNEL_SSE:
+      return "sse";
+    case TRI_KERNEL_AVX:
+      return "avx";
+    default:
+      return "unknown";
+  }
+}
@@ -0,0 +1,59 @@
+// Triangles packed for intersecting one ray with several of them at once.
+#ifndef TRI_PACKET_H_
+#define TRI_PACKET_H_
+
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+struct Triangle;
+struct TriangleHit;
+
+// Number of triangles in a TriPacket.
+#define TRI_PACKET_WIDTH 4
+
+// Implementations of the packet intersection functions.
+#define TRI_KERNEL_SCALAR 0 // one lane at a time; always available
+#define TRI_KERNEL_SSE    1 // one packet per instruction
+#define TRI_KERNEL_AVX    2 // two packets per instruction
+
+// Up to TRI_PACKET_WIDTH triangles of a Mesh in structure-of-arrays layout, as
+// stored in KDTree leaves. Unused lanes hold degenerate triangles, which are
+// never hit.
+struct TriPacket {
+  float ax[TRI_PACKET_WIDTH], ay[TRI_PACKET_WIDTH], az[TRI_PACKET_WIDTH];
+  float e1x[TRI_PACKET_WIDTH], e1y[TRI_PACKET_WIDTH], e1z[TRI_PACKET_WIDTH];
+  float e2x[TRI_PACKET_WIDTH], e2y[TRI_PACKET_WIDTH], e2z[TRI_PACKET_WIDTH];
+  uint32_t face[TRI_PACKET_WIDTH]; // index of each triangle's face in the Mesh
+
+  // Store the given triangle of face `id` in a lane.
+  void set(unsigned lane, const Triangle &tri, uint32_t id);
+
+  // Fill a lane with a degenerate triangle.
+  void clear(unsigned lane);
+};
+
+// Find the closest intersection, nearer than `hit.t`, of the ray `origin + t*dir`
+// with the triangles of `count` consecutive packets. Triangles are tested with
+// the Moller-Trumbore algorithm; of several equally close hits, the first one
+// in packet order is taken. Returns true if `hit` was updated.
+bool intersect_tri_packets(const TriPacket *packets, unsigned count,
+    const glm::vec3 &origin, const glm::vec3 &dir, TriangleHit &hit);
+
+// Check whether the ray `origin + t*dir` hits any triangle of `count`
+// consecutive packets at a distance less than t_max.
+bool tri_packets_occlude(const TriPacket *packets, unsigned count,
+    const glm::vec3 &origin, const glm::vec3 &dir, float t_max);
+
+// Get the kernel used by the functions above. By default this is the widest one
+// the CPU supports. Every kernel gives exactly the same results.
+int tri_kernel();
+
+// Select the kernel to use. Returns false, leaving the kernel unchanged, if the
+// CPU or the build does not support it.
+bool set_tri_kernel(int kernel);
+
+// Get the name of the given kernel: "scalar", "sse", or "avx".
+const char *tri_kernel_name(int kernel);
+
+#endif /* TRI_PACKET_H_ */
@@ -3,6 +3,7 @@
 #include <random>
 #include <string>
 
+#include <cctype>
 #include <cstdlib>
 #include <ctime>
 
@@ -106,6 +107,8 @@ uint32_t randi() {
   return rand_engine();
 }
 
+uint32_t RNG::_seed = 0;
+
 glm::vec3 apply_homog(const glm::mat4 &mat, const glm::vec3 &vec, int type) {
   assert(type == VEC3_DIR || type == VEC3_POINT);
 
@@ -220,7 +223,7 @@ std::string dirname(const std::string &path) {
   }
 
   unsigned end;
-  for (end = path.size(); end >= 0; --end) {
+  for (end = path.size(); end > 0; --end) {
     if (path[end-1] == '/' || path[end-1] == '\\') {
       break;
     }
@@ -237,6 +240,19 @@ std::string dirname(const std::string &path) {
   return path.substr(0, end);
 }
 
+std::string file_extension(const std::string &path) {
+  size_t dot = path.find_last_of("./\\");
+  if (dot == std::string::npos || path[dot] != '.') {
+    return std::string();
+  }
+
+  std::string ext = path.substr(dot + 1);
+  for (unsigned i = 0; i < ext.size(); ++i) {
+    ext[i] = tolower(ext[i]);
+  }
+  return ext;
+}
+
 glm::vec3 parse_vec3(const std::vector<std::string> &tokens, unsigned start_idx) {
   if (tokens.size() - start_idx < 3) {
     glerr() << "ERROR: insufficient components for 3-vector" << std::endl;
@@ -14,6 +14,8 @@
 
 #include <glm/glm.hpp>
 
+#include "rng.h"
+
 #ifdef UNIX
 template <typename T>
 static inline T min(T x, T y) {
@@ -46,17 +48,19 @@ void handle_shader_error(const char *msg, GLuint shader, bool warn = false);
 // errors were detected.
 void handle_program_error(const char *msg, GLuint program, bool warn = false);
 
-// Generate a random floating-point value in the range 0 to 1.
+// Generate a random floating-point value in the range 0 to 1. These draw from
+// one global generator and are not thread safe; rendering draws from per-pixel
+// RNG streams instead.
 double randf();
 
 // Generate a random integer.
 uint32_t randi();
 
 // Generate a random vector in the [-1, 1] cube centered at the origin.
-static inline glm::vec3 rand_vec() {
-  float x = 2*randf() - 1.0,
-        y = 2*randf() - 1.0,
-        z = 2*randf() - 1.0;
+static inline glm::vec3 rand_vec(RNG &rng) {
+  float x = 2*rng.randf() - 1.0,
+        y = 2*rng.randf() - 1.0,
+        z = 2*rng.randf() - 1.0;
   return glm::vec3(x, y, z);
 }
 
@@ -67,15 +71,15 @@ static inline glm::vec3 unit_vec_from_angles(float theta, float phi) {
 }
 
 // Generate a uniform random vector on the unit sphere centered at the origin.
-static inline glm::vec3 rand_unit_vec() {
-  return unit_vec_from_angles(2*PI*randf(), PI*randf());
+static inline glm::vec3 rand_unit_vec(RNG &rng) {
+  return unit_vec_from_angles(2*PI*rng.randf(), PI*rng.randf());
 }
 
 // Generate uniform random barycentric coordinates (three non-negative numbers
 // that sum to 1).
-static inline glm::vec3 rand_barycentric() {
-  double r1 = randf();
-  double sqrt_r2 = sqrt(randf());
+static inline glm::vec3 rand_barycentric(RNG &rng) {
+  double r1 = rng.randf();
+  double sqrt_r2 = sqrt(rng.randf());
 
   return glm::vec3(float(1 - sqrt_r2), float(sqrt_r2*(1.0 - r1)), float(r1*sqrt_r2));
 }
@@ -119,6 +123,10 @@ std::string strip(const std::string &str, const char *trailing = " \t\n");
 // directory, outputs ".".
 std::string dirname(const std::string &path);
 
+// Return the extension of the given file name, after the last '.', in lower
+// case. If there is no extension, returns an empty string.
+std::string file_extension(const std::string &path);
+
 glm::vec3 parse_vec3(const std::vector<std::string> &tokens, unsigned start_idx);
 
 float parse_float(const std::vector<std::string> &tokens, unsigned idx);